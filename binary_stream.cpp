@@ -0,0 +1,416 @@
+#include "binary_stream.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+static inline size_t
+round_up_to_8(size_t n)
+{
+    return (n + 7) & ~(size_t) 7;
+}
+
+size_t
+BinaryStreamRecord::record_size() const
+{
+    switch (m_type)
+    {
+    case BSRT_KEY:
+    case BSRT_STATS:
+        return sizeof(BinaryStreamRecord);
+    case BSRT_KEY_CNT:
+        return sizeof(BinaryStreamRecord) + 8;
+    case BSRT_DVEC:
+        return sizeof(BinaryStreamRecord) + sizeof(double) * (size_t) m_aux;
+    case BSRT_QUERY:
+        return sizeof(BinaryStreamRecord) + round_up_to_8(m_aux);
+    }
+
+    return 0;
+}
+
+bool
+is_binary_stream_file(
+    const std::string &filename)
+{
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) return false;
+
+    BinaryStreamFileHeader hdr;
+    bool ret = fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+        !memcmp(hdr.m_magic, binary_stream_magic, sizeof(hdr.m_magic));
+    fclose(f);
+    return ret;
+}
+
+BinaryStreamReader::BinaryStreamReader():
+    m_base(nullptr),
+    m_size(0),
+    m_pos(0),
+    m_truncated(false)
+{}
+
+BinaryStreamReader::~BinaryStreamReader()
+{
+    close();
+}
+
+bool
+BinaryStreamReader::open(
+    const std::string &filename)
+{
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) || (uint64_t) st.st_size < sizeof(BinaryStreamFileHeader))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    void *base = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) return false;
+    (void) madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    const BinaryStreamFileHeader *hdr = (const BinaryStreamFileHeader *) base;
+    if (memcmp(hdr->m_magic, binary_stream_magic, sizeof(hdr->m_magic)) ||
+        hdr->m_version != binary_stream_version)
+    {
+        fprintf(stderr,
+            "[ERROR] %s is not a binary stream file of version %u\n",
+            filename.c_str(), binary_stream_version);
+        munmap(base, st.st_size);
+        return false;
+    }
+
+    m_base = (const char *) base;
+    m_size = st.st_size;
+    m_pos = sizeof(BinaryStreamFileHeader);
+    m_truncated = false;
+    return true;
+}
+
+void
+BinaryStreamReader::close()
+{
+    if (m_base)
+    {
+        munmap((void *) m_base, m_size);
+        m_base = nullptr;
+    }
+    m_size = 0;
+    m_pos = 0;
+    m_truncated = false;
+}
+
+const BinaryStreamRecord*
+BinaryStreamReader::next()
+{
+    if (m_pos + sizeof(BinaryStreamRecord) > m_size)
+    {
+        m_truncated = m_pos != m_size;
+        return nullptr;
+    }
+
+    const BinaryStreamRecord *rec = (const BinaryStreamRecord *)(m_base + m_pos);
+    size_t rec_size = rec->record_size();
+    if (rec_size == 0 || m_pos + rec_size > m_size)
+    {
+        m_truncated = true;
+        return nullptr;
+    }
+
+    m_pos += rec_size;
+    return rec;
+}
+
+const BinaryStreamRecord*
+BinaryStreamReader::find_first_dvec() const
+{
+    uint64_t pos = sizeof(BinaryStreamFileHeader);
+    while (pos + sizeof(BinaryStreamRecord) <= m_size)
+    {
+        const BinaryStreamRecord *rec = (const BinaryStreamRecord *)(m_base + pos);
+        size_t rec_size = rec->record_size();
+        if (rec_size == 0 || pos + rec_size > m_size) break;
+        if (rec->m_type == BSRT_DVEC) return rec;
+        pos += rec_size;
+    }
+
+    return nullptr;
+}
+
+////////////////////////////////////////
+//         text to binary             //
+////////////////////////////////////////
+
+namespace {
+
+enum InputType
+{
+    IT_UINT32,
+    IT_IP,
+    IT_MATRIX
+};
+
+bool
+write_record(
+    FILE *f,
+    BinaryStreamRecordType type,
+    uint32_t aux,
+    TIMESTAMP ts,
+    const void *payload,
+    size_t payload_len)
+{
+    static const char zeros[8] = {0};
+
+    BinaryStreamRecord rec;
+    rec.m_type = type;
+    rec.m_aux = aux;
+    rec.m_ts = ts;
+    if (fwrite(&rec, sizeof(rec), 1, f) != 1) return false;
+    if (payload_len)
+    {
+        if (fwrite(payload, 1, payload_len, f) != payload_len) return false;
+        size_t padding = round_up_to_8(payload_len) - payload_len;
+        if (padding && fwrite(zeros, 1, padding, f) != padding) return false;
+    }
+
+    return true;
+}
+
+// Returns the number of whitespace separated fields in str.
+int
+count_fields(
+    const char *s)
+{
+    int n = 0;
+    for (;*s;)
+    {
+        while (std::isspace(*s)) ++s;
+        if (*s)
+        {
+            ++n;
+            while (*s && !std::isspace(*s)) ++s;
+        }
+    }
+    return n;
+}
+
+} // anonymous namespace
+
+int
+parse_key_and_count(
+    bool input_is_ip,
+    const char *str,
+    uint32_t &key,
+    int &cnt)
+{
+    char *end;
+    if (input_is_ip)
+    {
+        while (std::isspace(*str)) ++str;
+        char ip_str[17];
+        strncpy(ip_str, str, 16);
+        ip_str[16] = '\0';
+
+        struct in_addr ip;
+        if (!inet_aton(ip_str, &ip))
+        {
+            return 1;
+        }
+        key = (uint32_t) ip.s_addr;
+        while (*str && !std::isspace(*str)) ++str;
+    }
+    else
+    {
+        key = (uint32_t) strtoul(str, &end, 0);
+        if (end == str)
+        {
+            return 1;
+        }
+        str = end;
+    }
+
+    long c = strtol(str, &end, 0);
+    if (end == str)
+    {
+        cnt = 1;
+    }
+    else if (c <= 0 || c > INT32_MAX)
+    {
+        return 1;
+    }
+    else
+    {
+        cnt = (int) c;
+    }
+    return 0;
+}
+
+int
+convert_text_to_binary_stream(
+    const std::string &input_type_str,
+    const std::string &text_filename,
+    const std::string &binary_filename)
+{
+    InputType input_type;
+    if (input_type_str == "uint32")
+    {
+        input_type = IT_UINT32;
+    }
+    else if (input_type_str == "IP")
+    {
+        input_type = IT_IP;
+    }
+    else if (input_type_str == "matrix")
+    {
+        input_type = IT_MATRIX;
+    }
+    else
+    {
+        fprintf(stderr,
+            "[ERROR] Invalid input type: %s (uint32, IP or matrix required)\n",
+            input_type_str.c_str());
+        return 1;
+    }
+
+    std::ifstream fin(text_filename);
+    if (!fin)
+    {
+        std::cerr << "[ERROR] unable to open " << text_filename << std::endl;
+        return 1;
+    }
+
+    FILE *fout = fopen(binary_filename.c_str(), "wb");
+    if (!fout)
+    {
+        std::cerr << "[ERROR] unable to open " << binary_filename << std::endl;
+        return 1;
+    }
+
+    BinaryStreamFileHeader hdr;
+    memcpy(hdr.m_magic, binary_stream_magic, sizeof(hdr.m_magic));
+    hdr.m_version = binary_stream_version;
+    hdr.m_reserved = 0;
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fout) == 1;
+
+    std::string line;
+    std::vector<double> dvec;
+    int n = 0; // matrix dimension, determined by the first update line
+    uint64_t lineno = 0;
+    uint64_t n_data = 0;
+    while (ok && std::getline(fin, line))
+    {
+        ++lineno;
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        TIMESTAMP ts;
+        char *pc_arg_start;
+        if (line[0] == '?')
+        {
+            ts = (TIMESTAMP) strtoull(line.c_str() + 2, &pc_arg_start, 0);
+            size_t len = strlen(pc_arg_start) + 1;
+            ok = write_record(fout, BSRT_QUERY, (uint32_t) len, ts,
+                pc_arg_start, len);
+        }
+        else if (line[0] == '+')
+        {
+            ok = write_record(fout, BSRT_STATS, 0, 0, nullptr, 0);
+        }
+        else
+        {
+            ts = (TIMESTAMP) strtoull(line.c_str(), &pc_arg_start, 0);
+            if (input_type == IT_MATRIX)
+            {
+                if (n == 0)
+                {
+                    n = count_fields(pc_arg_start);
+                    if (n == 0)
+                    {
+                        std::cerr << "[ERROR] Unable to determine matrix dimension"
+                            << std::endl;
+                        fclose(fout);
+                        return 1;
+                    }
+                    dvec.resize(n);
+                }
+
+                const char *s = pc_arg_start;
+                bool malformatted = false;
+                for (int i = 0; i < n; ++i)
+                {
+                    char *s2;
+                    dvec[i] = strtod(s, &s2);
+                    if (s2 == s || (dvec[i] == HUGE_VAL))
+                    {
+                        malformatted = true;
+                        break;
+                    }
+                    s = s2;
+                }
+                if (malformatted)
+                {
+                    fprintf(stderr,
+                        "[WARN] malformatted line on %lu\n",
+                        lineno);
+                    continue;
+                }
+
+                ok = write_record(fout, BSRT_DVEC, (uint32_t) n, ts,
+                    dvec.data(), sizeof(double) * n);
+            }
+            else
+            {
+                uint32_t key;
+                int cnt;
+                if (parse_key_and_count(input_type == IT_IP, pc_arg_start,
+                        key, cnt))
+                {
+                    fprintf(stderr,
+                        "[WARN] malformatted line on %lu\n",
+                        lineno);
+                    continue;
+                }
+
+                if (cnt == 1)
+                {
+                    ok = write_record(fout, BSRT_KEY, key, ts, nullptr, 0);
+                }
+                else
+                {
+                    int32_t cnt32 = cnt;
+                    ok = write_record(fout, BSRT_KEY_CNT, key, ts,
+                        &cnt32, sizeof(cnt32));
+                }
+            }
+            ++n_data;
+        }
+    }
+
+    if (fclose(fout) || !ok)
+    {
+        std::cerr << "[ERROR] failed to write " << binary_filename << std::endl;
+        return 1;
+    }
+
+    std::cerr << "Converted " << n_data << " data points from "
+        << lineno << " lines" << std::endl;
+    return 0;
+}
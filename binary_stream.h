@@ -0,0 +1,198 @@
+#ifndef BINARY_STREAM_H
+#define BINARY_STREAM_H
+
+// Binary stream format for driver input.
+//
+// A binary stream file starts with a BinaryStreamFileHeader and is followed by
+// a sequence of records. Each record starts with a 16-byte
+// BinaryStreamRecord header, optionally followed by a payload. Records are
+// always 8-byte aligned so that the payload of a BSRT_DVEC record can be
+// directly passed to the sketches as a double array out of the memory map.
+//
+// Record types:
+//  - BSRT_KEY:     (ts, key), count = 1, no payload
+//  - BSRT_KEY_CNT: (ts, key, count), an int32_t count padded to 8 bytes
+//  - BSRT_DVEC:    (ts, dvec), m_aux is the dimension n, followed by n doubles
+//  - BSRT_QUERY:   a '?' line, m_aux is the length of the query argument
+//                  string (including the terminating NUL) that follows, padded
+//                  to 8 bytes. The argument string is passed to
+//                  parse_query_arg() as is.
+//  - BSRT_STATS:   a '+' line, no payload
+//
+// Comment lines in the text format are dropped during the conversion.
+// All integers are in host byte order.
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+typedef unsigned long long TIMESTAMP;
+
+constexpr const char        binary_stream_magic[8] = "ATTPBIN";
+
+constexpr uint32_t          binary_stream_version = 1;
+
+struct BinaryStreamFileHeader
+{
+    char                    m_magic[8];
+
+    uint32_t                m_version;
+
+    uint32_t                m_reserved;
+};
+
+enum BinaryStreamRecordType: uint32_t
+{
+    BSRT_KEY = 1,
+    BSRT_KEY_CNT = 2,
+    BSRT_DVEC = 3,
+    BSRT_QUERY = 4,
+    BSRT_STATS = 5
+};
+
+struct BinaryStreamRecord
+{
+    uint32_t                m_type;
+
+    uint32_t                m_aux; // key, dimension or query arg length
+
+    TIMESTAMP               m_ts;
+
+    const void*
+    payload() const
+    {
+        return (const void*)(this + 1);
+    }
+
+    uint32_t
+    key() const
+    {
+        return m_aux;
+    }
+
+    int
+    count() const
+    {
+        return (m_type == BSRT_KEY_CNT) ? *(const int32_t*) payload() : 1;
+    }
+
+    const double*
+    dvec() const
+    {
+        return (const double*) payload();
+    }
+
+    uint32_t
+    dim() const
+    {
+        return m_aux;
+    }
+
+    const char*
+    query_arg() const
+    {
+        return (const char*) payload();
+    }
+
+    size_t
+    record_size() const;
+};
+
+static_assert(sizeof(BinaryStreamFileHeader) == 16);
+static_assert(sizeof(BinaryStreamRecord) == 16);
+
+// Returns true if the file starts with the binary stream magic.
+bool
+is_binary_stream_file(
+    const std::string &filename);
+
+// Maps a binary stream file into memory and iterates through its records
+// without copying.
+class BinaryStreamReader
+{
+public:
+    BinaryStreamReader();
+
+    ~BinaryStreamReader();
+
+    bool
+    open(
+        const std::string &filename);
+
+    void
+    close();
+
+    bool
+    is_open() const
+    {
+        return m_base != nullptr;
+    }
+
+    // Returns nullptr at the end of the file or if the next record is
+    // truncated. The returned pointer is valid until close().
+    const BinaryStreamRecord*
+    next();
+
+    // Returns the first dvec record or nullptr if there is none. Does not
+    // change the current position.
+    const BinaryStreamRecord*
+    find_first_dvec() const;
+
+    uint64_t
+    bytes_read() const
+    {
+        return m_pos;
+    }
+
+    uint64_t
+    file_size() const
+    {
+        return m_size;
+    }
+
+    bool
+    is_truncated() const
+    {
+        return m_truncated;
+    }
+
+private:
+    const char                  *m_base;
+
+    uint64_t                    m_size;
+
+    uint64_t                    m_pos;
+
+    bool                        m_truncated;
+};
+
+// Parses the argument of an update line of uint32 or IP (if input_is_ip)
+// inputs, which is a key optionally followed by a positive count (1 if
+// omitted). Shared by the text input path of the driver and the conversion
+// to binary streams, so both read a line the same way.
+//
+// Returns 0 on success and non-zero if the key is missing or malformatted or
+// the count is not positive.
+int
+parse_key_and_count(
+    bool input_is_ip,
+    const char *str,
+    uint32_t &key,
+    int &cnt);
+
+// Converts a text input file to a binary stream file.
+//
+// input_type is one of "uint32", "IP" or "matrix", which determines how the
+// update lines are parsed (same as HH.input_type; "matrix" for the
+// matrix_sketch query). An optional count may follow the key on an update line
+// of uint32/IP inputs, see parse_key_and_count().
+//
+// Returns 0 on success and prints an error message to stderr and returns
+// non-zero otherwise.
+int
+convert_text_to_binary_stream(
+    const std::string &input_type,
+    const std::string &text_filename,
+    const std::string &binary_filename);
+
+#endif // BINARY_STREAM_H
@@ -0,0 +1,154 @@
+#ifndef CHUNKED_ARRAY_H
+#define CHUNKED_ARRAY_H
+
+#include <vector>
+#include <cstdint>
+#include <cassert>
+#include <algorithm>
+
+// An append-only array of chunks of (1 << ChunkShift) elements.
+// Elements are never moved and chunks are kept on clear().
+template<class T, unsigned ChunkShift>
+class ChunkedArray {
+    public:
+        static constexpr uint32_t chunk_size = 1u << ChunkShift;
+
+        ChunkedArray(): m_chunks(), m_size(0) {}
+
+        ~ChunkedArray() {
+            for (T *chunk: m_chunks) {
+                delete []chunk;
+            }
+        }
+
+        ChunkedArray(const ChunkedArray&) = delete;
+        ChunkedArray& operator=(const ChunkedArray&) = delete;
+
+        T &operator[](uint32_t off) {
+            return m_chunks[off >> ChunkShift][off & (chunk_size - 1)];
+        }
+
+        const T &operator[](uint32_t off) const {
+            return m_chunks[off >> ChunkShift][off & (chunk_size - 1)];
+        }
+
+        uint32_t size() const { return m_size; }
+
+        uint32_t push_back(const T &t) {
+            uint32_t off = m_size++;
+            if ((off >> ChunkShift) == m_chunks.size()) {
+                m_chunks.push_back(new T[chunk_size]);
+            }
+            (*this)[off] = t;
+            return off;
+        }
+
+        void pop_back() { --m_size; }
+
+        void clear() { m_size = 0; }
+
+        unsigned long long memory_usage() const {
+            return m_chunks.capacity() * sizeof(T*) +
+                m_chunks.size() * chunk_size * sizeof(T);
+        }
+
+    private:
+        std::vector<T*> m_chunks;
+
+        uint32_t        m_size;
+};
+
+// Growable arrays of uint32_t offsets (e.g., the blocks of a cell in a
+// ChunkedArray) in one shared pool. An array lives in a block of the pool
+// whose size is a power of two and moves to a block twice as large when it
+// is full. Freed blocks are reused through per-size free lists.
+//
+// The owner of an array keeps its block, size class and size, where block
+// is invalid_offset if nothing has been appended to it.
+class OffsetListPool {
+    public:
+        static constexpr uint32_t invalid_offset = ~(uint32_t) 0;
+
+        OffsetListPool(): m_pool() {
+            clear();
+        }
+
+        void clear() {
+            m_pool.clear();
+            std::fill(m_free_list, m_free_list + num_size_classes,
+                invalid_offset);
+        }
+
+        const uint32_t *data(uint32_t block) const {
+            return m_pool.data() + block;
+        }
+
+        uint32_t &at(uint32_t block, uint32_t i) {
+            return m_pool[block + i];
+        }
+
+        uint32_t at(uint32_t block, uint32_t i) const {
+            return m_pool[block + i];
+        }
+
+        // Appends off to the array of size n in block of size_class, which
+        // are updated if the array moves.
+        void push_back(
+            uint32_t &block,
+            uint8_t &size_class,
+            uint32_t n,
+            uint32_t off)
+        {
+            // grow the block by doubling its size if it is full
+            uint32_t capacity = (block == invalid_offset) ? 0 :
+                (1u << (min_block_shift + size_class));
+            if (n == capacity) {
+                unsigned new_size_class = (capacity == 0) ? 0 : size_class + 1;
+                uint32_t new_block = alloc_block(new_size_class);
+                if (capacity != 0) {
+                    std::copy(m_pool.begin() + block,
+                        m_pool.begin() + block + n,
+                        m_pool.begin() + new_block);
+                    free_block(block, size_class);
+                }
+                block = new_block;
+                size_class = (uint8_t) new_size_class;
+            }
+            m_pool[block + n] = off;
+        }
+
+        unsigned long long memory_usage() const {
+            return m_pool.capacity() * sizeof(uint32_t);
+        }
+
+    private:
+        static constexpr unsigned min_block_shift = 1;
+        static constexpr unsigned num_size_classes = 32;
+
+        std::vector<uint32_t> m_pool;
+
+        // heads of the free lists of blocks of size
+        // 1 << (min_block_shift + k), linked through their first entry
+        uint32_t m_free_list[num_size_classes];
+
+        uint32_t alloc_block(unsigned size_class) {
+            assert(size_class < num_size_classes);
+            uint32_t block = m_free_list[size_class];
+            if (block != invalid_offset) {
+                m_free_list[size_class] = m_pool[block];
+                return block;
+            }
+
+            block = (uint32_t) m_pool.size();
+            m_pool.resize(m_pool.size() +
+                ((size_t) 1 << (min_block_shift + size_class)));
+            return block;
+        }
+
+        void free_block(uint32_t block, unsigned size_class) {
+            m_pool[block] = m_free_list[size_class];
+            m_free_list[size_class] = block;
+        }
+};
+
+#endif // CHUNKED_ARRAY_H
@@ -33,6 +33,7 @@ DEFINE_CONFIG_ENTRY(EXACT_HH.enabled, boolean, true, false, false)
 DEFINE_CONFIG_ENTRY(SAMPLING.enabled, boolean, true, false, false)
 DEFINE_CONFIG_ENTRY(SAMPLING.sample_size, u32, SAMPLING.enabled, true, , true, 1u)
 DEFINE_CONFIG_ENTRY(SAMPLING.seed, u32, SAMPLING.enabled, false, 19950810u)
+DEFINE_CONFIG_ENTRY(SAMPLING.skip_counting, boolean, true, false, false) // Algorithm L; draws different samples than the default
 
 // uniform sampling sketch BITP
 DEFINE_CONFIG_ENTRY(SAMPLING_BITP.enabled, boolean, true, false, false)
@@ -47,15 +48,27 @@ DEFINE_CONFIG_ENTRY(PCM_HH.epsilon, double, PCM_HH.enabled, true, , false, 0, fa
 DEFINE_CONFIG_ENTRY(PCM_HH.delta, double, PCM_HH.enabled, true, , false, 0, false, 1)
 DEFINE_CONFIG_ENTRY(PCM_HH.Delta, double, PCM_HH.enabled, true, , false, 0)
 DEFINE_CONFIG_ENTRY(PCM_HH.seed, u32, PCM_HH.enabled, false, 19950810u)
+DEFINE_CONFIG_ENTRY(PCM_HH.pla_mode, string, true, false, "swing") // swing or optimal
+DEFINE_CONFIG_ENTRY(PCM_HH.num_query_threads, u32, true, false, 1u, true, 1u, true, 256u) // per level of the descent
 
 // Chain Misra Gries
 DEFINE_CONFIG_ENTRY(CMG.enabled, boolean, true, false, false)
 DEFINE_CONFIG_ENTRY(CMG.epsilon, double, CMG.enabled, true, , false, 0, false, 1)
 DEFINE_CONFIG_ENTRY(CMG.use_update_new, boolean, CMG.enabled, true, true)
+DEFINE_CONFIG_ENTRY(CMG.point_query_index, boolean, true, false, false) // per-key history index for estimate_frequency()
 
 // Tree Misra Gries
 DEFINE_CONFIG_ENTRY(TMG.enabled, boolean, true, false, false)
 DEFINE_CONFIG_ENTRY(TMG.epsilon, double, TMG.enabled, true, , false, 0, false, 1)
+DEFINE_CONFIG_ENTRY(TMG.prefix_cache_size, u32, true, false, 8u) // max cached prefix merges, 0 to disable
+
+// Sharded Misra Gries over CMG or TMG
+DEFINE_CONFIG_ENTRY(SMG.enabled, boolean, true, false, false)
+DEFINE_CONFIG_ENTRY(SMG.shard_sketch, string, SMG.enabled, false, "CMG") // CMG or TMG
+DEFINE_CONFIG_ENTRY(SMG.epsilon, double, SMG.enabled, true, , false, 0, false, 1)
+DEFINE_CONFIG_ENTRY(SMG.num_shards, u32, SMG.enabled, true, , true, 1u)
+DEFINE_CONFIG_ENTRY(SMG.num_threads, u32, true, false, 0u) // 0 for one thread per shard
+DEFINE_CONFIG_ENTRY(SMG.full_epsilon_per_shard, boolean, true, false, false) // epsilon rather than epsilon * num_shards per shard, at up to num_shards times the memory
 
 // Don't use, for debugging only
 DEFINE_CONFIG_ENTRY(DUMMY_PMG.enabled, boolean, true, false, false)
@@ -64,6 +77,7 @@ DEFINE_CONFIG_ENTRY(DUMMY_PMG.epsilon, double, DUMMY_PMG.enabled, true, , false,
 // Tree Misra Gries (BITP)
 DEFINE_CONFIG_ENTRY(TMG_BITP.enabled, boolean, true, false, false)
 DEFINE_CONFIG_ENTRY(TMG_BITP.epsilon, double, TMG_BITP.enabled, true, , false, 0, false, 1)
+DEFINE_CONFIG_ENTRY(TMG_BITP.merge_in_background, boolean, true, false, true) // maintain the tree on a worker thread if there are 2+ cores
 
 // Persistent AMSketch (for frequency estimation)
 DEFINE_CONFIG_ENTRY(PAMS.enabled, boolean, true, false, false)
@@ -78,6 +92,7 @@ DEFINE_CONFIG_ENTRY(PCM.epsilon, double, PCM.enabled, true, , false, 0, false, 1
 DEFINE_CONFIG_ENTRY(PCM.delta, double, PCM.enabled, true, , false, 0, false, 1)
 DEFINE_CONFIG_ENTRY(PCM.Delta, double, PCM.enabled, true, , false, 0)
 DEFINE_CONFIG_ENTRY(PCM.seed, u32, true, false, 19950810u)
+DEFINE_CONFIG_ENTRY(PCM.pla_mode, string, true, false, "swing") // swing or optimal
 
 // Test matrix sketch (ATTP)
 DEFINE_CONFIG_ENTRY(MS.dimension, u32, true, false, , true, 1)
@@ -91,11 +106,13 @@ DEFINE_CONFIG_ENTRY(EXACT_MS.enabled, boolean, true, false, false)
 DEFINE_CONFIG_ENTRY(NORM_SAMPLING.enabled, boolean, true, false, false)
 DEFINE_CONFIG_ENTRY(NORM_SAMPLING.sample_size, u32, NORM_SAMPLING.enabled, true, , true, 1u)
 DEFINE_CONFIG_ENTRY(NORM_SAMPLING.seed, u32, true, false, 19950810u)
+DEFINE_CONFIG_ENTRY(NORM_SAMPLING.row_storage, string, true, false, "double") // double, float or bfloat16
 
 // norm sampling w/ replacement
 DEFINE_CONFIG_ENTRY(NORM_SAMPLING_WR.enabled, boolean, true, false, false)
 DEFINE_CONFIG_ENTRY(NORM_SAMPLING_WR.sample_size, u32, NORM_SAMPLING_WR.enabled, true, , true, 1u)
 DEFINE_CONFIG_ENTRY(NORM_SAMPLING_WR.seed, u32, true, false, 19950810u)
+DEFINE_CONFIG_ENTRY(NORM_SAMPLING_WR.row_storage, string, true, false, "double") // double, float or bfloat16
 
 // ATTP FD
 DEFINE_CONFIG_ENTRY(PFD.enabled, boolean, true, false, false)
@@ -103,6 +120,9 @@ DEFINE_CONFIG_ENTRY(PFD.half_sketch_size, u32, PFD.enabled, true, , true, 1)
 
 // misc settings
 DEFINE_CONFIG_ENTRY(perf.measure_time, boolean, true, false, false)
+DEFINE_CONFIG_ENTRY(perf.update_batch_size, u32, true, false, 256u, true, 1u) // 1 to disable batching
+DEFINE_CONFIG_ENTRY(perf.num_update_threads, u32, true, false, 0u) // 0 to update the sketches on the parser thread
+DEFINE_CONFIG_ENTRY(perf.update_pipeline_depth, u32, true, false, 4u, true, 2u) // number of batches in flight
 DEFINE_CONFIG_ENTRY(misc.suppress_progress_bar, boolean, true, false, false)
 DEFINE_CONFIG_ENTRY(misc.fftw3.import_wisdom, boolean, true, false, true)
 DEFINE_CONFIG_ENTRY(misc.fftw3.export_wisdom, boolean, true, false, true)
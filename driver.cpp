@@ -5,6 +5,7 @@
 #include "misra_gries.h"
 #include "sketch_lib.h"
 #include "query.h"
+#include "binary_stream.h"
 
 //using namespace std;
 
@@ -19,6 +20,9 @@ void print_new_help(const char *progname)
     {
         std::cerr<< "usage: " << progname << " run <ConfigFile>" << std::endl;
         std::cerr<< "usage: " << progname << " help <QueryType>" << std::endl;
+        std::cerr<< "usage: " << progname << " convert <InputType> <TextFile> <BinaryFile>" << std::endl;
+        std::cerr<< "\tconverts a text input file to the binary stream format, where" << std::endl;
+        std::cerr<< "\t<InputType> is one of uint32, IP or matrix" << std::endl;
     }
     std::cerr << "Available query types:" << std::endl;
     std::cerr << "\theavy_hitter" << std::endl;
@@ -100,6 +104,19 @@ main(int argc, char *argv[])
                 << sketch_type_to_altname(st) << ')' << std::endl;
         }
     }
+    else if (!strcmp(command, "convert"))
+    {
+        if (argc < 5)
+        {
+            print_new_help(progname);
+            return 1;
+        }
+
+        const char *input_type = argv[argi++];
+        const char *text_file = argv[argi++];
+        const char *binary_file = argv[argi++];
+        return convert_text_to_binary_stream(input_type, text_file, binary_file);
+    }
     else
     {
         print_new_help(progname);
@@ -11,9 +11,83 @@ extern "C"
 }
 #include <cassert>
 #include <cstring>
+#include <cmath>
 
 using namespace std;
 
+// Buffers and LAPACK work arrays for the SVDs of FD sketches with the same l
+// and d. They're allocated on the first use and reused afterwards, so
+// shrinking a sketch doesn't allocate.
+//
+// If 2l is much smaller than d, the SVD of the 2l x d sketch B is computed
+// from the eigen-decomposition B B^T = U diag(lambda) U^T of its 2l x 2l
+// Gram matrix: the singular values are sqrt(lambda) and the right singular
+// vectors are the rows of diag(1 / sqrt(lambda)) U^T B. Otherwise, it's an
+// economy SVD of B.
+class FDWorkspace {
+    uint32_t l;
+    uint32_t d;
+    uint32_t mn; // min(2l, d)
+    bool use_gram;
+    bool allocated;
+
+    // singular values or eigenvalues
+    std::vector<double> S;
+
+    // the Gram matrix and then its eigenvectors, or U of the SVD
+    std::vector<double> U;
+
+    // the rows of the shrunk sketch, or VT of the SVD
+    std::vector<double> VT;
+
+    // Gram path only: diag(shrunk / original singular values) U^T
+    std::vector<double> W;
+
+    // the sketch rows passed to an SVD that destroys its input
+    double *out;
+
+    std::vector<double> work;
+    std::vector<lapack_int> iwork;
+
+    // the smallest d / 2l that uses the Gram matrix
+    static constexpr uint32_t min_gram_aspect_ratio = 4;
+
+public:
+    FDWorkspace(uint32_t _l, uint32_t _d) :
+        l(_l),
+        d(_d),
+        mn(std::min(2 * _l, _d)),
+        use_gram(_d >= min_gram_aspect_ratio * 2 * _l),
+        allocated(false),
+        S(), U(), VT(), W(),
+        out(nullptr),
+        work(),
+        iwork() {
+    }
+
+    ~FDWorkspace() {
+        delete []out;
+    }
+
+    FDWorkspace(const FDWorkspace&) = delete;
+    FDWorkspace &operator=(const FDWorkspace&) = delete;
+
+    // Shrinks the full 2l x d sketch B (col-major), which may be swapped
+    // with a buffer of the same size, and returns the number of non-zero
+    // rows left at its top.
+    uint32_t shrink(double *&B);
+
+    // Returns the squared largest singular value of the 2l x d sketch B.
+    double top_singular_value_sqr(const double *B);
+
+private:
+    void allocate();
+
+    // Computes the eigenvalues (ascending) of B B^T into S, and its
+    // eigenvectors into U if jobz is 'V'.
+    void gram_eig(char jobz, const double *B);
+};
+
 // fast-FD impl.
 class FD {
     uint32_t d;
@@ -51,62 +125,9 @@ public:
         first_zero_line = 0;
     }
 
-    void update(const double *row) {
+    void update(const double *row, FDWorkspace &ws) {
         if (first_zero_line == 2 * l) {
-            double *S = new double[std::min(2 * l, d)];
-            double *U = new double[2 * l * 2 * l];
-            double *VT = new double[d * d];
-
-#       ifdef NDEBUG
-            (void)
-#       else
-            lapack_int info =
-#       endif
-            LAPACKE_dgesdd(
-                LAPACK_COL_MAJOR,
-                'A',
-                2 * l,
-                d,
-                &B[0],
-                2 * l, // LDA
-                S,
-                U,
-                2 * l, // LDU
-                VT,
-                d); // LDVT
-            /*if (info != 0) {
-                LAPACKE_xerbla("dgesdd", info);        
-                std::cout << 2 * l << ' ' << d << std::endl;
-                std::cout << LAPACKE_dge_nancheck(
-                    LAPACK_COL_MAJOR,
-                    2 * l,
-                    d,
-                    &B[0],
-                    2 * l) << std::endl;
-            } */
-            assert(!info);
-    
-            memset(B, 0, sizeof(double) * 2 * l * d);
-            double epsilon = S[l - 1] * S[l - 1];
-            for (first_zero_line = 0; first_zero_line < l - 1; ++first_zero_line) {
-                S[first_zero_line] =
-                    std::sqrt(S[first_zero_line] * S[first_zero_line] - epsilon);
-                if (S[first_zero_line] == 0) {
-                    break;
-                }
-            }
-            
-            for (uint32_t j = 0; j < d; ++j) {
-                auto idx = j * 2 * l;
-                auto idx2 = j * d;
-                for (uint32_t i = 0; i < first_zero_line; ++i) {
-                    B[idx++] = S[i] * VT[idx2++];
-                }
-            }
-        
-            delete []S;
-            delete []U;
-            delete []VT;
+            first_zero_line = ws.shrink(B);
         }
 
         assert(first_zero_line < 2 * l); 
@@ -146,6 +167,10 @@ public:
         memcpy(B_out, B, sizeof(double) * 2 * l * d);
     }
 
+    double top_singular_value_sqr(FDWorkspace &ws) const {
+        return ws.top_singular_value_sqr(B);
+    }
+
     size_t memory_usage() const {
         return sizeof(FD) + sizeof(double) * 2 * l * d;
     }
@@ -170,6 +195,146 @@ public:
     }
 };
 
+void FDWorkspace::allocate() {
+    lapack_int n2 = (lapack_int) (2 * l);
+    double lwork_query[2];
+    lapack_int liwork_query[2];
+    // not referenced by the workspace queries
+    double dummy = 0;
+    lapack_int idummy = 0;
+
+    S.resize(std::max(mn, 2 * l));
+    if (use_gram) {
+        U.resize((size_t) 2 * l * 2 * l);
+        W.resize((size_t) 2 * l * 2 * l);
+        for (int k = 0; k < 2; ++k) {
+            LAPACKE_dsyevd_work(LAPACK_COL_MAJOR, (k == 0) ? 'V' : 'N', 'U',
+                n2, &dummy, n2, &dummy,
+                &lwork_query[k], -1, &liwork_query[k], -1);
+        }
+    } else {
+        U.resize((size_t) 2 * l * mn);
+        VT.resize((size_t) mn * d);
+        for (int k = 0; k < 2; ++k) {
+            LAPACKE_dgesdd_work(LAPACK_COL_MAJOR, (k == 0) ? 'S' : 'N',
+                n2, (lapack_int) d, &dummy, n2, &dummy,
+                &dummy, n2, &dummy, (lapack_int) mn,
+                &lwork_query[k], -1, &idummy);
+        }
+        liwork_query[0] = liwork_query[1] = (lapack_int) (8 * mn);
+    }
+    out = new double[(size_t) 2 * l * d];
+    work.resize((size_t) std::max(lwork_query[0], lwork_query[1]));
+    iwork.resize((size_t) std::max(liwork_query[0], liwork_query[1]));
+    allocated = true;
+}
+
+void FDWorkspace::gram_eig(char jobz, const double *B) {
+    lapack_int n2 = (lapack_int) (2 * l);
+    cblas_dsyrk(CblasColMajor, CblasUpper, CblasNoTrans,
+        n2, d, 1.0, B, n2, 0.0, U.data(), n2);
+#   ifdef NDEBUG
+    (void)
+#   else
+    lapack_int info =
+#   endif
+    LAPACKE_dsyevd_work(LAPACK_COL_MAJOR, jobz, 'U',
+        n2, U.data(), n2, S.data(),
+        work.data(), (lapack_int) work.size(),
+        iwork.data(), (lapack_int) iwork.size());
+    assert(!info);
+}
+
+uint32_t FDWorkspace::shrink(double *&B) {
+    if (!allocated) allocate();
+    uint32_t n2 = 2 * l;
+
+    // the i-th largest squared singular value
+    auto sigma_sqr = [&](uint32_t i) -> double {
+        if (use_gram) {
+            return (i < n2) ? std::max(S[n2 - 1 - i], 0.0) : 0.0;
+        }
+        return (i < mn) ? S[i] * S[i] : 0.0;
+    };
+
+    if (use_gram) {
+        gram_eig('V', B);
+    } else {
+#       ifdef NDEBUG
+        (void)
+#       else
+        lapack_int info =
+#       endif
+        LAPACKE_dgesdd_work(LAPACK_COL_MAJOR, 'S',
+            (lapack_int) n2, (lapack_int) d, B, (lapack_int) n2,
+            S.data(), U.data(), (lapack_int) n2, VT.data(), (lapack_int) mn,
+            work.data(), (lapack_int) work.size(), iwork.data());
+        assert(!info);
+    }
+
+    double epsilon = sigma_sqr(l - 1);
+    uint32_t first_zero_line;
+    for (first_zero_line = 0; first_zero_line < l - 1; ++first_zero_line) {
+        if (sigma_sqr(first_zero_line) - epsilon <= 0) {
+            break;
+        }
+    }
+
+    if (use_gram) {
+        // B <- W B, where row i of W is the eigenvector of the i-th largest
+        // eigenvalue scaled by sqrt(sigma_i^2 - epsilon) / sigma_i
+        for (uint32_t i = 0; i < first_zero_line; ++i) {
+            double s2 = sigma_sqr(i);
+            double scale = std::sqrt(s2 - epsilon) / std::sqrt(s2);
+            const double *u = U.data() + (size_t) (n2 - 1 - i) * n2;
+            for (uint32_t j = 0; j < n2; ++j) {
+                W[i + (size_t) j * first_zero_line] = scale * u[j];
+            }
+        }
+        memset(out, 0, sizeof(double) * n2 * d);
+        if (first_zero_line > 0) {
+            cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans,
+                first_zero_line, d, n2,
+                1.0, W.data(), first_zero_line, B, n2,
+                0.0, out, n2);
+        }
+        // B's old content is no longer needed
+        std::swap(B, out);
+    } else {
+        memset(B, 0, sizeof(double) * n2 * d);
+        for (uint32_t j = 0; j < d; ++j) {
+            double *b = B + (size_t) j * n2;
+            const double *vt = VT.data() + (size_t) j * mn;
+            for (uint32_t i = 0; i < first_zero_line; ++i) {
+                b[i] = std::sqrt(sigma_sqr(i) - epsilon) * vt[i];
+            }
+        }
+    }
+    return first_zero_line;
+}
+
+double FDWorkspace::top_singular_value_sqr(const double *B) {
+    if (!allocated) allocate();
+    if (use_gram) {
+        gram_eig('N', B);
+        return std::max(S[2 * l - 1], 0.0);
+    }
+
+    // dgesdd destroys its input
+    memcpy(out, B, sizeof(double) * 2 * l * d);
+#   ifdef NDEBUG
+    (void)
+#   else
+    lapack_int info =
+#   endif
+    LAPACKE_dgesdd_work(LAPACK_COL_MAJOR, 'N',
+        (lapack_int) (2 * l), (lapack_int) d, out, (lapack_int) (2 * l),
+        S.data(), nullptr, (lapack_int) (2 * l), nullptr, (lapack_int) mn,
+        work.data(), (lapack_int) work.size(), iwork.data());
+    assert(!info);
+    return S[0] * S[0];
+}
+
 // FD_ATTP implementation
 
 FD_ATTP::FD_ATTP(int _l, int _d):
@@ -178,6 +343,7 @@ FD_ATTP::FD_ATTP(int _l, int _d):
     AF2(0),
     nxt_target(0),
     C(new FD(_l, _d)),
+    ws(new FDWorkspace(_l, _d)),
     partial_ckpt(),
     full_ckpt()
 {
@@ -187,6 +353,7 @@ FD_ATTP::~FD_ATTP()
 {
     clear();
     delete C;
+    delete ws;
 }
 
 void
@@ -225,86 +392,74 @@ FD_ATTP::update(
     TIMESTAMP ts,
     const double *a)
 {
-    //static unsigned long _cnt = 0;
-    //++_cnt;
-    C->update(a);
-    
-    double n2 = cblas_ddot(d, a, 1, a, 1);
-    AF2 += n2;
+    UpdateRecord_dvec record{ts, a};
+    update_batch(&record, 1);
+}
 
-    //std::cout << AF2 << std::endl;
+void
+FD_ATTP::update_batch(
+    const UpdateRecord_dvec *records,
+    size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        TIMESTAMP ts = records[i].m_ts;
+        const double *a = records[i].m_dvec;
 
-    if (AF2 * (l-1) / l < nxt_target) {
-        //std::cout << AF2 * (l - 1) / l << ' ' << nxt_target << std::endl;
-        return;
-    }
-    
-    double *CM = new double[2 * l * d];
-    double *S = new double[std::min(2 * l, d)];
-    
-    double c1_2norm_sqr;
-    for (;;) {
-        C->to_matrix(CM);
-#ifdef NDEBUG
-        (void)
-#else
-        lapack_int info =
-#endif
-        LAPACKE_dgesdd(
-            LAPACK_COL_MAJOR,
-            'N',
-            2*l,
-            d,
-            &CM[0],
-            2 * l, // LDA
-            &S[0],
-            nullptr,
-            2 * l, // LDU
-            nullptr,
-            d); // LDVT
+        //static unsigned long _cnt = 0;
+        //++_cnt;
+        C->update(a, *ws);
+        
+        double n2 = cblas_ddot(d, a, 1, a, 1);
+        AF2 += n2;
 
-        assert(!info);
+        //std::cout << AF2 << std::endl;
 
-        c1_2norm_sqr = S[0] * S[0];
-        if (c1_2norm_sqr >= AF2/l) {
-            double *row = new double[d];
-            C->pop_first(row);
-
-            uint32_t ckpt_cnt = full_ckpt.empty() ?
-                partial_ckpt.size() :
-                (partial_ckpt.size() - full_ckpt.back().next_partial_ckpt);
-            if (ckpt_cnt + 1 >= l) {
-                if (full_ckpt.empty()) {
-                    full_ckpt.push_back(FullCkpt{
-                        ts,
-                        new FD(l, d),
-                        (uint32_t) partial_ckpt.size()});
+        if (AF2 * (l-1) / l < nxt_target) {
+            //std::cout << AF2 * (l - 1) / l << ' ' << nxt_target << std::endl;
+            continue;
+        }
+        
+        double c1_2norm_sqr;
+        for (;;) {
+            c1_2norm_sqr = C->top_singular_value_sqr(*ws);
+            if (c1_2norm_sqr >= AF2/l) {
+                double *row = new double[d];
+                C->pop_first(row);
+
+                uint32_t ckpt_cnt = full_ckpt.empty() ?
+                    partial_ckpt.size() :
+                    (partial_ckpt.size() - full_ckpt.back().next_partial_ckpt);
+                if (ckpt_cnt + 1 >= l) {
+                    if (full_ckpt.empty()) {
+                        full_ckpt.push_back(FullCkpt{
+                            ts,
+                            new FD(l, d),
+                            (uint32_t) partial_ckpt.size()});
+                    } else {
+                        full_ckpt.push_back(FullCkpt{
+                            ts,
+                            new FD(*full_ckpt.back().fd),
+                            (uint32_t) partial_ckpt.size()});
+                    }
+                    auto new_fd = full_ckpt.back().fd;
+                    auto ws = this->ws;
+                    std::for_each(partial_ckpt.end() - ckpt_cnt, partial_ckpt.end(),
+                        [new_fd, ws](const PartialCkpt &p) {
+                        new_fd->update(p.row, *ws);
+                    });
+                    new_fd->update(row, *ws);
+
+                    delete []row;
                 } else {
-                    full_ckpt.push_back(FullCkpt{
-                        ts,
-                        new FD(*full_ckpt.back().fd),
-                        (uint32_t) partial_ckpt.size()});
+                    partial_ckpt.push_back(PartialCkpt{ts, row});
                 }
-                auto new_fd = full_ckpt.back().fd;
-                std::for_each(partial_ckpt.end() - ckpt_cnt, partial_ckpt.end(),
-                    [new_fd](const PartialCkpt &p) {
-                    new_fd->update(p.row);
-                });
-                new_fd->update(row);
-
-                delete []row;
             } else {
-                partial_ckpt.push_back(PartialCkpt{ts, row});
+                break;
             }
-        } else {
-            break;
         }
-    }
 
-    nxt_target = AF2 - c1_2norm_sqr;
-    
-    delete []CM;
-    delete []S;
+        nxt_target = AF2 - c1_2norm_sqr;
+    }
 }
 
 
@@ -328,8 +483,10 @@ FD_ATTP::get_covariance_matrix(
         pckpt_i = (iter-1)->next_partial_ckpt;
     }
 
+    // queries are const and don't touch ws
+    FDWorkspace query_ws(l, d);
     for (; pckpt_i < partial_ckpt.size() && partial_ckpt[pckpt_i].ts <= ts_e; ++pckpt_i) {
-        fd->update(partial_ckpt[pckpt_i].row);
+        fd->update(partial_ckpt[pckpt_i].row, query_ws);
     }
     fd->to_covariance_matrix(a);
     delete fd;
@@ -8,6 +8,7 @@
 
 // we want keep class FD private to FD_ATTP impl.
 class FD;
+class FDWorkspace;
 
 class FD_ATTP:
     public IPersistentMatrixSketch
@@ -31,6 +32,7 @@ class FD_ATTP:
     double AF2;
     double nxt_target;
     FD *C;
+    FDWorkspace *ws; // for C and the full checkpoints
     std::vector<PartialCkpt> partial_ckpt;
     std::vector<FullCkpt> full_ckpt;
 
@@ -58,6 +60,11 @@ public:
         TIMESTAMP ts,
         const double *dvec) override;
 
+    void
+    update_batch(
+        const UpdateRecord_dvec *records,
+        size_t n) override;
+
     void
     get_covariance_matrix(
         TIMESTAMP ts_e,
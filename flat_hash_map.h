@@ -0,0 +1,386 @@
+#ifndef FLAT_HASH_MAP_H
+#define FLAT_HASH_MAP_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <algorithm>
+#include <utility>
+#include <iterator>
+#include <type_traits>
+
+// An open-addressing hash map from unsigned integer keys with Robin Hood
+// linear probing. The keys, values and probe distances of the slots are
+// stored in separate arrays, so a lookup only touches the values of the
+// matching key and an insertion allocates nothing unless the table grows.
+// Erasing shifts the rest of the probe run back by one slot instead of
+// leaving a tombstone.
+//
+// The capacity is a power of two with a max load factor of 7/8. An insertion
+// that would exceed it doubles the capacity, so a table that is not reserved
+// up front grows by doubling with amortized O(1) rehashing per insertion.
+// The capacity is otherwise only changed by reset(), reserve() and
+// shrink_to_fit(). Insertions invalidate all iterators.
+//
+// erase(iter) returns an iterator to the next entry, so entries may be
+// erased while iterating from begin(): iteration starts right after an empty
+// slot and a backward shift never crosses an empty slot, so no entry is
+// moved to a slot that has already been visited. Probing and iteration wrap
+// around from the last slot to the first.
+//
+// Dereferencing an iterator yields a pair of references to the key and the
+// value of an entry rather than a reference to a stored std::pair.
+template<class Key, class Value>
+class FlatHashMap {
+    static_assert(std::is_unsigned<Key>::value && sizeof(Key) <= 8,
+        "FlatHashMap keys must be unsigned integers of at most 64 bits");
+
+    public:
+        typedef Key key_type;
+        typedef Value mapped_type;
+        typedef size_t size_type;
+
+        template<bool IsConst>
+        class basic_iterator {
+            public:
+                typedef std::forward_iterator_tag iterator_category;
+                typedef std::pair<Key, Value> value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef std::pair<const Key&,
+                    std::conditional_t<IsConst, const Value&, Value&>>
+                    reference;
+
+                struct pointer {
+                    reference m_ref;
+
+                    const reference *operator->() const { return &m_ref; }
+                };
+
+                basic_iterator(): m_map(nullptr), m_slot(npos), m_stop(npos) {}
+
+                // iterator to const_iterator
+                template<bool C = IsConst, class = std::enable_if_t<C>>
+                basic_iterator(const basic_iterator<false> &iter):
+                    m_map(iter.m_map),
+                    m_slot(iter.m_slot),
+                    m_stop(iter.m_stop) {}
+
+                reference operator*() const {
+                    return reference(m_map->m_keys[m_slot],
+                        m_map->m_values[m_slot]);
+                }
+
+                pointer operator->() const { return pointer{**this}; }
+
+                basic_iterator &operator++() {
+                    m_slot = m_map->next_occupied_slot(m_slot, m_stop);
+                    return *this;
+                }
+
+                basic_iterator operator++(int) {
+                    basic_iterator iter = *this;
+                    ++*this;
+                    return iter;
+                }
+
+                bool operator==(const basic_iterator &iter) const {
+                    return m_slot == iter.m_slot;
+                }
+
+                bool operator!=(const basic_iterator &iter) const {
+                    return m_slot != iter.m_slot;
+                }
+
+            private:
+                typedef std::conditional_t<IsConst,
+                    const FlatHashMap*, FlatHashMap*> map_pointer;
+
+                basic_iterator(map_pointer map, size_type slot, size_type stop):
+                    m_map(map), m_slot(slot), m_stop(stop) {}
+
+                map_pointer m_map;
+
+                // current slot, or npos at the end
+                size_type   m_slot;
+
+                // the (empty) slot where the iteration ends
+                size_type   m_stop;
+
+                friend class FlatHashMap;
+
+                friend class basic_iterator<!IsConst>;
+        };
+
+        typedef basic_iterator<false> iterator;
+        typedef basic_iterator<true> const_iterator;
+
+        explicit FlatHashMap(size_type expected_size = 0):
+            m_keys(),
+            m_values(),
+            m_dist(),
+            m_size(0),
+            m_shift(64)
+        {
+            reset(expected_size);
+        }
+
+        size_type size() const { return m_size; }
+
+        bool empty() const { return m_size == 0; }
+
+        size_type capacity() const { return m_dist.size(); }
+
+        // Removes all entries but keeps the capacity.
+        void clear() {
+            if (m_size == 0) return;
+            std::fill(m_dist.begin(), m_dist.end(), (uint8_t) 0);
+            m_size = 0;
+        }
+
+        // Removes all entries and sets the capacity for expected_size
+        // entries.
+        void reset(size_type expected_size) {
+            m_size = 0;
+            allocate(capacity_for(expected_size));
+        }
+
+        // Grows the table if needed to hold n entries without rehashing.
+        void reserve(size_type n) {
+            if (capacity_for(n) > capacity()) {
+                rehash(capacity_for(n));
+            }
+        }
+
+        // Shrinks the table to the smallest capacity that holds the entries.
+        void shrink_to_fit() {
+            if (capacity_for(m_size) < capacity()) {
+                rehash(capacity_for(m_size));
+            }
+        }
+
+        iterator begin() {
+            if (m_size == 0) return end();
+            size_type stop = first_empty_slot();
+            return iterator(this, next_occupied_slot(stop, stop), stop);
+        }
+
+        const_iterator begin() const {
+            if (m_size == 0) return end();
+            size_type stop = first_empty_slot();
+            return const_iterator(this, next_occupied_slot(stop, stop), stop);
+        }
+
+        iterator end() { return iterator(this, npos, npos); }
+
+        const_iterator end() const { return const_iterator(this, npos, npos); }
+
+        iterator find(Key key) {
+            size_type slot = find_slot(key);
+            return iterator(this, slot, slot);
+        }
+
+        const_iterator find(Key key) const {
+            size_type slot = find_slot(key);
+            return const_iterator(this, slot, slot);
+        }
+
+        size_type count(Key key) const { return find_slot(key) != npos; }
+
+        Value &operator[](Key key) {
+            size_type slot = find_slot(key);
+            if (slot == npos) {
+                slot = insert_new(key, Value());
+            }
+            return m_values[slot];
+        }
+
+        std::pair<iterator, bool> emplace(Key key, const Value &value) {
+            size_type slot = find_slot(key);
+            if (slot != npos) {
+                return std::make_pair(iterator(this, slot, slot), false);
+            }
+            slot = insert_new(key, value);
+            return std::make_pair(iterator(this, slot, slot), true);
+        }
+
+        std::pair<iterator, bool> insert_or_assign(Key key, const Value &value) {
+            size_type slot = find_slot(key);
+            if (slot != npos) {
+                m_values[slot] = value;
+                return std::make_pair(iterator(this, slot, slot), false);
+            }
+            slot = insert_new(key, value);
+            return std::make_pair(iterator(this, slot, slot), true);
+        }
+
+        // Returns an iterator to the entry following iter.
+        iterator erase(iterator iter) {
+            assert(iter.m_slot != npos);
+            erase_slot(iter.m_slot);
+            if (m_dist[iter.m_slot] == 0) {
+                ++iter;
+            }
+            return iter;
+        }
+
+        size_type erase(Key key) {
+            size_type slot = find_slot(key);
+            if (slot == npos) return 0;
+            erase_slot(slot);
+            return 1;
+        }
+
+        // Heap memory held by the slots.
+        unsigned long long memory_usage() const {
+            return m_keys.capacity() * sizeof(Key) +
+                m_values.capacity() * sizeof(Value) +
+                m_dist.capacity() * sizeof(uint8_t);
+        }
+
+    private:
+        static constexpr size_type npos = ~(size_type) 0;
+
+        static constexpr size_type min_capacity = 8;
+
+        // probe distances are stored + 1 in a byte with 0 for empty slots
+        static constexpr unsigned max_dist = 255;
+
+        std::vector<Key>        m_keys;
+
+        std::vector<Value>      m_values;
+
+        // 1 + distance from the home slot of the key, or 0 if empty
+        std::vector<uint8_t>    m_dist;
+
+        size_type               m_size;
+
+        // the home slot of a key is the top log2(capacity) bits of its hash
+        unsigned                m_shift;
+
+        static size_type capacity_for(size_type n) {
+            if (n == 0) return 0;
+            size_type cap = min_capacity;
+            while (cap / 8 * 7 < n) cap <<= 1;
+            return cap;
+        }
+
+        // Fibonacci hashing alone maps keys with Fibonacci-like gaps (e.g.,
+        // 39, 44, 47, 52, ...) to few home slots, so the product is folded
+        // and multiplied once more.
+        size_type home_slot(Key key) const {
+            uint64_t h = (uint64_t) key * 0x9E3779B97F4A7C15ull;
+            h = (h ^ (h >> 32)) * 0x9E3779B97F4A7C15ull;
+            return (size_type) (h >> m_shift);
+        }
+
+        size_type mask() const { return capacity() - 1; }
+
+        void allocate(size_type cap) {
+            assert(cap == 0 || (cap & (cap - 1)) == 0);
+            // shrink or grow to exactly cap slots
+            std::vector<Key>(cap).swap(m_keys);
+            std::vector<Value>(cap).swap(m_values);
+            std::vector<uint8_t>(cap, 0).swap(m_dist);
+            m_shift = 64;
+            while (((size_type) 1 << (64 - m_shift)) < cap) --m_shift;
+        }
+
+        size_type find_slot(Key key) const {
+            if (m_size == 0) return npos;
+            size_type slot = home_slot(key);
+            for (unsigned dist = 1; m_dist[slot] >= dist; ++dist) {
+                if (m_keys[slot] == key) return slot;
+                slot = (slot + 1) & mask();
+            }
+            return npos;
+        }
+
+        size_type first_empty_slot() const {
+            if (capacity() == 0) return npos;
+            size_type slot = 0;
+            while (m_dist[slot] != 0) ++slot;
+            return slot;
+        }
+
+        // Returns the first occupied slot after slot, or npos if the next
+        // one is stop.
+        size_type next_occupied_slot(size_type slot, size_type stop) const {
+            if (slot == npos) return npos;
+            do {
+                slot = (slot + 1) & mask();
+                if (slot == stop) return npos;
+            } while (m_dist[slot] == 0);
+            return slot;
+        }
+
+        // Inserts a key that is not in the table and returns its slot.
+        size_type insert_new(Key key, Value value) {
+            if ((m_size + 1) > capacity() / 8 * 7) {
+                rehash(capacity() ? capacity() * 2 : min_capacity);
+            }
+
+            size_type slot = home_slot(key);
+            size_type ret = npos;
+            unsigned dist = 1;
+            for (;;) {
+                if (m_dist[slot] == 0) {
+                    m_keys[slot] = key;
+                    m_values[slot] = std::move(value);
+                    m_dist[slot] = (uint8_t) dist;
+                    ++m_size;
+                    return (ret == npos) ? slot : ret;
+                }
+                if (m_dist[slot] < dist) {
+                    // take the slot from the entry closer to its home
+                    std::swap(m_keys[slot], key);
+                    std::swap(m_values[slot], value);
+                    unsigned d = m_dist[slot];
+                    m_dist[slot] = (uint8_t) dist;
+                    dist = d;
+                    if (ret == npos) ret = slot;
+                }
+                slot = (slot + 1) & mask();
+                if (++dist == max_dist) {
+                    // Extremely unlikely with a 7/8 load factor. The entry
+                    // in hand is reinserted into a larger table.
+                    Key first_key = (ret == npos) ? key : m_keys[ret];
+                    rehash(capacity() * 2);
+                    insert_new(key, std::move(value));
+                    return find_slot(first_key);
+                }
+            }
+        }
+
+        void erase_slot(size_type slot) {
+            size_type next = (slot + 1) & mask();
+            while (m_dist[next] > 1) {
+                m_keys[slot] = m_keys[next];
+                m_values[slot] = std::move(m_values[next]);
+                m_dist[slot] = m_dist[next] - 1;
+                slot = next;
+                next = (next + 1) & mask();
+            }
+            m_dist[slot] = 0;
+            --m_size;
+        }
+
+        void rehash(size_type cap) {
+            std::vector<Key> keys;
+            std::vector<Value> values;
+            std::vector<uint8_t> dist;
+            keys.swap(m_keys);
+            values.swap(m_values);
+            dist.swap(m_dist);
+
+            allocate(cap);
+            m_size = 0;
+            for (size_type i = 0; i < dist.size(); ++i) {
+                if (dist[i] != 0) {
+                    insert_new(keys[i], std::move(values[i]));
+                }
+            }
+        }
+};
+
+#endif // FLAT_HASH_MAP_H
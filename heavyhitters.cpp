@@ -3,16 +3,28 @@
 #include "conf.h"
 #include <iostream>
 #include <random>
+#include <thread>
+#include <algorithm>
 
 using namespace std;
 
-HeavyHitters::HeavyHitters(unsigned logUniverseSize) : levels(logUniverseSize) {
+HeavyHitters::HeavyHitters(unsigned logUniverseSize) :
+    levels(logUniverseSize),
+    m_pla(nullptr),
+    tot_cnt(0ull),
+    cnt_pla(nullptr),
+    m_eps(0.0005),
+    m_delta(0.1),
+    m_Delta(0.1),
+    m_pla_mode(PLA_SWING),
+    m_num_query_threads(1)
+{
 	assert(logUniverseSize > 0);
-	pcm = new PCMSketch*[levels];
+    std::vector<uint64_t> level_seeds(levels);
 	for (auto i = 0; i < levels; ++i) {
-		pcm[i] = new PCMSketch(0.0005, 0.1, 0.1, i);
+        level_seeds[i] = i;
 	}
-    cnt_pla = nullptr;
+    init_levels(m_eps, m_delta, m_Delta, level_seeds);
 }
 
 HeavyHitters::HeavyHitters(
@@ -20,38 +32,83 @@ HeavyHitters::HeavyHitters(
     double epsilon,
     double delta,
     double Delta,
-    uint64_t seed):
+    uint64_t seed,
+    PLAMode pla_mode,
+    unsigned num_query_threads):
     levels(logUniverseSize),
-    pcm(nullptr),
+    m_pla(nullptr),
     tot_cnt(0ull),
     cnt_pla(nullptr),
     m_eps(epsilon),
     m_delta(delta),
-    m_Delta(Delta)
+    m_Delta(Delta),
+    m_pla_mode(pla_mode),
+    m_num_query_threads(num_query_threads)
 {
     std::mt19937 rgen(seed);
 
-    pcm = new PCMSketch*[levels];
+    std::vector<uint64_t> level_seeds(levels);
     for (auto i = 0; i < levels; ++i)
     {
-        pcm[i] = new PCMSketch(epsilon, delta, Delta, rgen());
+        level_seeds[i] = rgen();
     }
-    cnt_pla = new PLA(Delta);
+    init_levels(epsilon, delta, Delta, level_seeds);
+    cnt_pla = new PLA(Delta, pla_mode);
 }
 
 HeavyHitters::~HeavyHitters() {
-	for (auto i = 0; i < levels; ++i) {
-		delete pcm[i];
-	}
-	delete [] pcm;
+    delete m_pla;
     delete cnt_pla;
 }
 
-void HeavyHitters::clear() {
-    for (auto i = 0; i < levels; ++i)
+void
+HeavyHitters::init_levels(
+    double eps,
+    double delta,
+    double Delta,
+    const std::vector<uint64_t> &level_seeds)
+{
+    m_w = (unsigned) ceil(exp(1) / eps);
+    m_d = (unsigned) ceil(log(1 / delta));
+
+    // level i has 2^(levels - i) prefixes
+    m_first_exact_level = levels;
+    while (m_first_exact_level > 0 &&
+        (1ull << (levels - m_first_exact_level + 1)) <= m_w)
     {
-        pcm[i]->clear();
+        --m_first_exact_level;
     }
+
+    m_level_offset.resize(levels);
+    size_t num_cells = 0;
+    for (int i = 0; i < levels; ++i)
+    {
+        m_level_offset[i] = num_cells;
+        num_cells += (i < m_first_exact_level) ?
+            ((size_t) m_d * m_w) : ((size_t) 1 << (levels - i));
+    }
+
+    m_hash_param.resize((size_t) m_first_exact_level * m_d);
+    for (int i = 0; i < m_first_exact_level; ++i)
+    {
+        std::mt19937 rgen(level_seeds[i]);
+        std::uniform_int_distribution<uint64_t> unif(0, (((uint64_t) 1) << 61) - 1);
+        for (unsigned j = 0; j < m_d; ++j)
+        {
+            m_hash_param[i * m_d + j].first = unif(rgen);
+            m_hash_param[i * m_d + j].second = unif(rgen);
+        }
+    }
+
+    m_counters.assign(num_cells, 0);
+    m_pla = new PLAArray(num_cells, Delta, m_pla_mode);
+    m_update_cells.resize((size_t) m_first_exact_level * m_d +
+        (levels - m_first_exact_level));
+}
+
+void HeavyHitters::clear() {
+    std::fill(m_counters.begin(), m_counters.end(), 0);
+    m_pla->clear();
     if (cnt_pla)
     {
         cnt_pla->clear();
@@ -60,13 +117,32 @@ void HeavyHitters::clear() {
 }
 
 void HeavyHitters::update(unsigned long long ts, uint32_t element, int cnt) {
-	unsigned idx = element;
-	//char buffer[30];
-	for (auto i = 0; i < levels; ++i) {
-		//sprintf(buffer, "%u", idx);
-		pcm[i]->update(ts, idx, cnt);
+    // Hash the prefixes of all the levels first so that the counter and PLA
+    // updates below do not wait on the hashing.
+	uint32_t idx = element;
+    size_t *cell = m_update_cells.data();
+    const std::pair<uint64_t, uint64_t> *param = m_hash_param.data();
+	for (auto i = 0; i < m_first_exact_level; ++i) {
+        size_t row_start = m_level_offset[i];
+        for (unsigned j = 0; j < m_d; ++j) {
+            *cell++ = row_start + hash_to_col(*param++, idx);
+            row_start += m_w;
+        }
 		idx >>= 1;
 	}
+    // Keys of more than levels bits are wrapped into the 2^(levels - i)
+    // prefixes of an exact level, much like a hashed level maps them to
+    // some column.
+    for (auto i = m_first_exact_level; i < levels; ++i) {
+        size_t prefix_mask = ((size_t) 1 << (levels - i)) - 1;
+        *cell++ = m_level_offset[i] + (idx & prefix_mask);
+        idx >>= 1;
+    }
+
+    for (size_t c: m_update_cells) {
+        m_counters[c] += cnt;
+        m_pla->feed(c, PLA::point{ts, (double) m_counters[c]});
+    }
     
     if (cnt_pla)
     {
@@ -76,28 +152,169 @@ void HeavyHitters::update(unsigned long long ts, uint32_t element, int cnt) {
 }
 
 vector<uint32_t> HeavyHitters::query_hh(unsigned long long ts, double threshold) const {
-	vector<uint32_t> result;
-	vector<pair<int, unsigned>> stack = {{levels - 1, 0U}, {levels - 1, 1U}};
-	//char buffer[30];
-    //uint64_t n = 0;
-	while (!stack.empty()) {
-		auto [level, x] = stack.back();
-		stack.pop_back();
-		//sprintf(buffer, "%u", x);
-        //if (++n % 100000 == 0)
-            //cout << stack.size() << endl;
-		auto freq = pcm[level]->estimate_frequency(ts, x);
-		if (freq > threshold) {
-			if (level == 0) {
-				result.push_back(x);
-			}
-			else {
-				stack.push_back({level - 1, x << 1});
-				stack.push_back({level - 1, (x << 1) | 1});
-			}
-		}
-	}
-	return result;
+    return query_hh_impl(ts, threshold, false);
+}
+
+void
+HeavyHitters::estimate_prefixes(
+    int level,
+    const uint32_t *prefixes,
+    size_t n,
+    TIMESTAMP ts_s,
+    TIMESTAMP ts_e,
+    uint64_t *cnts) const
+{
+    size_t level_start = m_level_offset[level];
+    if (level >= m_first_exact_level)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            size_t cell = level_start + prefixes[i];
+            cnts[i] = (uint64_t) std::round(
+                m_pla->estimate(cell, ts_e) - m_pla->estimate(cell, ts_s));
+        }
+        return;
+    }
+
+    // The same as PCMSketch::estimate_frequency_batch_impl().
+    // vals[i * d + j] is the estimate of prefixes[i] in row j.
+    std::vector<double> vals(n * m_d);
+    bool memoize = n * 4 >= m_w;
+    std::vector<double> cell_vals(memoize ? m_w : 0);
+    const std::pair<uint64_t, uint64_t> *param = &m_hash_param[level * m_d];
+    for (unsigned j = 0; j < m_d; ++j)
+    {
+        size_t row_start = level_start + (size_t) j * m_w;
+        std::fill(cell_vals.begin(), cell_vals.end(), NAN);
+        for (size_t i = 0; i < n; ++i)
+        {
+            unsigned h = hash_to_col(param[j], prefixes[i]);
+            double v;
+            if (memoize && !std::isnan(cell_vals[h]))
+            {
+                v = cell_vals[h];
+            }
+            else
+            {
+                size_t cell = row_start + h;
+                v = m_pla->estimate(cell, ts_e) - m_pla->estimate(cell, ts_s);
+                if (memoize) cell_vals[h] = v;
+            }
+            vals[i * m_d + j] = v;
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        cnts[i] = (uint64_t) std::round(sort_and_get_median(&vals[i * m_d], m_d));
+    }
+}
+
+void
+HeavyHitters::estimate_level(
+    int level,
+    TIMESTAMP ts,
+    bool bitp,
+    const std::vector<uint32_t> &candidates,
+    std::vector<uint64_t> &freqs) const
+{
+    TIMESTAMP ts_s = bitp ? ts : 0;
+    TIMESTAMP ts_e = bitp ? (TIMESTAMP) ~0ul : ts;
+    auto estimate_range = [this, level, ts_s, ts_e, &candidates, &freqs](
+        size_t start, size_t end) {
+        estimate_prefixes(level, candidates.data() + start, end - start,
+            ts_s, ts_e, freqs.data() + start);
+    };
+
+    size_t n = candidates.size();
+    freqs.resize(n);
+    size_t num_threads = std::min((size_t) m_num_query_threads,
+        n / min_candidates_per_query_thread);
+    if (num_threads <= 1)
+    {
+        estimate_range(0, n);
+        return;
+    }
+
+    size_t chunk_size = (n + num_threads - 1) / num_threads;
+    std::vector<std::thread> threads;
+    threads.reserve(num_threads - 1);
+    for (size_t t = 1; t < num_threads; ++t)
+    {
+        threads.emplace_back(estimate_range, t * chunk_size,
+            std::min(n, (t + 1) * chunk_size));
+    }
+    estimate_range(0, chunk_size);
+    for (std::thread &thread: threads)
+    {
+        thread.join();
+    }
+}
+
+std::vector<uint32_t>
+HeavyHitters::query_hh_impl(
+    TIMESTAMP ts,
+    double threshold,
+    bool bitp) const
+{
+    // No prefix can have a count above threshold if the total count is no
+    // more than that. The total count estimated by cnt_pla is off by at most
+    // Delta.
+    if (cnt_pla)
+    {
+        double cnt_est;
+        if (bitp)
+        {
+            double cnt_at_s = cnt_pla->estimate(ts);
+            cnt_est = (cnt_at_s > tot_cnt) ? 0 : (tot_cnt - cnt_at_s);
+        }
+        else
+        {
+            cnt_est = cnt_pla->estimate(ts);
+        }
+        if (cnt_est + m_Delta <= threshold)
+        {
+            return {};
+        }
+    }
+
+    // candidates are in increasing order on each level
+    vector<uint32_t> candidates = {0U, 1U};
+    vector<uint32_t> next_candidates;
+    vector<uint64_t> freqs;
+    for (int level = levels - 1;; --level)
+    {
+        estimate_level(level, ts, bitp, candidates, freqs);
+
+        next_candidates.clear();
+        if (level == 0)
+        {
+            // same order as a depth-first search that visits the right child
+            // first
+            for (size_t i = candidates.size(); i-- > 0;)
+            {
+                if (freqs[i] > threshold)
+                {
+                    next_candidates.push_back(candidates[i]);
+                }
+            }
+            return next_candidates;
+        }
+
+        for (size_t i = 0; i < candidates.size(); ++i)
+        {
+            if (freqs[i] > threshold)
+            {
+                next_candidates.push_back(candidates[i] << 1);
+                next_candidates.push_back((candidates[i] << 1) | 1);
+            }
+        }
+        if (next_candidates.empty())
+        {
+            return next_candidates;
+        }
+        candidates.swap(next_candidates);
+    }
 }
 
 std::vector<IPersistentHeavyHitterSketch::HeavyHitter>
@@ -111,44 +328,24 @@ HeavyHitters::estimate_heavy_hitters(
     //decltype(query_hh(ts_e, threshold)) raw_result;
     auto raw_result = query_hh(ts_e, threshold);
     
+    std::vector<uint64_t> freqs(raw_result.size());
+    estimate_prefixes(0, raw_result.data(), raw_result.size(),
+        ts_e, (TIMESTAMP) ~0ul, freqs.data());
+
     std::vector<IPersistentHeavyHitterSketch::HeavyHitter> ret;
-    std::transform(raw_result.begin(), raw_result.end(),
-        std::back_inserter(ret),
-        [ts_e,this,cnt_est](uint32_t value) -> auto {
-            //char buffer[30];
-            //sprintf(buffer, "%u", value);
-            auto freq = pcm[0]->estimate_frequency_bitp(ts_e, value);
-            return IPersistentHeavyHitterSketch::HeavyHitter{
-                .m_value = value,
-                .m_fraction = (float) (freq / cnt_est)
-            };
+    ret.reserve(raw_result.size());
+    for (size_t i = 0; i < raw_result.size(); ++i)
+    {
+        ret.push_back(IPersistentHeavyHitterSketch::HeavyHitter{
+            .m_value = raw_result[i],
+            .m_fraction = (float) (freqs[i] / cnt_est)
         });
+    }
     return ret; 
 }
 
 vector<uint32_t> HeavyHitters::query_hh_bitp(unsigned long long ts, double threshold) const {
-	vector<uint32_t> result;
-	vector<pair<int, unsigned>> stack = {{levels - 1, 0U}, {levels - 1, 1U}};
-	//char buffer[30];
-    //uint64_t n = 0;
-	while (!stack.empty()) {
-		auto [level, x] = stack.back();
-		stack.pop_back();
-		//sprintf(buffer, "%u", x);
-        //if (++n % 100000 == 0)
-            //cout << stack.size() << endl;
-		auto freq = pcm[level]->estimate_frequency_bitp(ts, x);
-		if (freq > threshold) {
-			if (level == 0) {
-				result.push_back(x);
-			}
-			else {
-				stack.push_back({level - 1, x << 1});
-				stack.push_back({level - 1, (x << 1) | 1});
-			}
-		}
-	}
-	return result;
+    return query_hh_impl(ts, threshold, true);
 }
 
 std::vector<IPersistentHeavyHitterSketchBITP::HeavyHitter>
@@ -164,26 +361,29 @@ HeavyHitters::estimate_heavy_hitters_bitp(
     // TODO
     auto raw_result = query_hh_bitp(ts_s, threshold);
     
+    std::vector<uint64_t> freqs(raw_result.size());
+    estimate_prefixes(0, raw_result.data(), raw_result.size(),
+        ts_s, (TIMESTAMP) ~0ul, freqs.data());
+
     std::vector<IPersistentHeavyHitterSketch::HeavyHitter> ret;
-    std::transform(raw_result.begin(), raw_result.end(),
-        std::back_inserter(ret),
-        [ts_s,this,cnt_est](uint32_t value) -> auto {
-            //char buffer[30];
-            //sprintf(buffer, "%u", value);
-            auto freq = pcm[0]->estimate_frequency_bitp(ts_s, value);
-            return IPersistentHeavyHitterSketch::HeavyHitter{
-                .m_value = value,
-                .m_fraction = (float) (freq / cnt_est)
-            };
+    ret.reserve(raw_result.size());
+    for (size_t i = 0; i < raw_result.size(); ++i)
+    {
+        ret.push_back(IPersistentHeavyHitterSketch::HeavyHitter{
+            .m_value = raw_result[i],
+            .m_fraction = (float) (freqs[i] / cnt_est)
         });
+    }
     return ret; 
 }
 
 size_t HeavyHitters::memory_usage() const {
-	size_t s = 0;
-	for (int i = 0; i < levels; ++i) {
-		s += pcm[i]->memory_usage();
-	}
+	size_t s = sizeof(*this) +
+        m_level_offset.capacity() * sizeof(m_level_offset[0]) +
+        m_hash_param.capacity() * sizeof(m_hash_param[0]) +
+        m_counters.capacity() * sizeof(m_counters[0]) +
+        m_update_cells.capacity() * sizeof(m_update_cells[0]) +
+        m_pla->memory_usage();
     if (cnt_pla) s += cnt_pla->memory_usage();
 	return s;
 }
@@ -191,6 +391,7 @@ size_t HeavyHitters::memory_usage() const {
 std::string HeavyHitters::get_short_description() const {
     std::ostringstream oss;
     oss << "PCM_HH-logU" << levels << "-e" << m_eps << "-d" << m_delta << "-D" << m_Delta;
+    if (m_pla_mode == PLA_OPTIMAL) oss << "-optPLA";
     return oss.str();
 }
 
@@ -246,7 +447,19 @@ HeavyHitters::create_from_config(int idx)
     double Delta = g_config->get_double("PCM_HH.Delta", idx).value();
     uint32_t seed = g_config->get_u32("PCM_HH.seed").value();
 
-    return new HeavyHitters(logUniverseSize, epsilon, delta, Delta, seed);
+    PLAMode pla_mode;
+    std::string pla_mode_str = g_config->get("PCM_HH.pla_mode").value();
+    if (!parse_pla_mode(pla_mode_str, pla_mode))
+    {
+        std::cerr << "[WARN] invalid PCM_HH.pla_mode " << pla_mode_str
+            << " (swing or optimal required), using swing" << std::endl;
+        pla_mode = PLA_SWING;
+    }
+
+    uint32_t num_query_threads = g_config->get_u32("PCM_HH.num_query_threads").value();
+
+    return new HeavyHitters(logUniverseSize, epsilon, delta, Delta, seed, pla_mode,
+        num_query_threads);
 }
 
 int
@@ -2,7 +2,9 @@
 #define HEAVYHITTERS_H
 
 #include <vector>
-#include "pcm.h"
+#include <utility>
+#include "pla.h"
+#include "sketch.h"
 
 class HeavyHitters:
     public IPersistentHeavyHitterSketch,
@@ -16,7 +18,9 @@ public:
         double epsilon,
         double delta,
         double Delta,
-        uint64_t seed = 19950810ul);
+        uint64_t seed = 19950810ul,
+        PLAMode pla_mode = PLA_SWING,
+        unsigned num_query_threads = 1);
 
     virtual ~HeavyHitters();
 
@@ -44,9 +48,30 @@ public:
     std::string get_short_description() const override;
 
     private:
+        // Level i counts the prefixes element >> i, so it has
+        // 2^(levels - i) of them. Levels below m_first_exact_level are
+        // count-min sketches of m_d rows of m_w cells. The remaining top
+        // levels have no more prefixes than m_w, so each of their prefixes
+        // has its own cell, and the prefixes of keys out of the universe are
+        // wrapped into them. The cells of all levels share one counter array
+        // and one PLAArray, where level i starts at m_level_offset[i].
         int levels;
-        
-        PCMSketch **pcm;
+
+        unsigned m_w, m_d;
+
+        int m_first_exact_level;
+
+        std::vector<size_t> m_level_offset;
+
+        // the hash parameters of row j of level i are at i * m_d + j
+        std::vector<std::pair<uint64_t, uint64_t>> m_hash_param;
+
+        std::vector<int> m_counters;
+
+        PLAArray *m_pla;
+
+        // cells touched by the current update
+        std::vector<size_t> m_update_cells;
         
         uint64_t tot_cnt; 
 
@@ -55,6 +80,63 @@ public:
         double m_eps;
         double m_delta;
         double m_Delta;
+        PLAMode m_pla_mode;
+
+        // max number of threads estimating the candidates of a level
+        unsigned m_num_query_threads;
+
+        static constexpr size_t min_candidates_per_query_thread = 1024;
+
+        // Sets up the cells of eps and delta for the levels, where the hash
+        // parameters of level i are drawn from level_seeds[i] in the same way
+        // as PCMSketch does.
+        void
+        init_levels(
+            double eps,
+            double delta,
+            double Delta,
+            const std::vector<uint64_t> &level_seeds);
+
+        // Same as CMSketch::u32_hash().
+        unsigned
+        hash_to_col(
+            const std::pair<uint64_t, uint64_t> &param,
+            uint64_t key) const
+        {
+            uint64_t x = (param.first * key + param.second) >> 32;
+            return (unsigned)((x * m_w) >> 32);
+        }
+
+        // Estimates the counts of prefixes[0..n) of level in [ts_s, ts_e]
+        // into cnts[0..n).
+        void
+        estimate_prefixes(
+            int level,
+            const uint32_t *prefixes,
+            size_t n,
+            TIMESTAMP ts_s,
+            TIMESTAMP ts_e,
+            uint64_t *cnts) const;
+
+        // Level-synchronous descent of the dyadic tree shared by query_hh()
+        // and query_hh_bitp(). Returns the leaves in decreasing order, as
+        // the depth-first search used to.
+        std::vector<uint32_t>
+        query_hh_impl(
+            TIMESTAMP ts,
+            double threshold,
+            bool bitp) const;
+
+        // Estimates the frequencies of the prefixes in candidates with
+        // estimate_prefixes(), split across up to m_num_query_threads
+        // threads.
+        void
+        estimate_level(
+            int level,
+            TIMESTAMP ts,
+            bool bitp,
+            const std::vector<uint32_t> &candidates,
+            std::vector<uint64_t> &freqs) const;
 
     public:
         static HeavyHitters* create(int &argi, int argc, char *argv[], const char **help_str);
@@ -2,6 +2,8 @@
 #include <cassert>
 #include <iostream>
 #include <cmath>
+#include <functional>
+#include <algorithm>
 
 MisraGries::MisraGries(
     double epsilon):
@@ -9,8 +11,7 @@ MisraGries::MisraGries(
     m_k(std::max((uint32_t) std::ceil(1 / epsilon), 2u)),
     m_cnt(),
     m_min_cnt(~0ul),
-    m_delta(0),
-    m_initial_bucket_count(m_cnt.bucket_count())
+    m_delta(0)
 {
 }
 
@@ -20,11 +21,24 @@ MisraGries::MisraGries(
     m_k(k),
     m_cnt(),
     m_min_cnt(~0ul),
-    m_delta(0),
-    m_initial_bucket_count(m_cnt.bucket_count())
+    m_delta(0)
 {
 }
 
+MisraGries::MisraGries(
+    uint32_t k,
+    const FrozenMisraGries &summary):
+    MisraGries(k)
+{
+    assert(summary.size() <= m_k);
+    m_cnt.reserve(summary.size());
+    for (size_t i = 0; i < summary.size(); ++i)
+    {
+        m_cnt.emplace(summary.key(i), summary.cnt(i));
+        m_min_cnt = std::min(m_min_cnt, summary.cnt(i));
+    }
+}
+
 MisraGries::~MisraGries()
 {
 }
@@ -32,8 +46,7 @@ MisraGries::~MisraGries()
 void
 MisraGries::clear()
 {
-    m_cnt.clear();
-    m_cnt.rehash(m_initial_bucket_count);
+    m_cnt.reset(0);
     m_min_cnt = ~0ull;
     m_delta = 0;
 }
@@ -41,7 +54,7 @@ MisraGries::clear()
 size_t
 MisraGries::memory_usage() const
 {
-    return 40 + size_of_unordered_map(m_cnt);
+    return sizeof(MisraGries) + m_cnt.memory_usage();
 }
 
 void
@@ -192,27 +205,27 @@ MisraGries::merge(
         return ;
     }
 
-    std::vector<std::pair<uint32_t, uint64_t>> cnt_pairs(
-        m_cnt.begin(), m_cnt.end());
+    std::vector<uint64_t> cnts;
+    cnts.reserve(m_cnt.size());
+    for (const auto &p: m_cnt)
+    {
+        cnts.push_back(p.second);
+    }
     
     std::nth_element(
-        cnt_pairs.begin(),
-        cnt_pairs.begin() + m_k,
-        cnt_pairs.end(),
-        [](const auto &p1, const auto &p2) -> bool {
-            return p1.second > p2.second;
-        });
-
-    uint64_t delta = cnt_pairs[m_k].second;
+        cnts.begin(),
+        cnts.begin() + m_k,
+        cnts.end(),
+        std::greater<uint64_t>());
+
+    uint64_t delta = cnts[m_k];
     
     auto iter = m_cnt.begin();
     while (iter != m_cnt.end())
     {
         if (iter->second <= delta)
         {
-            auto to_remove = iter;
-            ++iter;
-            m_cnt.erase(to_remove);
+            iter = m_cnt.erase(iter);
         }
         else
         {
@@ -247,7 +260,7 @@ void
 MisraGries::reset_delta()
 {
     m_min_cnt = ~0ul;
-    for (auto &p: m_cnt)
+    for (auto p: m_cnt)
     {
         assert(p.second > m_delta);
         p.second -= m_delta;
@@ -256,6 +269,298 @@ MisraGries::reset_delta()
     m_delta = 0;
 }
 
+FrozenMisraGries::FrozenMisraGries():
+    m_keys(),
+    m_cnts()
+{
+}
+
+FrozenMisraGries::FrozenMisraGries(
+    const MisraGries &mg):
+    FrozenMisraGries()
+{
+    std::vector<std::pair<uint32_t, uint64_t>> counters;
+    counters.reserve(mg.m_cnt.size());
+    for (const auto &p: mg.m_cnt)
+    {
+        assert(p.second > mg.m_delta);
+        counters.emplace_back(p.first, p.second - mg.m_delta);
+    }
+    assign(counters);
+}
+
+FrozenMisraGries::FrozenMisraGries(
+    std::vector<std::pair<uint32_t, uint64_t>> counters):
+    m_keys(),
+    m_cnts()
+{
+    assign(counters);
+}
+
+void
+FrozenMisraGries::assign(
+    std::vector<std::pair<uint32_t, uint64_t>> &counters)
+{
+    if (counters.size() <= 64)
+    {
+        std::sort(counters.begin(), counters.end(),
+            [](const auto &p1, const auto &p2) -> bool {
+                return p1.first < p2.first;
+            });
+    }
+    else
+    {
+        // LSD radix sort on the keys, 8 bits per pass up to the highest
+        // set bit of the keys
+        uint32_t key_bits = 0;
+        for (const auto &p: counters)
+        {
+            key_bits |= p.first;
+        }
+        std::vector<std::pair<uint32_t, uint64_t>> buf(counters.size());
+        for (unsigned shift = 0; shift < 32 && (key_bits >> shift); shift += 8)
+        {
+            size_t pos[257] = {0};
+            for (const auto &p: counters)
+            {
+                ++pos[((p.first >> shift) & 0xff) + 1];
+            }
+            for (unsigned d = 0; d < 256; ++d)
+            {
+                pos[d + 1] += pos[d];
+            }
+            for (const auto &p: counters)
+            {
+                buf[pos[(p.first >> shift) & 0xff]++] = p;
+            }
+            counters.swap(buf);
+        }
+    }
+
+    m_keys.clear();
+    m_cnts.clear();
+    m_keys.reserve(counters.size());
+    m_cnts.reserve(counters.size());
+    for (const auto &p: counters)
+    {
+        m_keys.push_back(p.first);
+        m_cnts.push_back(p.second);
+    }
+}
+
+void
+FrozenMisraGries::clear()
+{
+    m_keys.clear();
+    m_cnts.clear();
+}
+
+uint64_t
+FrozenMisraGries::get_cnt(
+    uint32_t key) const
+{
+    auto iter = std::lower_bound(m_keys.begin(), m_keys.end(), key);
+    if (iter == m_keys.end() || *iter != key) return 0;
+    return m_cnts[iter - m_keys.begin()];
+}
+
+void
+FrozenMisraGries::purge(
+    uint64_t threshold)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < m_keys.size(); ++i)
+    {
+        if (m_cnts[i] > threshold)
+        {
+            m_keys[n] = m_keys[i];
+            m_cnts[n] = m_cnts[i];
+            ++n;
+        }
+    }
+    m_keys.resize(n);
+    m_cnts.resize(n);
+}
+
+void
+FrozenMisraGries::shrink_to_fit()
+{
+    m_keys.shrink_to_fit();
+    m_cnts.shrink_to_fit();
+}
+
+size_t
+FrozenMisraGries::memory_usage() const
+{
+    return sizeof(FrozenMisraGries) +
+        m_keys.capacity() * sizeof(uint32_t) +
+        m_cnts.capacity() * sizeof(uint64_t);
+}
+
+std::vector<IPersistentHeavyHitterSketch::HeavyHitter>
+FrozenMisraGries::estimate_heavy_hitters(
+    double frac_threshold,
+    uint64_t tot_cnt,
+    double eps) const
+{
+    std::vector<IPersistentHeavyHitterSketch::HeavyHitter> ret;
+
+    uint64_t threshold = (uint64_t) std::ceil(tot_cnt * (frac_threshold - eps));
+    for (size_t i = 0; i < m_keys.size(); ++i)
+    {
+        if (m_cnts[i] >= threshold)
+        {
+            ret.emplace_back(IPersistentHeavyHitterSketch::HeavyHitter{
+                m_keys[i], (float) ((double) m_cnts[i] / tot_cnt)
+            });
+        }
+    }
+
+    return ret;
+}
+
+FrozenMisraGries
+FrozenMisraGries::merge(
+    const FrozenMisraGries *const *summaries,
+    size_t n,
+    uint32_t k)
+{
+    FrozenMisraGries ret = sum(summaries, n);
+    ret.prune(k);
+    return ret;
+}
+
+FrozenMisraGries
+FrozenMisraGries::sum(
+    const FrozenMisraGries *const *summaries,
+    size_t n)
+{
+    if (n == 0)
+    {
+        return FrozenMisraGries();
+    }
+
+    // Merge two summaries at a time in the order of a Huffman tree, which
+    // copies the fewest counters. The intermediate summaries are owned by
+    // tmps, which never reallocates as there are n - 1 merges.
+    std::vector<const FrozenMisraGries*> pending(summaries, summaries + n);
+    std::vector<FrozenMisraGries> tmps;
+    tmps.reserve(n - 1);
+    auto release = [&tmps](const FrozenMisraGries *s) {
+        if (s >= tmps.data() && s < tmps.data() + tmps.size())
+        {
+            tmps[s - tmps.data()] = FrozenMisraGries();
+        }
+    };
+    while (pending.size() > 1)
+    {
+        size_t i1 = 0, i2 = 1;
+        if (pending[i2]->size() < pending[i1]->size())
+        {
+            std::swap(i1, i2);
+        }
+        for (size_t i = 2; i < pending.size(); ++i)
+        {
+            if (pending[i]->size() < pending[i1]->size())
+            {
+                i2 = i1;
+                i1 = i;
+            }
+            else if (pending[i]->size() < pending[i2]->size())
+            {
+                i2 = i;
+            }
+        }
+
+        tmps.emplace_back();
+        merge_two(*pending[i1], *pending[i2], tmps.back());
+        release(pending[i1]);
+        release(pending[i2]);
+        pending[std::min(i1, i2)] = &tmps.back();
+        pending.erase(pending.begin() + std::max(i1, i2));
+    }
+
+    return tmps.empty() ? *pending[0] : std::move(tmps.back());
+}
+
+void
+FrozenMisraGries::merge_two(
+    const FrozenMisraGries &s1,
+    const FrozenMisraGries &s2,
+    FrozenMisraGries &out)
+{
+    const size_t n1 = s1.size(), n2 = s2.size();
+    out.m_keys.resize(n1 + n2);
+    out.m_cnts.resize(n1 + n2);
+    uint32_t *keys = out.m_keys.data();
+    uint64_t *cnts = out.m_cnts.data();
+
+    size_t i1 = 0, i2 = 0, n = 0;
+    while (i1 < n1 && i2 < n2)
+    {
+        uint32_t key1 = s1.m_keys[i1], key2 = s2.m_keys[i2];
+        if (key1 < key2)
+        {
+            keys[n] = key1;
+            cnts[n] = s1.m_cnts[i1++];
+        }
+        else if (key2 < key1)
+        {
+            keys[n] = key2;
+            cnts[n] = s2.m_cnts[i2++];
+        }
+        else
+        {
+            keys[n] = key1;
+            cnts[n] = s1.m_cnts[i1++] + s2.m_cnts[i2++];
+        }
+        ++n;
+    }
+    for (; i1 < n1; ++i1, ++n)
+    {
+        keys[n] = s1.m_keys[i1];
+        cnts[n] = s1.m_cnts[i1];
+    }
+    for (; i2 < n2; ++i2, ++n)
+    {
+        keys[n] = s2.m_keys[i2];
+        cnts[n] = s2.m_cnts[i2];
+    }
+    out.m_keys.resize(n);
+    out.m_cnts.resize(n);
+}
+
+void
+FrozenMisraGries::prune(
+    uint32_t k)
+{
+    if (m_keys.size() <= k)
+    {
+        return ;
+    }
+
+    std::vector<uint64_t> cnts(m_cnts);
+    std::nth_element(
+        cnts.begin(),
+        cnts.begin() + k,
+        cnts.end(),
+        std::greater<uint64_t>());
+    uint64_t delta = cnts[k];
+
+    size_t n = 0;
+    for (size_t i = 0; i < m_keys.size(); ++i)
+    {
+        if (m_cnts[i] > delta)
+        {
+            m_keys[n] = m_keys[i];
+            m_cnts[n] = m_cnts[i] - delta;
+            ++n;
+        }
+    }
+    m_keys.resize(n);
+    m_cnts.resize(n);
+}
+
 int
 MisraGries::unit_test(
     int argc,
@@ -1,15 +1,18 @@
 #ifndef MISRA_GRIES_H
 #define MISRA_GRIES_H
 
-#include <unordered_map>
 #include <list>
-#include "hashtable.h"
+#include <vector>
+#include <utility>
+#include "flat_hash_map.h"
 #include "sketch.h"
 
 namespace MisraGriesSketches {
     class MisraGriesAccessor;
 }
 
+class FrozenMisraGries;
+
 class MisraGries
 {
 public:
@@ -19,6 +22,11 @@ public:
     MisraGries(
         uint32_t k);
 
+    // Thaws a frozen summary with at most k counters.
+    MisraGries(
+        uint32_t k,
+        const FrozenMisraGries &summary);
+
     ~MisraGries();
 
     MisraGries(const MisraGries&) = default;
@@ -77,16 +85,15 @@ private:
 
     uint32_t                m_k;
 
-    mutable std::unordered_map<uint32_t, uint64_t>
+    // not preallocated for k - 1 counters since many of the MGs in the
+    // persistent sketches only hold a few
+    mutable FlatHashMap<uint32_t, uint64_t>
                             m_cnt;
 
     mutable uint64_t        m_min_cnt;
 
     mutable uint64_t        m_delta;
 
-    std::unordered_map<uint32_t, uint64_t>::size_type
-                            m_initial_bucket_count;
-
 public:
     static int
     unit_test(
@@ -94,6 +101,112 @@ public:
         char *argv[]);
 
     friend class MisraGriesSketches::MisraGriesAccessor;
+
+    friend class FrozenMisraGries;
+};
+
+// An immutable MG summary that stores its counters as arrays sorted by key,
+// e.g., in the tree nodes of the persistent MG sketches in pmmg.h. It costs
+// 12 bytes per counter and summaries are merged with linear merges of the
+// sorted arrays.
+class FrozenMisraGries
+{
+public:
+    FrozenMisraGries();
+
+    // Freezes the counters of mg with its pending subtraction applied.
+    explicit FrozenMisraGries(
+        const MisraGries &mg);
+
+    // Freezes a set of (key, count) counters with distinct keys.
+    explicit FrozenMisraGries(
+        std::vector<std::pair<uint32_t, uint64_t>> counters);
+
+    void
+    clear();
+
+    size_t
+    size() const
+    {
+        return m_keys.size();
+    }
+
+    uint32_t
+    key(size_t i) const
+    {
+        return m_keys[i];
+    }
+
+    uint64_t
+    cnt(size_t i) const
+    {
+        return m_cnts[i];
+    }
+
+    // Returns the counter of key, or 0 if there's none.
+    uint64_t
+    get_cnt(
+        uint32_t key) const;
+
+    // Removes the counters <= threshold.
+    void
+    purge(
+        uint64_t threshold);
+
+    void
+    shrink_to_fit();
+
+    size_t
+    memory_usage() const;
+
+    // Same as MisraGries::estimate_heavy_hitters() on an MG with epsilon
+    // eps.
+    std::vector<HeavyHitter_u32>
+    estimate_heavy_hitters(
+        double frac_threshold,
+        uint64_t tot_cnt,
+        double eps) const;
+
+    // Merges n summaries into one with at most k counters. The counters
+    // of the same key are summed up and, if there are more than k of them,
+    // the (k + 1)-th largest counter is subtracted from all of them as in
+    // MisraGries::merge(). The error bound is the same as merging them one
+    // by one, but the counters are only subtracted once.
+    static FrozenMisraGries
+    merge(
+        const FrozenMisraGries *const *summaries,
+        size_t n,
+        uint32_t k);
+
+    // Sums up the counters of n summaries without reducing them to k. A
+    // merge() that includes the sum is the same as a merge() of all the
+    // summaries in it.
+    static FrozenMisraGries
+    sum(
+        const FrozenMisraGries *const *summaries,
+        size_t n);
+
+private:
+    // Sorts the counters by key and stores them.
+    void
+    assign(
+        std::vector<std::pair<uint32_t, uint64_t>> &counters);
+
+    // Merges s1 and s2 into out without pruning.
+    static void
+    merge_two(
+        const FrozenMisraGries &s1,
+        const FrozenMisraGries &s2,
+        FrozenMisraGries &out);
+
+    // Reduces the summary to at most k counters.
+    void
+    prune(
+        uint32_t k);
+
+    std::vector<uint32_t>   m_keys;
+
+    std::vector<uint64_t>   m_cnts;
 };
 
 #endif // MISRA_GRIES_H
@@ -9,6 +9,7 @@ extern "C"
 #include <cstring>
 #include <cassert>
 #include <iostream>
+#include <vector>
 
 using dsimpl::UINT8;
 
@@ -27,10 +28,6 @@ NormSamplingSketch::List::~List()
 void
 NormSamplingSketch::List::reset()
 {
-    for (uint32_t i = 0; i < m_length; ++i)
-    {
-        delete []m_items[i].m_dvec;
-    }
     delete []m_items;
     m_items = nullptr;
     m_length = m_capacity = 0;
@@ -40,14 +37,14 @@ NormSamplingSketch::List::reset()
 void
 NormSamplingSketch::List::append(
     TIMESTAMP ts,
-    double *dvec,
+    uint32_t row,
     double weight)
 {
     ensure_item_capacity(m_length + 1);
     
     m_items[m_length].m_ts = ts;
     m_items[m_length].m_threshold = m_weight;
-    m_items[m_length++].m_dvec = dvec;
+    m_items[m_length++].m_row = row;
     m_weight = weight;
 }
 
@@ -94,11 +91,12 @@ NormSamplingSketch::List::ensure_item_capacity(
 NormSamplingSketch::NormSamplingSketch(
     uint32_t n,
     uint32_t sample_size,
-    uint32_t seed):
+    uint32_t seed,
+    RowStorageType row_storage_type):
     m_n(n),
     m_sample_size(sample_size),
     m_seen(0),
-    m_n_dvec_stored(0),
+    m_rows(n, row_storage_type),
     m_reservoir(new List[sample_size]),
     m_weight_min_heap(new List*[sample_size]),
     m_rng(seed),
@@ -120,11 +118,11 @@ void
 NormSamplingSketch::clear()
 {
     m_seen = 0;
-    m_n_dvec_stored = 0;
     for (uint32_t i = 0; i < m_sample_size; ++i)
     {
         m_reservoir[i].reset();
     }
+    m_rows.clear();
     // m_weight_min_heap will be re-built anyway and thus
     // does not need be reinit'd
 }
@@ -138,14 +136,18 @@ NormSamplingSketch::memory_usage() const
         res += m_reservoir[i].memory_usage();
     }
     res += sizeof(List*) * m_sample_size; // m_weight_min_heap
-    res += m_n_dvec_stored * sizeof(double) * m_n;
+    res += m_rows.memory_usage();
     return res;
 }
 
 std::string
 NormSamplingSketch::get_short_description() const
 {
-    return std::string("NORM_SAMPLING-ss") + std::to_string(m_sample_size);
+    std::string desc = std::string("NORM_SAMPLING-ss") +
+        std::to_string(m_sample_size);
+    if (m_rows.storage_type() == ROW_STORAGE_FLOAT) desc += "-f32";
+    else if (m_rows.storage_type() == ROW_STORAGE_BFLOAT16) desc += "-bf16";
+    return desc;
 }
 
 void
@@ -158,10 +160,7 @@ NormSamplingSketch::update(
 
     if (m_seen < m_sample_size)
     {
-        double *dvec_copy = new double[m_n];
-        memcpy(dvec_copy, dvec, sizeof(double) * m_n);
-        m_reservoir[m_seen++].append(ts, dvec_copy, weight);
-        ++m_n_dvec_stored;
+        m_reservoir[m_seen++].append(ts, m_rows.append(dvec), weight);
 
         if (m_seen == m_sample_size)
         {
@@ -175,12 +174,8 @@ NormSamplingSketch::update(
     {
         if (weight > m_weight_min_heap[0]->get_weight())
         {
-            double *dvec_copy = new double[m_n];
-            memcpy(dvec_copy, dvec, sizeof(double) * m_n);
-
             List *l = m_weight_min_heap[0];
-            l->append(ts, dvec_copy, weight);
-            ++m_n_dvec_stored;
+            l->append(ts, m_rows.append(dvec), weight);
 
             dsimpl::min_heap_push_down(
                 m_weight_min_heap,
@@ -212,22 +207,21 @@ NormSamplingSketch::get_covariance_matrix(
         }
     }
     
+    // only used if the rows are not stored in double
+    std::vector<double> buf(
+        (m_rows.storage_type() == ROW_STORAGE_DOUBLE) ? 0 : m_n);
+
+    PackedGramAccumulator acc(m_n, A);
     //uint64_t _c = 0;
     for (uint32_t i = 0; i < c; ++i) {
-        double *dvec = items[i]->m_dvec;
+        const double *dvec = m_rows.get(items[i]->m_row, buf.data());
         double l2_sqr = cblas_ddot(m_n, dvec, 1, dvec, 1);
         double alpha = (l2_sqr < threshold) ? (threshold / l2_sqr) : 1.0;
         //if (l2_sqr < threshold) ++_c;
 
-        cblas_dspr(
-            CblasColMajor,
-            CblasUpper,
-            m_n,
-            alpha,
-            dvec,
-            1,
-            A);
+        acc.add(dvec, alpha);
     }
+    acc.flush();
     //std::cout << "_c == " << _c << std::endl;
 
     delete []items;
@@ -249,7 +243,18 @@ NormSamplingSketch::create_from_config(int idx)
     sample_size = g_config->get_u32("NORM_SAMPLING.sample_size", idx).value();
     seed = g_config->get_u32("NORM_SAMPLING.seed", -1).value();
 
-    return new NormSamplingSketch(n, sample_size, seed);
+    RowStorageType row_storage_type;
+    std::string row_storage_str =
+        g_config->get("NORM_SAMPLING.row_storage").value();
+    if (!parse_row_storage_type(row_storage_str, row_storage_type))
+    {
+        std::cerr << "[WARN] invalid NORM_SAMPLING.row_storage "
+            << row_storage_str << " (double, float or bfloat16 required), "
+            << "using double" << std::endl;
+        row_storage_type = ROW_STORAGE_DOUBLE;
+    }
+
+    return new NormSamplingSketch(n, sample_size, seed, row_storage_type);
 }
 
 int
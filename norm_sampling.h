@@ -2,6 +2,7 @@
 #define NORM_SAMPLING_H
 
 #include "sketch.h"
+#include "row_store.h"
 #include <unordered_map>
 #include <random>
 
@@ -13,7 +14,7 @@ private:
     {
         TIMESTAMP               m_ts;
 
-        double                  *m_dvec;
+        uint32_t                m_row; // in m_rows
 
         double                  m_threshold;
     };
@@ -31,7 +32,7 @@ private:
         void
         append(
             TIMESTAMP ts,
-            double *dvec,
+            uint32_t row,
             double weight);
 
         size_t
@@ -61,7 +62,8 @@ public:
     NormSamplingSketch(
         uint32_t n,
         uint32_t sample_size,
-        uint32_t seed = 19950810u);
+        uint32_t seed = 19950810u,
+        RowStorageType row_storage_type = ROW_STORAGE_DOUBLE);
 
     virtual
     ~NormSamplingSketch();
@@ -92,7 +94,7 @@ private:
 
     uint32_t                    m_seen;
 
-    uint64_t                    m_n_dvec_stored;
+    RowStore                    m_rows;
 
     List                        *m_reservoir;
     
@@ -1,6 +1,5 @@
 #include "norm_sampling_wr.h"
 #include "conf.h"
-#include "avl.h"
 extern "C"
 {
 #include <cblas.h>
@@ -10,11 +9,7 @@ extern "C"
 #include <cassert>
 #include <iostream>
 #include <map>
-
-using dsimpl::UINT8;
-
-using dsimpl::avl_impl::is_not_bit47_extended;
-using dsimpl::avl_impl::xor_bit;
+#include <vector>
 
 NormSamplingWRSketch::List::List():
     m_length(0u),
@@ -30,13 +25,6 @@ NormSamplingWRSketch::List::~List()
 void
 NormSamplingWRSketch::List::reset()
 {
-    for (uint32_t i = 0; i < m_length; ++i)
-    {
-        if (is_not_bit47_extended<63>(m_items[i].m_dvec))
-        {
-            delete [](xor_bit<63>(m_items[i].m_dvec));
-        }
-    }
     delete []m_items;
     m_items = nullptr;
     m_length = m_capacity = 0;
@@ -45,18 +33,12 @@ NormSamplingWRSketch::List::reset()
 void
 NormSamplingWRSketch::List::append(
     TIMESTAMP ts,
-    double *dvec,
-    bool is_owner)
+    uint32_t row)
 {
     ensure_item_capacity(m_length + 1);
-    
-    if (is_owner)
-    {
-        dvec = xor_bit<63>(dvec);
-    }
 
     m_items[m_length].m_ts = ts;
-    m_items[m_length++].m_dvec = dvec;
+    m_items[m_length++].m_row = row;
 }
 
 size_t
@@ -65,8 +47,8 @@ NormSamplingWRSketch::List::memory_usage() const
     return 24 + sizeof(Item) * m_capacity;
 }
 
-double*
-NormSamplingWRSketch::List::dvec_last_of(
+uint32_t
+NormSamplingWRSketch::List::row_last_of(
     TIMESTAMP ts) const
 {
     Item *item = std::upper_bound(m_items, m_items + m_length, ts,
@@ -76,15 +58,9 @@ NormSamplingWRSketch::List::dvec_last_of(
 
     if (item == m_items)
     {
-        return nullptr;
+        return RowStore::invalid_id;
     }
-
-    item = item - 1;
-    if (is_not_bit47_extended<63>(item->m_dvec))
-    {
-        return xor_bit<63>(item->m_dvec);     
-    }
-    return item->m_dvec;
+    return item[-1].m_row;
 }
 
 void
@@ -112,15 +88,17 @@ NormSamplingWRSketch::List::ensure_item_capacity(
 NormSamplingWRSketch::NormSamplingWRSketch(
     uint32_t n,
     uint32_t sample_size,
-    uint32_t seed):
+    uint32_t seed,
+    RowStorageType row_storage_type):
     m_n(n),
     m_sample_size(sample_size),
     m_last_ts(0),
-    m_n_dvec_stored(0),
+    m_rows(n, row_storage_type),
     m_tot_weight(0),
     m_reservoir(new List[sample_size]),
     m_rng(seed),
     m_unif_0_1(0, 1),
+    m_hit_lists(),
     m_sqr_fnorms()
 {    
 }
@@ -134,11 +112,11 @@ void
 NormSamplingWRSketch::clear()
 {
     m_last_ts = 0;
-    m_n_dvec_stored = 0;
     for (uint32_t i = 0; i < m_sample_size; ++i)
     {
         m_reservoir[i].reset();
     }
+    m_rows.clear();
     m_tot_weight = 0;
     m_sqr_fnorms.clear();
 }
@@ -151,7 +129,7 @@ NormSamplingWRSketch::memory_usage() const
     {
         res += m_reservoir[i].memory_usage();
     }
-    res += m_n_dvec_stored * sizeof(double) * m_n;
+    res += m_rows.memory_usage();
     res += sizeof(m_sqr_fnorms) + sizeof(decltype(*m_sqr_fnorms.begin())) *
         m_sqr_fnorms.size();
     return res;
@@ -160,7 +138,11 @@ NormSamplingWRSketch::memory_usage() const
 std::string
 NormSamplingWRSketch::get_short_description() const
 {
-    return std::string("NORM_SAMPLING_WR-ss") + std::to_string(m_sample_size);
+    std::string desc = std::string("NORM_SAMPLING_WR-ss") +
+        std::to_string(m_sample_size);
+    if (m_rows.storage_type() == ROW_STORAGE_FLOAT) desc += "-f32";
+    else if (m_rows.storage_type() == ROW_STORAGE_BFLOAT16) desc += "-bf16";
+    return desc;
 }
 
 void
@@ -176,20 +158,56 @@ NormSamplingWRSketch::update(
         m_last_ts = ts;
     }
 
-    double *dvec_copy = nullptr;
-    for (uint32_t i = 0; i < m_sample_size; ++i)
+    if (l2_sqr <= 0) return ;
+
+    // Each list independently takes the row with probability
+    // l2_sqr / m_tot_weight. So the number of lists that take it is
+    // binomial, and given that number, the lists are a uniformly random
+    // subset of all the lists.
+    double p = std::min(l2_sqr / m_tot_weight, 1.0);
+    std::binomial_distribution<uint32_t> binom(m_sample_size, p);
+    uint32_t num_hits = binom(m_rng);
+    if (num_hits == 0) return ;
+
+    sample_hit_lists(num_hits);
+    uint32_t row = m_rows.append(dvec);
+    for (uint32_t i: m_hit_lists)
+    {
+        m_reservoir[i].append(ts, row);
+    }
+}
+
+void
+NormSamplingWRSketch::sample_hit_lists(
+    uint32_t num_hits)
+{
+    m_hit_lists.clear();
+    if (num_hits <= 64 && num_hits * 8ull < m_sample_size)
     {
-        double r = m_unif_0_1(m_rng) * m_tot_weight;
-        if (r < l2_sqr) {
-            if (!dvec_copy) {
-                dvec_copy = new double[m_n];
-                memcpy(dvec_copy, dvec, sizeof(double) * m_n);
-                m_reservoir[i].append(ts, dvec_copy, true);
-                ++m_n_dvec_stored;
+        // Floyd's algorithm, with a linear search for the few lists
+        // already sampled
+        for (uint32_t j = m_sample_size - num_hits; j < m_sample_size; ++j)
+        {
+            std::uniform_int_distribution<uint32_t> unif(0, j);
+            uint32_t i = unif(m_rng);
+            if (std::find(m_hit_lists.begin(), m_hit_lists.end(), i) !=
+                m_hit_lists.end())
+            {
+                i = j;
             }
-            else
+            m_hit_lists.push_back(i);
+        }
+    }
+    else
+    {
+        // selection sampling (Knuth's Algorithm S)
+        uint32_t num_needed = num_hits;
+        for (uint32_t i = 0; num_needed > 0; ++i)
+        {
+            if (m_unif_0_1(m_rng) * (m_sample_size - i) < num_needed)
             {
-                m_reservoir[i].append(ts, dvec_copy, false);
+                m_hit_lists.push_back(i);
+                --num_needed;
             }
         }
     }
@@ -202,23 +220,36 @@ NormSamplingWRSketch::get_covariance_matrix(
 {
     memset(A, 0, m_n * (m_n + 1) / 2 * sizeof(double));
     
-    double sample_fnorm_sqr = 0;
+    // only used if the rows are not stored in double
+    std::vector<double> buf(
+        (m_rows.storage_type() == ROW_STORAGE_DOUBLE) ? 0 : m_n);
+
+    std::vector<uint32_t> rows;
+    rows.reserve(m_sample_size);
     for (uint32_t i = 0; i < m_sample_size ; ++i)
     {
-        double *dvec = m_reservoir[i].dvec_last_of(ts_e); 
-        if (!dvec) return ; // which means we haven't seen any update
+        uint32_t row = m_reservoir[i].row_last_of(ts_e);
+        // which means we haven't seen any update
+        if (row == RowStore::invalid_id) return ;
+        rows.push_back(row);
+    }
+
+    // a row sampled by k lists is added once with weight k
+    std::sort(rows.begin(), rows.end());
+    PackedGramAccumulator acc(m_n, A);
+    double sample_fnorm_sqr = 0;
+    for (size_t i = 0; i < rows.size(); )
+    {
+        size_t j = i + 1;
+        while (j < rows.size() && rows[j] == rows[i]) ++j;
+
+        const double *dvec = m_rows.get(rows[i], buf.data());
         double two_norm_sqr = cblas_ddot(m_n, dvec, 1, dvec, 1);
-        cblas_dspr(
-            CblasColMajor,
-            CblasUpper,
-            m_n,
-            //1.0 / two_norm_sqr,
-            1.0,
-            dvec,
-            1,
-            A);
-        sample_fnorm_sqr += two_norm_sqr;
+        acc.add(dvec, (double) (j - i));
+        sample_fnorm_sqr += two_norm_sqr * (j - i);
+        i = j;
     }
+    acc.flush();
     
     double tot_fnorm_sqr;
     if (ts_e >= m_last_ts)
@@ -254,7 +285,18 @@ NormSamplingWRSketch::create_from_config(int idx)
     sample_size = g_config->get_u32("NORM_SAMPLING_WR.sample_size", idx).value();
     seed = g_config->get_u32("NORM_SAMPLING_WR.seed", -1).value();
 
-    return new NormSamplingWRSketch(n, sample_size, seed);
+    RowStorageType row_storage_type;
+    std::string row_storage_str =
+        g_config->get("NORM_SAMPLING_WR.row_storage").value();
+    if (!parse_row_storage_type(row_storage_str, row_storage_type))
+    {
+        std::cerr << "[WARN] invalid NORM_SAMPLING_WR.row_storage "
+            << row_storage_str << " (double, float or bfloat16 required), "
+            << "using double" << std::endl;
+        row_storage_type = ROW_STORAGE_DOUBLE;
+    }
+
+    return new NormSamplingWRSketch(n, sample_size, seed, row_storage_type);
 }
 
 int
@@ -2,8 +2,10 @@
 #define NORM_SAMPLING_WR_H
 
 #include "sketch.h"
+#include "row_store.h"
 #include <random>
 #include <map>
+#include <vector>
 
 class NormSamplingWRSketch:
     public IPersistentMatrixSketch
@@ -12,9 +14,8 @@ private:
     struct Item
     {
         TIMESTAMP               m_ts;
-    
-        // flip bit 63 to indicate ownership
-        double                  *m_dvec;
+
+        uint32_t                m_row; // in m_rows
     };
 
     struct List
@@ -30,15 +31,15 @@ private:
         void
         append(
             TIMESTAMP ts,
-            double *dvec,
-            bool is_owner);
+            uint32_t row);
 
         size_t
         memory_usage() const;
     
-        // transparently return the latest dvec up to timestamp ts
-        double*
-        dvec_last_of(
+        // returns the latest row up to timestamp ts, or
+        // RowStore::invalid_id if there's none
+        uint32_t
+        row_last_of(
             TIMESTAMP ts) const;
 
     private:
@@ -56,7 +57,8 @@ public:
     NormSamplingWRSketch(
         uint32_t n,
         uint32_t sample_size,
-        uint32_t seed = 19950810u);
+        uint32_t seed = 19950810u,
+        RowStorageType row_storage_type = ROW_STORAGE_DOUBLE);
 
     virtual
     ~NormSamplingWRSketch();
@@ -81,13 +83,18 @@ public:
         double *A) const override;
     
 private:
+    // Samples num_hits distinct lists uniformly at random into m_hit_lists.
+    void
+    sample_hit_lists(
+        uint32_t num_hits);
+
     int                         m_n;
     
     uint32_t                    m_sample_size;
 
     TIMESTAMP                   m_last_ts;
 
-    uint64_t                    m_n_dvec_stored;
+    RowStore                    m_rows;
 
     double                      m_tot_weight;
 
@@ -98,6 +105,8 @@ private:
     std::uniform_real_distribution<double>
                                 m_unif_0_1;
 
+    std::vector<uint32_t>       m_hit_lists;
+
     std::map<TIMESTAMP, double> m_sqr_fnorms;
 
 public:
@@ -9,12 +9,16 @@ PAMSketch::PAMSketch(double eps, double delta, double Delta,
     w(ceil(exp(1)/eps)),
     d(ceil(log(1/delta))),
     D(Delta),
-    p_sampling(1/Delta),
+    m_sample_blocks(),
+    m_sample_index(),
+    m_u32_hash_param(),
+    m_num_sign_groups((d + 7) / 8),
+    m_sign_table(),
     rgen(seed),
+    m_log1m_sampling_p(std::log1p(-std::min(1., 1 / Delta))),
     m_eps(eps),
     m_delta(delta),
-    m_Delta(Delta),
-    m_u32_hash_param() {
+    m_Delta(Delta) {
 
     C.resize(d);
     for (unsigned int i = 0; i < d; i++) {
@@ -22,25 +26,35 @@ PAMSketch::PAMSketch(double eps, double delta, double Delta,
     }
 
     //srand(time(NULL));
-    std::uniform_int_distribution<int> unif(0, std::numeric_limits<int>::max());
-    ksi.resize(d);
+    prepare_row_hash();
+
+    uint64_t sampling_seed = rgen();
+    sampling_seed = (sampling_seed << 32) | rgen();
+    m_sampling_rng.resize(d);
+    m_sampling_skip.resize(d);
     for (unsigned int i = 0; i < d; i++) {
-        ksi[i] = std::make_tuple(
-            unif(rgen), unif(rgen), unif(rgen), unif(rgen));
+        m_sampling_rng[i].seed(CounterRNG::mix(sampling_seed + i));
+        m_sampling_skip[i] = draw_sampling_skip(i);
     }
-
-    prepare_u32_hash();
 }
 
-void PAMSketch::prepare_u32_hash()
+void PAMSketch::prepare_row_hash()
 {
-    std::uniform_int_distribution<uint64_t> unif(0, (((uint64_t) 1) << 63) - 1);
-    m_u32_hash_param.resize(d); 
+    std::uniform_int_distribution<uint64_t> unif;
+    m_u32_hash_param.resize(d);
     for (unsigned int i = 0; i < d; ++i)
     {
         m_u32_hash_param[i].first = unif(rgen);
         m_u32_hash_param[i].second = unif(rgen);
     }
+
+    // 4 random bytes per draw, sign_table_size is a multiple of 4
+    m_sign_table.resize(sign_table_size * m_num_sign_groups);
+    for (size_t i = 0; i < m_sign_table.size(); i += 4)
+    {
+        uint32_t r = rgen();
+        std::memcpy(&m_sign_table[i], &r, sizeof(r));
+    }
 }
 
 void PAMSketch::clear() {
@@ -48,6 +62,30 @@ void PAMSketch::clear() {
         C[i].clear();
         C[i].resize(w);
     }
+    m_sample_blocks.clear();
+    m_sample_index.clear();
+}
+
+void PAMSketch::add_sample(Counter &counter, TIMESTAMP ts) {
+    // append to the last block of the counter if it fits
+    if (counter.num_blocks != 0) {
+        SampleBlock &blk = m_sample_blocks[
+            m_sample_index.at(counter.index_block, counter.num_blocks - 1)];
+        if (blk.num_samples < samples_per_block &&
+            ts - blk.first_ts <= std::numeric_limits<uint32_t>::max()) {
+            blk.ts_offset[blk.num_samples - 1] = (uint32_t)(ts - blk.first_ts);
+            blk.val[blk.num_samples++] = counter.val;
+            return;
+        }
+    }
+
+    SampleBlock blk;
+    blk.first_ts = ts;
+    blk.val[0] = counter.val;
+    blk.num_samples = 1;
+    uint32_t off = m_sample_blocks.push_back(blk);
+    m_sample_index.push_back(counter.index_block, counter.index_size_class,
+        counter.num_blocks++, off);
 }
 
 void PAMSketch::update(unsigned long long t, const char *str, int c) {
@@ -65,18 +103,48 @@ PAMSketch::update(
 
 void PAMSketch::update_impl(TIMESTAMP ts, uint64_t hashval, int c)
 {
+    // All the rows are hashed in this pass, where one lookup gives the sign
+    // flags of 8 rows.
+    uint32_t x = fold_key(hashval);
+    unsigned signs = 0;
     for (unsigned int j = 0; j < d; j++) {
-        unsigned int h = u32_hash(j, hashval);
-        unsigned int f = flag(j, hashval);
+        if ((j & 7) == 0) signs = sign_bits(j >> 3, x);
+        unsigned int h = row_bucket(j, x);
+        unsigned int f = (signs >> (j & 7)) & 1;
         C[j][h][f].val += c;
 
-        if (p_sampling(rgen)) {
-            C[j][h][f].samples.emplace_back(std::make_pair(ts, C[j][h][f].val));
+        if (should_sample(j)) {
+            add_sample(C[j][h][f], ts);
         }
     }
 
 }
 
+void
+PAMSketch::update_batch(
+    const UpdateRecord_u32 *records,
+    size_t n)
+{
+    // Each row has its own sampling stream (see m_sampling_rng), so we can
+    // process the batch one row at a time as PCMSketch does and still sample
+    // the same updates as update() does.
+    std::vector<uint8_t> signs;
+    sign_bits_batch(n, [records](size_t i) { return records[i].m_value; },
+        signs);
+    for (unsigned int j = 0; j < d; j++) {
+        for (size_t i = 0; i < n; ++i) {
+            unsigned int h = row_bucket(j, records[i].m_value);
+            unsigned int f = sign_of(&signs[i * m_num_sign_groups], j);
+            Counter &counter = C[j][h][f];
+            counter.val += records[i].m_c;
+
+            if (should_sample(j)) {
+                add_sample(counter, records[i].m_ts);
+            }
+        }
+    }
+}
+
 double
 PAMSketch::estimate_point_in_interval(
     const char *str,
@@ -97,20 +165,62 @@ PAMSketch::estimate_point_in_interval_impl(
 {
     std::vector<double> D;
     D.reserve(d);
+    // all the rows are hashed in this pass as in update_impl()
+    uint32_t x = fold_key(hashval);
+    unsigned signs = 0;
     for (unsigned int j = 0; j < d; j++) {
-        unsigned int h = u32_hash(j, hashval);
-        int Xi_value = Xi(j, hashval);
+        if ((j & 7) == 0) signs = sign_bits(j >> 3, x);
+        unsigned int h = row_bucket(j, x);
+        int Xi_value = Xi((signs >> (j & 7)) & 1);
         double D_s = Xi_value * (estimate_C(j, h, 1, s) - estimate_C(j, h, 0, s));
         double D_e = Xi_value * (estimate_C(j, h, 1, e) - estimate_C(j, h, 0, e));
         
         D.push_back(D_e - D_s);
     }
 
-    std::sort(D.begin(), D.end());
-    if (d & 1) {
-        return D[d/2];
-    } else {
-        return (D[d/2] + D[d/2 - 1]) / 2.;
+    return get_median(D.data(), d);
+}
+
+void
+PAMSketch::estimate_frequency_batch_impl(
+    const uint32_t *keys,
+    size_t n,
+    TIMESTAMP s,
+    TIMESTAMP e,
+    uint64_t *cnts) const
+{
+    // D[i * d + j] is the estimate of keys[i] in row j
+    std::vector<double> D(n * d);
+
+    // Memoize the counter differences of the cells in a row at s and e if
+    // there are enough keys to make it worthwhile, where NaN marks a cell
+    // not looked up yet.
+    bool memoize = n * 4 >= w;
+    std::vector<std::pair<double, double>> C_diffs(memoize ? w : 0);
+    std::vector<uint8_t> signs;
+    sign_bits_batch(n, [keys](size_t i) { return keys[i]; }, signs);
+    for (unsigned int j = 0; j < d; j++) {
+        fill(C_diffs.begin(), C_diffs.end(), std::make_pair(NAN, NAN));
+        for (size_t i = 0; i < n; ++i) {
+            unsigned int h = row_bucket(j, keys[i]);
+            unsigned int f = sign_of(&signs[i * m_num_sign_groups], j);
+            std::pair<double, double> C_diff;
+            if (memoize && !std::isnan(C_diffs[h].first)) {
+                C_diff = C_diffs[h];
+            } else {
+                C_diff.first = estimate_C(j, h, 1, s) - estimate_C(j, h, 0, s);
+                C_diff.second = estimate_C(j, h, 1, e) - estimate_C(j, h, 0, e);
+                if (memoize) C_diffs[h] = C_diff;
+            }
+            int Xi_value = Xi(f);
+            D[i * d + j] = Xi_value * C_diff.second - Xi_value * C_diff.first;
+        }
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        // the signed estimate may be negative
+        cnts[i] = (uint64_t) std::round(
+            std::max(0., get_median(&D[i * d], d)));
     }
 }
 
@@ -123,27 +233,32 @@ PAMSketch::estimate_point_at_the_time(
 }
 
 double PAMSketch::estimate_C(unsigned j, unsigned i, unsigned f, unsigned long long t) const {
-    auto &samples = C[j][i][f].samples;
+    const Counter &counter = C[j][i][f];
 
-    auto r = samples.size(), l = (decltype(r)) 0;
-    
-    while (l < r) {
-        auto mid = (l + r) / 2;
-        if (samples[mid].first == t) {
-            l = mid + 1;
-            break;
-        } else if (samples[mid].first < t) {
-            l = mid + 1;
+    // find the last block that starts no later than t
+    const uint32_t *index = m_sample_index.data(counter.index_block);
+    int l = 0;
+    int r = (int) counter.num_blocks - 1;
+    while (l <= r) {
+        int mid = (l + r) / 2;
+        if (m_sample_blocks[index[mid]].first_ts > t) {
+            r = mid - 1;
         } else {
-            r = mid;
+            l = mid + 1;
         }
     }
-    
-    if (l == 0) {
+    if (r < 0) {
         return 0;
-    } else {
-        return samples[l - 1].second + D - 1;
     }
+
+    // the last sample no later than t
+    const SampleBlock &blk = m_sample_blocks[index[r]];
+    unsigned long long t_offset = t - blk.first_ts;
+    unsigned k = 1;
+    while (k < blk.num_samples && blk.ts_offset[k - 1] <= t_offset) {
+        ++k;
+    }
+    return blk.val[k - 1] + D - 1;
 }
 
 uint64_t
@@ -152,7 +267,17 @@ PAMSketch::estimate_frequency(
     uint32_t key) const
 {
     return (uint64_t) std::round(
-            estimate_point_in_interval_impl(key, 0, ts_e));
+            std::max(0., estimate_point_in_interval_impl(key, 0, ts_e)));
+}
+
+void
+PAMSketch::estimate_frequency_batch(
+    TIMESTAMP ts_e,
+    const uint32_t *keys,
+    size_t n,
+    uint64_t *cnts) const
+{
+    estimate_frequency_batch_impl(keys, n, 0, ts_e, cnts);
 }
 
 uint64_t
@@ -160,21 +285,28 @@ PAMSketch::estimate_frequency_bitp(
     TIMESTAMP ts_s,
     uint32_t key) const
 {
-    return (uint64_t) std::round(
-            estimate_point_in_interval_impl(key, ts_s, (TIMESTAMP) ~0ul));
+    return (uint64_t) std::round(std::max(0.,
+            estimate_point_in_interval_impl(key, ts_s, (TIMESTAMP) ~0ul)));
+}
+
+void
+PAMSketch::estimate_frequency_bitp_batch(
+    TIMESTAMP ts_s,
+    const uint32_t *keys,
+    size_t n,
+    uint64_t *cnts) const
+{
+    estimate_frequency_batch_impl(keys, n, ts_s, (TIMESTAMP) ~0ul, cnts);
 }
 
 size_t PAMSketch::memory_usage() const {
-    size_t mem = sizeof(*this) + sizeof(double) * m_u32_hash_param.size();
+    size_t mem = sizeof(*this);
     
     mem += 2 * sizeof(Counter) * C.capacity() * C[0].capacity();
-    for (unsigned j = 0; j < d; ++j)
-    for (unsigned h = 0; h < w; ++h) {
-        mem += sizeof(C[j][h][0].samples.front()) *
-            (C[j][h][0].samples.capacity() + C[j][h][1].samples.capacity());
-    }
+    mem += m_sample_blocks.memory_usage() + m_sample_index.memory_usage();
 
-    mem += ksi.capacity() * sizeof(ksi[0]);
+    mem += m_u32_hash_param.capacity() * sizeof(m_u32_hash_param[0]);
+    mem += m_sign_table.capacity() * sizeof(m_sign_table[0]);
 
     return mem;
 }
@@ -11,6 +11,7 @@
 #include <tuple>
 #include "util.h"
 #include "sketch.h"
+#include "chunked_array.h"
 #include "MurmurHash3.h"
 
 
@@ -20,29 +21,74 @@ class PAMSketch:
     public IPersistentFrequencyEstimationSketchBITP // u32
     {
     protected:
+        // The samples of a counter are stored in SampleBlocks, whose offsets
+        // are in the counter's list in m_sample_index.
         struct Counter {
-            Counter(): val(0), samples() {}
+            Counter(): val(0), num_blocks(0),
+                index_block(OffsetListPool::invalid_offset),
+                index_size_class(0) {}
 
             int val;
-            std::vector<std::pair<unsigned long long, int>> samples;
+            uint32_t num_blocks;
+            uint32_t index_block;
+            uint8_t index_size_class;
         };
+
+        static constexpr unsigned samples_per_block = 7;
+
+        // Consecutive samples of a counter in 64 bytes. The timestamps are
+        // stored as offsets from first_ts and the values in a separate
+        // column. A new block is started when a block is full or an offset
+        // does not fit in 32 bits.
+        struct SampleBlock {
+            unsigned long long first_ts;
+            // of the samples 1 .. num_samples - 1
+            uint32_t ts_offset[samples_per_block - 1];
+            int val[samples_per_block];
+            uint32_t num_samples;
+        };
+
+        static constexpr unsigned sample_chunk_shift = 6;
     
         const unsigned int w, d, D;
         std::vector<std::vector<std::array<Counter, 2>>> C;
 
-        // need 4-wise independent hash rather than 2-wise
-        std::vector<std::tuple<int, int, int, int>> ksi;
+        ChunkedArray<SampleBlock, sample_chunk_shift> m_sample_blocks;
+
+        OffsetListPool m_sample_index;
 
-        std::bernoulli_distribution p_sampling;
+        // The parameters (a, b) of the bucket hash of each row, see
+        // row_bucket(). A 2-wise independent hash is enough for the bucket.
+        std::vector<std::pair<uint64_t, uint64_t>> m_u32_hash_param;
+
+        // The sign needs a 4-wise independent hash rather than 2-wise. The
+        // sign flags of rows 8g .. 8g + 7 are the bits of one tabulation
+        // hash, see sign_bits(), whose tables are
+        // m_sign_table[g * sign_table_size, (g + 1) * sign_table_size). So
+        // the flags of up to 8 rows of a key take three lookups.
+        unsigned m_num_sign_groups;
+
+        std::vector<uint8_t> m_sign_table;
 
         std::mt19937 rgen;
 
+        // A sample is recorded with probability 1 / Delta on each counter
+        // update. Rather than drawing that on every update, we keep in
+        // m_sampling_skip[j] the number of updates in row j before its next
+        // sample, which is geometrically distributed.
+        double m_log1m_sampling_p;
+
+        std::vector<uint64_t> m_sampling_skip;
+
+        // Each row draws its skips from its own stream, so the samples of a
+        // row only depend on the updates to that row, in whatever order
+        // update() and update_batch() visit the rows.
+        std::vector<CounterRNG> m_sampling_rng;
+
         double m_eps;
         double m_delta;
         double m_Delta;
     
-        std::vector<std::pair<uint64_t, uint64_t>> m_u32_hash_param;
-    
     public:
         PAMSketch(double eps, double delta, double Delta,
                 uint32_t seed = 19950810u);
@@ -57,6 +103,11 @@ class PAMSketch:
             uint32_t value,
             int c = 1) override;
 
+        void
+        update_batch(
+            const UpdateRecord_u32 *records,
+            size_t n) override;
+
         double
         estimate_point_in_interval(
             const char *str,
@@ -72,12 +123,26 @@ class PAMSketch:
         estimate_frequency(
             TIMESTAMP ts_e,
             uint32_t key) const override;
+
+        void
+        estimate_frequency_batch(
+            TIMESTAMP ts_e,
+            const uint32_t *keys,
+            size_t n,
+            uint64_t *cnts) const override;
         
         uint64_t
         estimate_frequency_bitp(
             TIMESTAMP ts_s,
             uint32_t key) const override;
 
+        void
+        estimate_frequency_bitp_batch(
+            TIMESTAMP ts_s,
+            const uint32_t *keys,
+            size_t n,
+            uint64_t *cnts) const override;
+
         size_t memory_usage() const override;
 
         std::string get_short_description() const override;
@@ -89,6 +154,16 @@ class PAMSketch:
             uint64_t hashval,
             TIMESTAMP ts_s,
             TIMESTAMP ts_e) const;
+
+        // Estimates keys[0..n) in [ts_s, ts_e] into cnts[0..n). Cells are
+        // looked up only once per batch if there are many keys per row.
+        void
+        estimate_frequency_batch_impl(
+            const uint32_t *keys,
+            size_t n,
+            TIMESTAMP ts_s,
+            TIMESTAMP ts_e,
+            uint64_t *cnts) const;
     
         // use j^th hash to hash value i
         //inline unsigned int h(unsigned j, const void *dat, size_t len) {
@@ -97,24 +172,78 @@ class PAMSketch:
         //    return (h[0] ^ h[1]) % w;
         //}
 
-        // j^th ksi to hash value i (mapped to 0, 1)
-        inline unsigned int flag(unsigned j, unsigned int i) const {
-            return (((std::get<0>(ksi[j]) * i + std::get<1>(ksi[j]))
-                * i + std::get<2>(ksi[j])) * i + std::get<3>(ksi[j])) % 2;
+        // Keys are hashed as 32-bit values: a u32 key as is and the 64-bit
+        // hash of a string folded into 32 bits.
+        static uint32_t fold_key(uint64_t key) {
+            return (uint32_t)(key ^ (key >> 32));
+        }
+
+        // Bucket of x in row j in [0, w). The high 32 bits of a * x + b mod
+        // 2^64 are 2-wise independent (multiply-add-shift), and are mapped
+        // onto [0, w) by multiply-shift range reduction.
+        inline unsigned row_bucket(unsigned j, uint32_t x) const {
+            uint64_t y = m_u32_hash_param[j].first * x + m_u32_hash_param[j].second;
+            return (unsigned)(((y >> 32) * w) >> 32);
+        }
+
+        // T0, T1 and T2 with 2^16, 2^16 and 2^17 entries
+        static constexpr size_t sign_table_size = (size_t) 1 << 18;
+
+        // The sign flags of rows 8g .. 8g + 7 of x in bits 0 .. 7, which are
+        // T0[x0] ^ T1[x1] ^ T2[x0 + x1] for the 16-bit halves x0, x1 of x.
+        // With random tables, this is 4-wise (in fact 5-wise) independent
+        // (Thorup and Zhang, Tabulation-based 5-independent hashing).
+        inline unsigned sign_bits(unsigned g, uint32_t x) const {
+            const uint8_t *t = m_sign_table.data() + g * sign_table_size;
+            uint32_t x0 = x & 0xffffu;
+            uint32_t x1 = x >> 16;
+            return t[x0] ^ t[0x10000u + x1] ^ t[0x20000u + x0 + x1];
         }
 
-        inline int Xi(unsigned j,  unsigned i) const {
-            return (int)(flag(j, i) * 2) - 1;
+        // The sign flag (mapped to 0, 1) of row j in the sign bits of all
+        // the rows of a key, m_num_sign_groups bytes
+        static unsigned sign_of(const uint8_t *bits, unsigned j) {
+            return (bits[j >> 3] >> (j & 7)) & 1;
+        }
+
+        // The sign bits of all the rows of key(0) .. key(n - 1) into bits,
+        // m_num_sign_groups bytes per key, for the batch functions that go
+        // row by row. Each key is looked up once rather than once per row.
+        template<typename KeyFunc>
+        void sign_bits_batch(size_t n, KeyFunc key, std::vector<uint8_t> &bits) const {
+            bits.resize(n * m_num_sign_groups);
+            uint8_t *b = bits.data();
+            for (size_t i = 0; i < n; ++i) {
+                uint32_t x = fold_key(key(i));
+                for (unsigned g = 0; g < m_num_sign_groups; ++g) {
+                    *b++ = sign_bits(g, x);
+                }
+            }
+        }
+
+        static inline int Xi(unsigned f) {
+            return (int)(f * 2) - 1;
         }
 
         double estimate_C(unsigned j, unsigned i, unsigned int f, unsigned long long t) const;
 
-        void prepare_u32_hash();
+        void add_sample(Counter &counter, TIMESTAMP ts);
+
+        void prepare_row_hash();
+
+        uint64_t draw_sampling_skip(unsigned j) {
+            return geometric_skip(m_sampling_rng[j].next_double_oc(),
+                m_log1m_sampling_p);
+        }
 
-        unsigned int u32_hash(unsigned j, uint64_t key) const
-        {
-            auto x = m_u32_hash_param[j].first * key + m_u32_hash_param[j].second;
-            return (unsigned)(x % w);
+        // Returns whether to record a sample on this update of row j.
+        bool should_sample(unsigned j) {
+            if (m_sampling_skip[j] == 0) {
+                m_sampling_skip[j] = draw_sampling_skip(j);
+                return true;
+            }
+            --m_sampling_skip[j];
+            return false;
         }
 
     public:
@@ -34,8 +34,11 @@ void CMSketch::update(const char *str, int c) {
 
 void CMSketch::update_impl(uint64_t hashval, int c)
 {
+    unsigned hs[max_unrolled_depth];
+    bool unrolled = d <= max_unrolled_depth;
+    if (unrolled) hash_all_rows(hashval, hs);
     for (unsigned int j = 0; j < d; j++) {
-	    int h = u32_hash(j, hashval);
+	    unsigned h = unrolled ? hs[j] : u32_hash(j, hashval);
         C[j][h] += c;
     }
 }
@@ -46,8 +49,11 @@ uint64_t CMSketch::estimate(const char *str) const {
 
 uint64_t CMSketch::estimate_impl(uint64_t hashval) const {
     int val = numeric_limits<int>::max();
+    unsigned hs[max_unrolled_depth];
+    bool unrolled = d <= max_unrolled_depth;
+    if (unrolled) hash_all_rows(hashval, hs);
     for (unsigned int j = 0; j < d; j++) {
-	    unsigned int h = u32_hash(j, hashval);
+	    unsigned int h = unrolled ? hs[j] : u32_hash(j, hashval);
         val = min(val, C[j][h]);
     }
     return val;
@@ -59,26 +65,16 @@ size_t CMSketch::memory_usage() const {
 }
 
 // PCMSketch below
-PCMSketch::PCMSketch(double eps, double delta, double Delta, uint64_t seed): 
+PCMSketch::PCMSketch(double eps, double delta, double Delta, uint64_t seed,
+    PLAMode pla_mode): 
     CMSketch(eps, delta, seed),
-    m_eps(eps), m_delta(delta), m_Delta(Delta) {
-
-    pla.resize(d);
-    for (unsigned int i = 0; i < d; i++) {
-        pla[i].reserve(w);
-        for (unsigned int j = 0; j < w; j++) {
-            pla[i].push_back(PLA(Delta));
-        }
-    }
+    pla((size_t) w * d, Delta, pla_mode),
+    m_eps(eps), m_delta(delta), m_Delta(Delta), m_pla_mode(pla_mode) {
 }
 
 void PCMSketch::clear() {
     CMSketch::clear();
-    for (unsigned int i = 0; i < d; i++) {
-        for (unsigned int j= 0; j < w; j++) {
-            pla[i][j].clear();
-        }
-    }
+    pla.clear();
 }
 
 void PCMSketch::update(unsigned long long t, const char *str, int c) {
@@ -95,10 +91,31 @@ PCMSketch::update(
 }
 
 void PCMSketch::update_impl(TIMESTAMP ts, uint64_t hashval, int c) {
+    unsigned hs[max_unrolled_depth];
+    bool unrolled = d <= max_unrolled_depth;
+    if (unrolled) hash_all_rows(hashval, hs);
     for (unsigned int j = 0; j < d; j++) {
-	    unsigned h = u32_hash(j, hashval);
+	    unsigned h = unrolled ? hs[j] : u32_hash(j, hashval);
         C[j][h] += c;
-        pla[j][h].feed({ts, (double)C[j][h]});
+        pla.feed((size_t) j * w + h, {ts, (double)C[j][h]});
+    }
+}
+
+void
+PCMSketch::update_batch(
+    const UpdateRecord_u32 *records,
+    size_t n)
+{
+    // Rows are independent so we can process the batch one row at a time.
+    // Each cell still sees its updates in the original order.
+    for (unsigned int j = 0; j < d; j++) {
+        int *C_j = C[j].data();
+        size_t row_start = (size_t) j * w;
+        for (size_t i = 0; i < n; ++i) {
+            unsigned h = u32_hash(j, records[i].m_value);
+            C_j[h] += records[i].m_c;
+            pla.feed(row_start + h, {records[i].m_ts, (double) C_j[h]});
+        }
     }
 }
 double PCMSketch::estimate_point_in_interval(
@@ -111,21 +128,58 @@ double PCMSketch::estimate_point_in_interval(
 double PCMSketch::estimate_point_in_interval_impl(
     uint64_t hashval, TIMESTAMP ts_s, TIMESTAMP ts_e) const {
     
-    double *vals = new double[d];
+    double vals_buf[16];
+    std::vector<double> vals_vec;
+    double *vals = vals_buf;
+    if (d > 16) {
+        vals_vec.resize(d);
+        vals = vals_vec.data();
+    }
+    unsigned hs[max_unrolled_depth];
+    bool unrolled = d <= max_unrolled_depth;
+    if (unrolled) hash_all_rows(hashval, hs);
+    for (unsigned int j = 0; j < d; j++) {
+        unsigned h = unrolled ? hs[j] : u32_hash(j, hashval);
+        size_t cell = (size_t) j * w + h;
+        vals[j] = pla.estimate(cell, ts_e) - pla.estimate(cell, ts_s);
+    }
+    return sort_and_get_median(vals, d);
+}
+
+void PCMSketch::estimate_frequency_batch_impl(
+    const uint32_t *keys,
+    size_t n,
+    TIMESTAMP ts_s,
+    TIMESTAMP ts_e,
+    uint64_t *cnts) const {
+
+    // vals[i * d + j] is the estimate of keys[i] in row j
+    std::vector<double> vals(n * d);
+
+    // Memoize the estimates of the cells in a row if there are enough keys
+    // to make it worthwhile, where NaN marks a cell not looked up yet.
+    bool memoize = n * 4 >= w;
+    std::vector<double> cell_vals(memoize ? w : 0);
     for (unsigned int j = 0; j < d; j++) {
-        unsigned h = u32_hash(j, hashval);
-        const PLA &target = pla[j][h];
-        vals[j] = target.estimate(ts_e) - target.estimate(ts_s);
+        size_t row_start = (size_t) j * w;
+        fill(cell_vals.begin(), cell_vals.end(), NAN);
+        for (size_t i = 0; i < n; ++i) {
+            unsigned h = u32_hash(j, keys[i]);
+            double v;
+            if (memoize && !std::isnan(cell_vals[h])) {
+                v = cell_vals[h];
+            } else {
+                size_t cell = row_start + h;
+                v = pla.estimate(cell, ts_e) - pla.estimate(cell, ts_s);
+                if (memoize) cell_vals[h] = v;
+            }
+            vals[i * d + j] = v;
+        }
     }
-    sort(vals, vals + d);
-    double ret;
-    if (d & 1) { // d is odd
-        ret = vals[d/2];
-    } else {
-        ret = (vals[d/2] + vals[(d/2)-1]) / 2;
+
+    for (size_t i = 0; i < n; ++i) {
+        cnts[i] = (uint64_t) std::round(sort_and_get_median(&vals[i * d], d));
     }
-    delete []vals;
-    return ret;
 }
 
 double PCMSketch::estimate_point_at_the_time(
@@ -144,6 +198,16 @@ PCMSketch::estimate_frequency(
             estimate_point_in_interval_impl(key, 0, ts_e));
 }
 
+void
+PCMSketch::estimate_frequency_batch(
+    TIMESTAMP ts_e,
+    const uint32_t *keys,
+    size_t n,
+    uint64_t *cnts) const
+{
+    estimate_frequency_batch_impl(keys, n, 0, ts_e, cnts);
+}
+
 uint64_t
 PCMSketch::estimate_frequency_bitp(
     TIMESTAMP ts_s,
@@ -153,19 +217,24 @@ PCMSketch::estimate_frequency_bitp(
             estimate_point_in_interval_impl(key, ts_s, (TIMESTAMP) ~0ul));
 }
 
+void
+PCMSketch::estimate_frequency_bitp_batch(
+    TIMESTAMP ts_s,
+    const uint32_t *keys,
+    size_t n,
+    uint64_t *cnts) const
+{
+    estimate_frequency_batch_impl(keys, n, ts_s, (TIMESTAMP) ~0ul, cnts);
+}
+
 size_t PCMSketch::memory_usage() const {
-    size_t sum = 0;
-    for (unsigned int i = 0; i < d; i++) {
-        for (unsigned int j = 0; j < w; j++) {
-            sum += (size_t) pla[i][j].memory_usage();
-        }
-    }
-    return (size_t) CMSketch::memory_usage() + sum;
+    return (size_t) CMSketch::memory_usage() + (size_t) pla.memory_usage();
 }
 
 std::string PCMSketch::get_short_description() const {
     std::ostringstream oss;
     oss << std::fixed << "PCM-e" << m_eps << "-d" << m_delta << "-D" << m_Delta;
+    if (m_pla_mode == PLA_OPTIMAL) oss << "-optPLA";
     return oss.str();
 }
 
@@ -205,6 +274,14 @@ PCMSketch *PCMSketch::create_from_config(int idx) {
     double Delta = g_config->get_double("PCM.Delta", idx).value();
     uint32_t seed = g_config->get_u32("PCM.seed").value();
 
-    return new PCMSketch(epsilon, delta, Delta, seed);
+    PLAMode pla_mode;
+    std::string pla_mode_str = g_config->get("PCM.pla_mode").value();
+    if (!parse_pla_mode(pla_mode_str, pla_mode)) {
+        std::cerr << "[WARN] invalid PCM.pla_mode " << pla_mode_str
+            << " (swing or optimal required), using swing" << std::endl;
+        pla_mode = PLA_SWING;
+    }
+
+    return new PCMSketch(epsilon, delta, Delta, seed, pla_mode);
 }
 
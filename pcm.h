@@ -33,10 +33,48 @@ class CMSketch {
         
         uint64_t estimate_impl(uint64_t hashval) const;
 
+        // Row j hashes key with multiply-add-shift, i.e., the high 32 bits of
+        // a_j * key + b_j, and maps the result onto [0, w) with Lemire's
+        // multiply-shift range reduction instead of a 64-bit modulo.
         unsigned int u32_hash(unsigned j, uint64_t key) const
         {
-            auto x = m_u32_hash_param[j].first * key + m_u32_hash_param[j].second;
-            return (unsigned)(x % w);
+            uint64_t x = (m_u32_hash_param[j].first * key +
+                m_u32_hash_param[j].second) >> 32;
+            return (unsigned)((x * w) >> 32);
+        }
+
+        static constexpr unsigned max_unrolled_depth = 7;
+
+        // Computes u32_hash(j, key) of all the rows into h[0..d). The rows
+        // are hashed by a fully unrolled kernel if 3 <= d <= max_unrolled_depth
+        // so that the independent multiplications can overlap.
+        void hash_all_rows(uint64_t key, unsigned *h) const
+        {
+            switch (d) {
+            case 3: hash_rows_fixed<3>(key, h); break;
+            case 4: hash_rows_fixed<4>(key, h); break;
+            case 5: hash_rows_fixed<5>(key, h); break;
+            case 6: hash_rows_fixed<6>(key, h); break;
+            case 7: hash_rows_fixed<7>(key, h); break;
+            default:
+                for (unsigned j = 0; j < d; ++j) {
+                    h[j] = u32_hash(j, key);
+                }
+            }
+        }
+
+    private:
+        template<unsigned D>
+        void hash_rows_fixed(uint64_t key, unsigned *h) const
+        {
+            const std::pair<uint64_t, uint64_t> *param = m_u32_hash_param.data();
+            uint64_t x[D];
+            for (unsigned j = 0; j < D; ++j) {
+                x[j] = (param[j].first * key + param[j].second) >> 32;
+            }
+            for (unsigned j = 0; j < D; ++j) {
+                h[j] = (unsigned)((x[j] * w) >> 32);
+            }
         }
 };
 
@@ -47,14 +85,16 @@ class PCMSketch :
     public IPersistentFrequencyEstimationSketchBITP // u32 
 {
     private:
-        std::vector<std::vector<PLA>> pla;
+        PLAArray pla; // cell (j, h) is at j * w + h
 
         double m_eps;
         double m_delta;
         double m_Delta;
+        PLAMode m_pla_mode;
 
     public:
-        PCMSketch(double eps, double delta, double Delta, uint64_t seed = 19950810ul);
+        PCMSketch(double eps, double delta, double Delta, uint64_t seed = 19950810ul,
+            PLAMode pla_mode = PLA_SWING);
 
         void clear() override;
         
@@ -66,6 +106,11 @@ class PCMSketch :
             uint32_t key,
             int c = 1) override;
 
+        void
+        update_batch(
+            const UpdateRecord_u32 *records,
+            size_t n) override;
+
         double
         estimate_point_in_interval(
             const char *str,
@@ -82,11 +127,25 @@ class PCMSketch :
             TIMESTAMP ts_e,
             uint32_t key) const override;
 
+        void
+        estimate_frequency_batch(
+            TIMESTAMP ts_e,
+            const uint32_t *keys,
+            size_t n,
+            uint64_t *cnts) const override;
+
         uint64_t
         estimate_frequency_bitp(
             TIMESTAMP ts_s,
             uint32_t key) const override;
 
+        void
+        estimate_frequency_bitp_batch(
+            TIMESTAMP ts_s,
+            const uint32_t *keys,
+            size_t n,
+            uint64_t *cnts) const override;
+
         size_t memory_usage() const override;
 
         std::string get_short_description() const override;
@@ -104,6 +163,16 @@ class PCMSketch :
             TIMESTAMP ts_s,
             TIMESTAMP ts_e) const;
 
+        // Estimates keys[0..n) in [ts_s, ts_e] into cnts[0..n). Cells are
+        // looked up only once per batch if there are many keys per row.
+        void
+        estimate_frequency_batch_impl(
+            const uint32_t *keys,
+            size_t n,
+            TIMESTAMP ts_s,
+            TIMESTAMP ts_e,
+            uint64_t *cnts) const;
+
     public:
         static PCMSketch *create(int &argi, int argc, char *argv[], const char **help_str);
 
@@ -16,11 +16,12 @@ PerfTimer::measure_start()
 }
 
 void
-PerfTimer::measure_end()
+PerfTimer::measure_end(
+    uint64_t n)
 {
     auto end = clock::now();
     m_elapsed += end - m_last_start;
-    ++m_num_calls;
+    m_num_calls += n;
 }
 
 uint64_t
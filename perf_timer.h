@@ -19,8 +19,11 @@ public:
     void
     measure_start();
 
+    // n is the number of calls (e.g., updates in a batch) that this
+    // measurement covers
     void
-    measure_end();
+    measure_end(
+        uint64_t n = 1);
 
     uint64_t
     get_elapsed_ms() const;
@@ -1,8 +1,169 @@
 #include "pla.h"
+#include <cstring>
 
 using namespace std;
 
-PLA::PLA(double delta) : tollerance(delta) {
+bool parse_pla_mode(const string &str, PLAMode &mode) {
+    if (str == "swing") {
+        mode = PLA_SWING;
+    } else if (str == "optimal") {
+        mode = PLA_OPTIMAL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// ConvexHullFitter below
+ConvexHullFitter::ConvexHullFitter() :
+    m_first_x(0),
+    m_last_x(0),
+    m_num_points(0),
+    m_upper_start(0),
+    m_lower_start(0),
+    m_rect(),
+    m_upper(),
+    m_lower() {
+}
+
+void ConvexHullFitter::clear() {
+    m_num_points = 0;
+    m_upper.clear();
+    m_lower.clear();
+}
+
+bool ConvexHullFitter::add_point(unsigned long long x, double y, double tolerance) {
+    if (m_num_points == 0) {
+        hpoint p1{0, y + tolerance};
+        hpoint p2{0, y - tolerance};
+        m_first_x = m_last_x = x;
+        m_rect[0] = p1;
+        m_rect[1] = p2;
+        m_upper.clear();
+        m_lower.clear();
+        m_upper.push_back(p1);
+        m_lower.push_back(p2);
+        m_upper_start = m_lower_start = 0;
+        m_num_points = 1;
+        return true;
+    }
+
+    assert(x > m_last_x);
+    hpoint p1{(double)(x - m_first_x), y + tolerance};
+    hpoint p2{(double)(x - m_first_x), y - tolerance};
+
+    if (m_num_points == 1) {
+        m_rect[2] = p2;
+        m_rect[3] = p1;
+        m_upper.push_back(p1);
+        m_lower.push_back(p2);
+        ++m_num_points;
+        m_last_x = x;
+        return true;
+    }
+
+    hslope slope1 = slope_between(m_rect[2], m_rect[0]);
+    hslope slope2 = slope_between(m_rect[3], m_rect[1]);
+    if (slope_between(p1, m_rect[2]) < slope1 ||
+        slope_between(p2, m_rect[3]) > slope2) {
+        return false;
+    }
+
+    if (slope_between(p1, m_rect[1]) < slope2) {
+        // p1 lowers the max slope: the new max slope line goes through p1
+        // and the lower hull point that minimizes the slope
+        hslope min_slope = slope_between(m_lower[m_lower_start], p1);
+        uint32_t min_i = m_lower_start;
+        for (uint32_t i = m_lower_start + 1; i < m_lower.size(); ++i) {
+            hslope s = slope_between(m_lower[i], p1);
+            if (s > min_slope) break;
+            min_slope = s;
+            min_i = i;
+        }
+        m_rect[1] = m_lower[min_i];
+        m_rect[3] = p1;
+        m_lower_start = min_i;
+
+        size_t end = m_upper.size();
+        while (end >= m_upper_start + 2 &&
+                cross(m_upper[end - 2], m_upper[end - 1], p1) <= 0) {
+            --end;
+        }
+        m_upper.resize(end);
+        m_upper.push_back(p1);
+    }
+
+    if (slope_between(p2, m_rect[0]) > slope1) {
+        // p2 raises the min slope, symmetric to the above
+        hslope max_slope = slope_between(m_upper[m_upper_start], p2);
+        uint32_t max_i = m_upper_start;
+        for (uint32_t i = m_upper_start + 1; i < m_upper.size(); ++i) {
+            hslope s = slope_between(m_upper[i], p2);
+            if (s < max_slope) break;
+            max_slope = s;
+            max_i = i;
+        }
+        m_rect[0] = m_upper[max_i];
+        m_rect[2] = p2;
+        m_upper_start = max_i;
+
+        size_t end = m_lower.size();
+        while (end >= m_lower_start + 2 &&
+                cross(m_lower[end - 2], m_lower[end - 1], p2) >= 0) {
+            --end;
+        }
+        m_lower.resize(end);
+        m_lower.push_back(p2);
+    }
+
+    // drop the hull points that can no longer be on the extreme lines
+    if (m_upper_start >= 32 && m_upper_start * 2 >= m_upper.size()) {
+        m_upper.erase(m_upper.begin(), m_upper.begin() + m_upper_start);
+        m_upper_start = 0;
+    }
+    if (m_lower_start >= 32 && m_lower_start * 2 >= m_lower.size()) {
+        m_lower.erase(m_lower.begin(), m_lower.begin() + m_lower_start);
+        m_lower_start = 0;
+    }
+
+    ++m_num_points;
+    m_last_x = x;
+    return true;
+}
+
+void ConvexHullFitter::get_line(double &slope, double &intercept) const {
+    assert(m_num_points > 0);
+    if (m_num_points == 1) {
+        slope = 0;
+        intercept = (m_rect[0].y + m_rect[1].y) / 2;
+        return;
+    }
+
+    // Any line through the intersection of the two extreme lines with a
+    // slope between theirs is feasible.
+    hslope slope1 = slope_between(m_rect[2], m_rect[0]);
+    hslope slope2 = slope_between(m_rect[3], m_rect[1]);
+    double ix, iy;
+    double a = slope1.dx * slope2.dy - slope1.dy * slope2.dx;
+    if (a == 0) {
+        ix = m_rect[0].x;
+        iy = m_rect[0].y;
+    } else {
+        double b = ((m_rect[1].x - m_rect[0].x) * slope2.dy -
+                    (m_rect[1].y - m_rect[0].y) * slope2.dx) / a;
+        ix = m_rect[0].x + b * slope1.dx;
+        iy = m_rect[0].y + b * slope1.dy;
+    }
+    slope = (slope1.dy / slope1.dx + slope2.dy / slope2.dx) / 2;
+    intercept = iy - slope * (ix + (double) m_first_x);
+}
+
+unsigned long long ConvexHullFitter::hull_memory_usage() const {
+    return (m_upper.capacity() + m_lower.capacity()) * sizeof(hpoint);
+}
+
+// PLA below
+PLA::PLA(double delta, PLAMode mode) : tollerance(delta), mode(mode) {
     clear();
 }
 
@@ -11,12 +172,19 @@ void PLA::clear() {
     buffer_lower = lower = numeric_limits<double>::lowest();
     buffer_upper = upper = numeric_limits<double>::max();
     buffer_initialized = initialized = false;
+    hull.clear();
 }
 
 double PLA::estimate(unsigned long long t) const {
     if (buffer_initialized) {
         if (t >= buffer_last.x) {
             return buffer_last.y;
+        } else if (mode == PLA_OPTIMAL) {
+            if (!hull.empty() && t >= hull.first_x()) {
+                double slope, intercept;
+                hull.get_line(slope, intercept);
+                return valueAtTime(slope, intercept, min(t, hull.last_x()));
+            }
         } else if (t >= buffer_begin.x) {
             auto slope = (buffer_lower + buffer_upper) / 2;
             auto intercept = buffer_begin.y - slope * buffer_begin.x;
@@ -34,11 +202,20 @@ double PLA::estimate(unsigned long long t) const {
                 l = m + 1;
             }
         }
+        // Optimal segments are disjoint. The counter stays unchanged between
+        // the end of a segment and the start of the next one.
+        if (mode == PLA_OPTIMAL && r >= 0) {
+            return valueAtTime(result[r].slope, result[r].intercept, result[r].end);
+        }
     }
     return 0.0;
 }
 
 void PLA::feed(point current) {
+    if (mode == PLA_OPTIMAL) {
+        feed_optimal(current);
+        return;
+    }
 
     if (buffer_initialized && current.x - buffer_last.x > double_eps) {
         lower = buffer_lower;
@@ -78,6 +255,403 @@ void PLA::feed(point current) {
     buffer_last = current;
 }
 
+void PLA::feed_optimal(point current) {
+    // Only the last point of a timestamp is fitted.
+    if (buffer_initialized && current.x - buffer_last.x > double_eps) {
+        if (!hull.add_point(buffer_last.x, buffer_last.y, tollerance)) {
+            double slope, intercept;
+            hull.get_line(slope, intercept);
+            result.push_back({hull.first_x(), hull.last_x(), slope, intercept});
+            hull.clear();
+            hull.add_point(buffer_last.x, buffer_last.y, tollerance);
+        }
+    }
+    buffer_last = current;
+    buffer_initialized = true;
+}
+
 unsigned long long PLA::memory_usage() const {
-    return result.capacity() * sizeof(segment) + sizeof(*this);
+    return result.capacity() * sizeof(segment) + sizeof(*this) +
+        hull.hull_memory_usage();
+}
+
+// PLAArray below
+PLAArray::PLAArray(size_t num_cells, double tolerance, PLAMode mode) :
+    tollerance(tolerance),
+    m_max_float_error(tolerance / 256),
+    m_mode(mode),
+    m_cell_slots(num_cells),
+    m_cells(),
+    m_seg_blocks(),
+    m_hulls(),
+    m_index_pool() {
+    clear();
+}
+
+void PLAArray::clear() {
+    fill(m_cell_slots.begin(), m_cell_slots.end(), invalid_offset);
+
+    // keep the allocated chunks for reuse
+    m_cells.clear();
+    m_seg_blocks.clear();
+    m_hulls.clear();
+    m_index_pool.clear();
+}
+
+double PLAArray::estimate(size_t i, unsigned long long t) const {
+    uint32_t slot = m_cell_slots[i];
+    if (slot == invalid_offset) {
+        return 0.0;
+    }
+    if (m_mode == PLA_OPTIMAL) {
+        return estimate_optimal(slot, t);
+    }
+
+    const Cell &cell = m_cells[slot];
+    if (t >= cell.buffer_last.x) {
+        return cell.buffer_last.y;
+    } else if (t >= cell.buffer_begin.x) {
+        auto slope = (cell.buffer_lower + cell.buffer_upper) / 2;
+        auto intercept = cell.buffer_begin.y - slope * cell.buffer_begin.x;
+        return valueAtTime(slope, intercept, t);
+    }
+    return estimate_segments(cell, t, false);
+}
+
+void PLAArray::feed(size_t i, point current) {
+    uint32_t &slot = m_cell_slots[i];
+    if (slot == invalid_offset) {
+        // Same as the state of a fresh PLA after its first feed().
+        Cell cell;
+        cell.buffer_lower = cell.lower = numeric_limits<double>::lowest();
+        cell.buffer_upper = cell.upper = numeric_limits<double>::max();
+        cell.begin = {0, 0};
+        cell.last_x = 0;
+        cell.buffer_last = cell.buffer_begin = current;
+        cell.num_segments = 0;
+        cell.num_seg_blocks = 0;
+        cell.index_block = invalid_offset;
+        cell.index_size_class = 0;
+        cell.initialized = false;
+        cell.last_segment_pending = false;
+        slot = m_cells.push_back(cell);
+        if (m_mode == PLA_OPTIMAL) {
+            m_hulls.push_back(ConvexHullFitter());
+        }
+        return;
+    }
+    if (m_mode == PLA_OPTIMAL) {
+        feed_optimal(slot, current);
+        return;
+    }
+
+    Cell &cell = m_cells[slot];
+    if (current.x - cell.buffer_last.x > double_eps) {
+        cell.lower = cell.buffer_lower;
+        cell.upper = cell.buffer_upper;
+        cell.last_x = cell.buffer_last.x;
+        cell.begin = cell.buffer_begin;
+        cell.initialized = true;
+        cell.last_segment_pending = false;
+    }
+    else if (cell.last_segment_pending) {
+        pop_segment(cell);
+    }
+
+    if (!cell.initialized) {
+        cell.buffer_last = cell.buffer_begin = current;
+        return;
+    }
+
+    assert(current.x - cell.last_x > - double_eps);
+
+    auto lowerPrime = max(cell.lower, pointSlope(cell.begin, {current.x, current.y - tollerance}));
+    auto upperPrime = min(cell.upper, pointSlope(cell.begin, {current.x, current.y + tollerance}));
+
+    if (lowerPrime <= upperPrime) {
+        cell.buffer_lower = lowerPrime;
+        cell.buffer_upper = upperPrime;
+    } else {
+        auto slope = (cell.lower + cell.upper) / 2;
+        auto intercept = cell.begin.y - slope * cell.begin.x;
+        push_segment(cell, {cell.begin.x, cell.last_x, slope, intercept});
+        cell.last_segment_pending = true;
+
+        cell.buffer_begin = {cell.last_x, valueAtTime(slope, intercept, cell.last_x)};
+        cell.buffer_lower = pointSlope(cell.buffer_begin, {current.x, current.y - tollerance});
+        cell.buffer_upper = pointSlope(cell.buffer_begin, {current.x, current.y + tollerance});
+    }
+    cell.buffer_last = current;
+}
+
+void PLAArray::feed_optimal(uint32_t slot, point current) {
+    Cell &cell = m_cells[slot];
+    // Only the last point of a timestamp is fitted.
+    if (current.x - cell.buffer_last.x > double_eps) {
+        ConvexHullFitter &hull = m_hulls[slot];
+        if (!hull.add_point(cell.buffer_last.x, cell.buffer_last.y, tollerance)) {
+            double slope, intercept;
+            hull.get_line(slope, intercept);
+            push_segment(cell, {hull.first_x(), hull.last_x(), slope, intercept});
+            hull.clear();
+            hull.add_point(cell.buffer_last.x, cell.buffer_last.y, tollerance);
+        }
+    }
+    cell.buffer_last = current;
+}
+
+double PLAArray::estimate_optimal(uint32_t slot, unsigned long long t) const {
+    const Cell &cell = m_cells[slot];
+    if (t >= cell.buffer_last.x) {
+        return cell.buffer_last.y;
+    }
+
+    const ConvexHullFitter &hull = m_hulls[slot];
+    if (!hull.empty() && t >= hull.first_x()) {
+        double slope, intercept;
+        hull.get_line(slope, intercept);
+        return valueAtTime(slope, intercept, min(t, hull.last_x()));
+    }
+
+    // the counter stays unchanged between the end of a segment and the start
+    // of the next one
+    return estimate_segments(cell, t, true);
+}
+
+double PLAArray::estimate_segments(
+    const Cell &cell, unsigned long long t, bool hold_value) const {
+    // find the last block that starts no later than t
+    const uint32_t *index = m_index_pool.data(cell.index_block);
+    int l = 0;
+    int r = (int) cell.num_seg_blocks - 1;
+    while (l <= r) {
+        int m = (l + r) / 2;
+        if (m_seg_blocks[index[m]].first_start > t) {
+            r = m - 1;
+        } else {
+            l = m + 1;
+        }
+    }
+    if (r < 0) {
+        return 0.0;
+    }
+
+    const SegBlock &blk = m_seg_blocks[index[r]];
+    packed_segment prev{0, blk.first_start, 0, 0};
+    const uint8_t *p = blk.data;
+    for (unsigned k = 0; k < blk.num_segments; ++k) {
+        packed_segment seg;
+        p += decode_segment(p, prev, seg);
+        if (seg.start > t) {
+            break;
+        }
+        if (seg.end >= t) {
+            if (seg.end == seg.start) {
+                return seg.y_start;
+            }
+            return seg.y_start + (seg.y_end - seg.y_start) *
+                ((double)(t - seg.start) / (double)(seg.end - seg.start));
+        }
+        prev = seg;
+    }
+    return hold_value ? prev.y_end : 0.0;
+}
+
+unsigned long long PLAArray::memory_usage() const {
+    unsigned long long s = sizeof(*this) +
+        m_cell_slots.capacity() * sizeof(uint32_t) +
+        m_cells.memory_usage() +
+        m_seg_blocks.memory_usage() +
+        m_hulls.memory_usage() +
+        m_index_pool.memory_usage();
+    for (uint32_t slot = 0; slot < m_hulls.size(); ++slot) {
+        s += m_hulls[slot].hull_memory_usage();
+    }
+    return s;
+}
+
+namespace {
+
+inline uint8_t *put_varint(uint8_t *p, unsigned long long v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t) v;
+    return p;
+}
+
+inline const uint8_t *get_varint(const uint8_t *p, unsigned long long &v) {
+    v = 0;
+    for (unsigned shift = 0;; shift += 7) {
+        uint8_t b = *p++;
+        v |= (unsigned long long)(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+    }
+    return p;
+}
+
+} // anonymous namespace
+
+unsigned PLAArray::encode_segment(
+    uint8_t *buf,
+    const packed_segment *prev,
+    const packed_segment &seg,
+    packed_segment *stored) const {
+
+    uint8_t flags = 0;
+    uint8_t *p = buf + 1;
+    unsigned long long prev_end = prev ? prev->end : seg.start;
+    if (seg.start != prev_end) {
+        // zigzag encoded, though the gap is never negative in practice
+        long long gap = (long long)(seg.start - prev_end);
+        flags |= SEG_HAS_GAP;
+        p = put_varint(p, ((unsigned long long) gap << 1) ^ (unsigned long long)(gap >> 63));
+    }
+    assert(seg.end >= seg.start);
+    if (seg.end != seg.start) {
+        flags |= SEG_HAS_LENGTH;
+        p = put_varint(p, seg.end - seg.start);
+    }
+
+    *stored = seg;
+    if (prev && abs(seg.y_start - prev->y_end) <= m_max_float_error) {
+        flags |= SEG_SHARED_Y_START;
+        stored->y_start = prev->y_end;
+    } else {
+        float f = (float) seg.y_start;
+        if (abs((double) f - seg.y_start) <= m_max_float_error) {
+            flags |= SEG_FLOAT_Y_START;
+            memcpy(p, &f, sizeof(f));
+            p += sizeof(f);
+            stored->y_start = f;
+        } else {
+            memcpy(p, &seg.y_start, sizeof(double));
+            p += sizeof(double);
+        }
+    }
+
+    float f = (float) seg.y_end;
+    if (abs((double) f - seg.y_end) <= m_max_float_error) {
+        flags |= SEG_FLOAT_Y_END;
+        memcpy(p, &f, sizeof(f));
+        p += sizeof(f);
+        stored->y_end = f;
+    } else {
+        memcpy(p, &seg.y_end, sizeof(double));
+        p += sizeof(double);
+    }
+
+    buf[0] = flags;
+    return (unsigned)(p - buf);
+}
+
+unsigned PLAArray::decode_segment(
+    const uint8_t *p,
+    const packed_segment &prev,
+    packed_segment &seg) {
+
+    const uint8_t *p0 = p;
+    uint8_t flags = *p++;
+    unsigned long long v;
+
+    seg.start = prev.end;
+    if (flags & SEG_HAS_GAP) {
+        p = get_varint(p, v);
+        seg.start += (unsigned long long)((long long)(v >> 1) ^ -(long long)(v & 1));
+    }
+    seg.end = seg.start;
+    if (flags & SEG_HAS_LENGTH) {
+        p = get_varint(p, v);
+        seg.end += v;
+    }
+
+    if (flags & SEG_SHARED_Y_START) {
+        seg.y_start = prev.y_end;
+    } else if (flags & SEG_FLOAT_Y_START) {
+        float f;
+        memcpy(&f, p, sizeof(f));
+        p += sizeof(f);
+        seg.y_start = f;
+    } else {
+        memcpy(&seg.y_start, p, sizeof(double));
+        p += sizeof(double);
+    }
+
+    if (flags & SEG_FLOAT_Y_END) {
+        float f;
+        memcpy(&f, p, sizeof(f));
+        p += sizeof(f);
+        seg.y_end = f;
+    } else {
+        memcpy(&seg.y_end, p, sizeof(double));
+        p += sizeof(double);
+    }
+
+    return (unsigned)(p - p0);
+}
+
+unsigned PLAArray::decode_last_segment(
+    const SegBlock &blk,
+    packed_segment &seg) {
+
+    assert(blk.num_segments > 0);
+    packed_segment prev{0, blk.first_start, 0, 0};
+    unsigned off = 0;
+    unsigned last_off = 0;
+    for (unsigned k = 0; k < blk.num_segments; ++k) {
+        last_off = off;
+        off += decode_segment(blk.data + off, prev, seg);
+        prev = seg;
+    }
+    return last_off;
+}
+
+void PLAArray::push_segment(Cell &cell, const segment &seg) {
+    packed_segment pseg{seg.start, seg.end,
+        valueAtTime(seg.slope, seg.intercept, seg.start),
+        valueAtTime(seg.slope, seg.intercept, seg.end)};
+    packed_segment stored;
+    uint8_t buf[max_encoded_segment_size];
+    ++cell.num_segments;
+
+    // append to the last block of the cell if it fits
+    if (cell.num_seg_blocks != 0) {
+        SegBlock &blk = m_seg_blocks[m_index_pool.at(cell.index_block, cell.num_seg_blocks - 1)];
+        packed_segment prev;
+        decode_last_segment(blk, prev);
+        unsigned len = encode_segment(buf, &prev, pseg, &stored);
+        if (blk.num_bytes + len <= sizeof(blk.data) && blk.num_segments < 255) {
+            memcpy(blk.data + blk.num_bytes, buf, len);
+            blk.num_bytes += len;
+            ++blk.num_segments;
+            return;
+        }
+    }
+
+    SegBlock blk;
+    blk.first_start = pseg.start;
+    blk.num_segments = 1;
+    blk.num_bytes = encode_segment(blk.data, nullptr, pseg, &stored);
+    uint32_t off = m_seg_blocks.push_back(blk);
+    m_index_pool.push_back(cell.index_block, cell.index_size_class,
+        cell.num_seg_blocks++, off);
+}
+
+void PLAArray::pop_segment(Cell &cell) {
+    assert(cell.num_segments > 0);
+    --cell.num_segments;
+    cell.last_segment_pending = false;
+
+    uint32_t off = m_index_pool.at(cell.index_block, cell.num_seg_blocks - 1);
+    SegBlock &blk = m_seg_blocks[off];
+    packed_segment seg;
+    blk.num_bytes = (uint8_t) decode_last_segment(blk, seg);
+    if (--blk.num_segments == 0) {
+        --cell.num_seg_blocks;
+        // reclaim the block if no other cell has appended a block after it
+        if (off + 1 == m_seg_blocks.size()) {
+            m_seg_blocks.pop_back();
+        }
+    }
 }
@@ -4,9 +4,91 @@
 #include <limits>
 #include <vector>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <cassert>
+#include <string>
+#include "chunked_array.h"
 
+enum PLAMode {
+    PLA_SWING,      // greedy slope window (default)
+    PLA_OPTIMAL     // minimum number of segments, see ConvexHullFitter
+};
+
+// Parses "swing" or "optimal". Returns false on invalid mode strings.
+bool parse_pla_mode(const std::string &str, PLAMode &mode);
+
+// Fits one segment of the optimal PLA with the convex hull method of
+// O'Rourke (1981), which OptimalPLR (Xie et al., VLDB 2014) applies to
+// streams. It maintains the upper and lower convex hulls of the points
+// shifted by +/- tolerance and the two extreme feasible lines, so each point
+// is added in amortized O(1) time.
+//
+// Points must be added in strictly increasing x order. add_point() returns
+// false and leaves the state unchanged if no line is within tolerance of all
+// the points and the new one, where the caller should end the segment.
+// Starting a new segment only when that happens yields the minimum number of
+// (disjoint) segments.
+class ConvexHullFitter {
+    public:
+        ConvexHullFitter();
+
+        void clear();
+
+        bool empty() const { return m_num_points == 0; }
+
+        unsigned long long first_x() const { return m_first_x; }
+
+        unsigned long long last_x() const { return m_last_x; }
+
+        bool add_point(unsigned long long x, double y, double tolerance);
+
+        // Returns a line within tolerance of all the points added so far.
+        void get_line(double &slope, double &intercept) const;
+
+        // Heap memory held by the hulls.
+        unsigned long long hull_memory_usage() const;
+
+    private:
+        // x is relative to m_first_x
+        struct hpoint {
+            double x, y;
+        };
+
+        // slope of the line through two points, compared without division
+        struct hslope {
+            double dx, dy;
+
+            bool operator<(const hslope &s) const { return dy * s.dx < s.dy * dx; }
+            bool operator>(const hslope &s) const { return dy * s.dx > s.dy * dx; }
+        };
+
+        static hslope slope_between(const hpoint &p, const hpoint &q) {
+            return {p.x - q.x, p.y - q.y};
+        }
+
+        static double cross(const hpoint &o, const hpoint &a, const hpoint &b) {
+            return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+        }
+
+        unsigned long long      m_first_x;
+
+        unsigned long long      m_last_x;
+
+        uint32_t                m_num_points;
+
+        uint32_t                m_upper_start;
+
+        uint32_t                m_lower_start;
+
+        // the extreme feasible lines are m_rect[0]-m_rect[2] (min slope)
+        // and m_rect[1]-m_rect[3] (max slope)
+        hpoint                  m_rect[4];
+
+        std::vector<hpoint>     m_upper;
+
+        std::vector<hpoint>     m_lower;
+};
 
 class PLA {
     public:
@@ -23,7 +105,7 @@ class PLA {
 
         std::vector<segment> result;
 
-        PLA(double);
+        PLA(double, PLAMode mode = PLA_SWING);
 
         void clear();
 
@@ -39,6 +121,8 @@ class PLA {
 
         double tollerance;
 
+        PLAMode mode;
+
         double lower, upper;
         //available slope range : [lower, upper]
         point begin;
@@ -52,6 +136,175 @@ class PLA {
         point buffer_begin, buffer_last;
         bool buffer_initialized;
 
+        // In PLA_OPTIMAL mode, buffer_last is the latest point, which is
+        // added to hull once a point with a larger timestamp arrives, and the
+        // other fitting states above are unused.
+        ConvexHullFitter hull;
+
+        void feed_optimal(point current);
+
+        inline double valueAtTime(
+            double slope, double intercept, unsigned long long time) const
+        {
+            return slope * time + intercept;
+        }
+
+        inline double pointSlope(point pt1, point pt2) const {
+            assert((abs((double) pt2.x - pt1.x) > double_eps));
+            return (pt2.y - pt1.y) / (pt2.x - pt1.x);
+        }
+};
+
+// A fixed number of PLAs (cells) with the same tolerance in a flat layout.
+//
+// The fitting state of a cell is allocated on its first feed() in a dense
+// pool of fixed-size chunks, so cells that are never updated only cost a
+// 4-byte slot. Finished segments are stored by their end points and
+// compressed into 64-byte blocks (see SegBlock), which are appended to a
+// shared pool of fixed-size chunks. Each cell keeps an index of its blocks'
+// offsets in an index block from a pool of power-of-two sized index blocks,
+// so estimate() binary searches the blocks by their first timestamps and
+// then decodes at most one block.
+//
+// feed(i, pt) produces the same segments as PLA::feed(pt) on the i-th cell
+// in the same mode. The end point values of a segment are stored in float32
+// if that is off by no more than tolerance / 256, so estimate(i, t) may
+// differ from PLA::estimate(t) by that much.
+class PLAArray {
+    public:
+        typedef PLA::point point;
+        typedef PLA::segment segment;
+
+        PLAArray(size_t num_cells, double tolerance, PLAMode mode = PLA_SWING);
+
+        PLAArray(const PLAArray&) = delete;
+        PLAArray& operator=(const PLAArray&) = delete;
+
+        void clear();
+
+        double estimate(size_t i, unsigned long long t) const;
+
+        void feed(size_t i, point current);
+
+        size_t num_cells() const { return m_cell_slots.size(); }
+
+        uint32_t num_segments(size_t i) const {
+            uint32_t slot = m_cell_slots[i];
+            return (slot == invalid_offset) ? 0 : m_cells[slot].num_segments;
+        }
+
+        unsigned long long memory_usage() const;
+
+    private:
+        struct Cell {
+            double lower, upper;
+            point begin;
+            unsigned long long last_x; // last.y is never used
+            double buffer_lower, buffer_upper;
+            point buffer_begin, buffer_last;
+            uint32_t num_segments;
+            uint32_t num_seg_blocks;
+            uint32_t index_block; // in m_index_pool
+            uint8_t index_size_class;
+            bool initialized;
+            // whether the last segment was pushed since the last commit of
+            // the buffered state, i.e., its start is begin.x
+            bool last_segment_pending;
+        };
+
+        // A segment as stored: the line through (start, y_start) and
+        // (end, y_end).
+        struct packed_segment {
+            unsigned long long start, end;
+            double y_start, y_end;
+        };
+
+        // A block of consecutive segments of a cell. Each segment is encoded
+        // as a flag byte (SEG_*), the zigzag varint gap between its start and
+        // the end of the previous one (omitted if 0), the varint length
+        // (omitted if 0), and y_start (omitted if equal to the previous
+        // y_end) and y_end in float32 or double. The first segment of a block
+        // starts at first_start, so blocks decode independently.
+        struct SegBlock {
+            unsigned long long first_start;
+            uint8_t num_segments;
+            uint8_t num_bytes;
+            uint8_t data[54];
+        };
+
+        enum : uint8_t {
+            SEG_HAS_GAP = 1,
+            SEG_HAS_LENGTH = 2,
+            SEG_SHARED_Y_START = 4,
+            SEG_FLOAT_Y_START = 8,
+            SEG_FLOAT_Y_END = 16
+        };
+
+        // flag byte + 2 varints + 2 doubles
+        static constexpr unsigned max_encoded_segment_size = 1 + 10 + 10 + 8 + 8;
+
+        static constexpr unsigned cell_chunk_shift = 5;
+        static constexpr unsigned seg_chunk_shift = 6;
+        static constexpr uint32_t invalid_offset = OffsetListPool::invalid_offset;
+
+        const double double_eps = 0.000000001;
+
+        double tollerance;
+
+        // max error of an end point value stored in float32
+        double m_max_float_error;
+
+        PLAMode m_mode;
+
+        // offset of the i-th cell in m_cells, or invalid_offset if the cell
+        // has never been fed
+        std::vector<uint32_t> m_cell_slots;
+
+        ChunkedArray<Cell, cell_chunk_shift> m_cells;
+
+        ChunkedArray<SegBlock, seg_chunk_shift> m_seg_blocks;
+
+        // In PLA_OPTIMAL mode, the hull of the open segment of the cell at
+        // the same offset in m_cells. Only buffer_last and the segment index
+        // of the cell are used in this mode.
+        ChunkedArray<ConvexHullFitter, cell_chunk_shift> m_hulls;
+
+        // offsets of the segment blocks of each cell
+        OffsetListPool m_index_pool;
+
+        void feed_optimal(uint32_t slot, point current);
+
+        double estimate_optimal(uint32_t slot, unsigned long long t) const;
+
+        // Looks up the segments of cell for t. If no segment covers t,
+        // returns the y_end of the last segment before t if hold_value is
+        // true, or 0 otherwise.
+        double estimate_segments(
+            const Cell &cell, unsigned long long t, bool hold_value) const;
+
+        // Encodes seg after prev (or as the first segment of a block if
+        // prev is null) into buf. Returns the encoded size and sets *stored
+        // to seg as it will be decoded.
+        unsigned encode_segment(
+            uint8_t *buf,
+            const packed_segment *prev,
+            const packed_segment &seg,
+            packed_segment *stored) const;
+
+        // Decodes the segment at p after prev. Returns the encoded size.
+        static unsigned decode_segment(
+            const uint8_t *p,
+            const packed_segment &prev,
+            packed_segment &seg);
+
+        // Decodes the last segment of blk and returns its offset in data.
+        static unsigned decode_last_segment(
+            const SegBlock &blk,
+            packed_segment &seg);
+
+        void push_segment(Cell &cell, const segment &seg);
+
+        void pop_segment(Cell &cell);
 
         inline double valueAtTime(
             double slope, double intercept, unsigned long long time) const
@@ -43,7 +43,7 @@ struct MisraGriesAccessor {
     }
 
     static uint64_t
-    get_cnt_prime(MG *mg, uint32_t key)
+    get_cnt_prime(const MG *mg, uint32_t key)
     {
         auto iter = mg->m_cnt.find(key);
         if (iter == mg->m_cnt.end()) return 0;
@@ -60,7 +60,8 @@ using MGA = MisraGriesAccessor;
 
 ChainMisraGries::ChainMisraGries(
     double  epsilon,
-    bool    use_update_new):
+    bool    use_update_new,
+    bool    use_point_query_index):
     m_epsilon(epsilon),
     m_epsilon_over_3(epsilon / 3),
     m_k((uint32_t) std::ceil(1 / m_epsilon_over_3)),
@@ -68,7 +69,7 @@ ChainMisraGries::ChainMisraGries(
     m_tot_cnt(0u),
     m_last_ts(0u),
     m_cur_sketch(m_k),
-    m_snapshot_cnt_map((cnt_map_t::size_type) std::ceil(umap_default_load_factor * (m_k > 1 ? m_k - 1: 1))),
+    m_snapshot_cnt_map(m_k - 1),
     m_checkpoints(),
     m_delta_list_tail_ptr(nullptr),
     m_num_delta_nodes_since_last_chkpt(0),
@@ -81,7 +82,10 @@ ChainMisraGries::ChainMisraGries(
     m_c2_min_heap(),
     m_inverted_index_proxy(),
     m_tmp_cnt_ts(0),
-    m_tmp_cnt_map()
+    m_tmp_cnt_map(),
+    m_use_point_query_index(use_point_query_index),
+    m_key_histories(),
+    m_time_points()
 {
     m_all_counters = new Counter[2 * (m_k - 1)];
     
@@ -136,6 +140,8 @@ ChainMisraGries::clear()
     m_deleted_counters.clear();
     m_tmp_cnt_ts = 0;
     m_tmp_cnt_map.clear();
+    m_key_histories.reset(0);
+    m_time_points.clear();
 }
 
 size_t
@@ -152,25 +158,37 @@ ChainMisraGries::memory_usage() const
                     acc += sizeof(DeltaNode);
                     n = n->m_next;
                 }
-                acc += size_of_unordered_map(chkpt.m_cnt_map);
+                acc += chkpt.m_cnt_map.memory_usage();
                 return acc;
             });
 
+    if (m_use_point_query_index)
+    {
+        size_of_checkpoints_and_dnodes +=
+            sizeof(m_key_histories) + m_key_histories.memory_usage() +
+            sizeof(m_time_points) + sizeof(TimePoint) * m_time_points.capacity();
+        for (const auto &p: m_key_histories)
+        {
+            size_of_checkpoints_and_dnodes +=
+                sizeof(KeyHistoryEntry) * p.second.capacity();
+        }
+    }
+
     if (m_use_update_new)
     {
         return 88 + // scalar members + m_inverted_index_proxy (which counts as 8 for alignment)
             m_cur_sketch.memory_usage() + 
             size_of_checkpoints_and_dnodes +
             sizeof(Counter) * (2 * m_k - 2) +
-            size_of_unordered_map(m_key_to_counter_map) +
-            size_of_unordered_map(m_deleted_counters) +
+            sizeof(m_key_to_counter_map) + m_key_to_counter_map.memory_usage() +
+            sizeof(m_deleted_counters) + m_deleted_counters.memory_usage() +
             sizeof(m_c1_max_heap) + sizeof(Counter*) * m_c1_max_heap.capacity() +
             sizeof(m_c2_min_heap) + sizeof(Counter*) * m_c2_min_heap.capacity();
     }
     
     return 56 + // scalar members
         m_cur_sketch.memory_usage() +
-        size_of_unordered_map(m_snapshot_cnt_map) +
+        sizeof(m_snapshot_cnt_map) + m_snapshot_cnt_map.memory_usage() +
         size_of_checkpoints_and_dnodes;
 }
 
@@ -198,6 +216,39 @@ ChainMisraGries::update(
         update_old(ts, key, c);
 }
 
+void
+ChainMisraGries::update_batch(
+    const UpdateRecord_u32 *records,
+    size_t n)
+{
+    if (n == 0) return ;
+
+    // The timestamps are non-decreasing in a batch so the cached counts only
+    // need to be checked once for the entire batch.
+    if (m_tmp_cnt_ts != 0 &&
+        records[0].m_ts <= m_tmp_cnt_ts &&
+        m_tmp_cnt_ts <= records[n - 1].m_ts)
+    {
+        m_tmp_cnt_ts = 0;
+        m_tmp_cnt_map.clear();
+    }
+
+    if (m_use_update_new)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            update_new(records[i].m_ts, records[i].m_value, records[i].m_c);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            update_old(records[i].m_ts, records[i].m_value, records[i].m_c);
+        }
+    }
+}
+
 void
 ChainMisraGries::update_new(
     TIMESTAMP           ts,
@@ -371,6 +422,7 @@ check_for_checkpoint:
             }
             else if (new_dnode_list)
             {
+                index_delta_list(new_dnode_list);
                 *m_delta_list_tail_ptr = new_dnode_list;
                 m_delta_list_tail_ptr = new_dnode_list_tail_ptr;
                 m_num_delta_nodes_since_last_chkpt = num_deltas;
@@ -653,6 +705,7 @@ ChainMisraGries::update_old(
             }
             else if (new_delta_list)
             {
+                index_delta_list(new_delta_list);
                 *m_delta_list_tail_ptr = new_delta_list;
                 m_delta_list_tail_ptr = new_delta_list_tail_ptr;
                 m_num_delta_nodes_since_last_chkpt = num_deltas;
@@ -679,7 +732,7 @@ ChainMisraGries::estimate_heavy_hitters(
     
     uint64_t threshold = (uint64_t) std::ceil((m_epsilon_over_3 + frac_threshold - m_epsilon) * m_est_tot_cnt);
     std::vector<HeavyHitter> ret;
-    for (auto &p: m_tmp_cnt_map)
+    for (const auto &p: m_tmp_cnt_map)
     {
         if (p.second >= threshold)
         {
@@ -692,6 +745,39 @@ ChainMisraGries::estimate_heavy_hitters(
     return ret;
 }
 
+MG*
+ChainMisraGries::get_prefix_mg(
+    TIMESTAMP ts_e,
+    uint64_t &tot_cnt,
+    double &err_frac) const
+{
+    if (ts_e >= m_last_ts)
+    {
+        tot_cnt = m_tot_cnt;
+        err_frac = m_cur_sketch.get_eps();
+        return new MG(m_cur_sketch);
+    }
+
+    create_tmp_cnt_at(ts_e);
+
+    // The estimates are in [c - 2 * eps/3 * N, c + eps/3 * N]. Shift them
+    // down by eps/3 * N so that they never over-estimate.
+    MG *mg = new MG(m_k);
+    cnt_map_t &cnt_map = MGA::cnt_map(mg);
+    uint64_t d = (uint64_t) std::ceil(m_epsilon_over_3 * m_est_tot_cnt);
+    for (const auto &p: m_tmp_cnt_map)
+    {
+        if (p.second > d)
+        {
+            cnt_map.emplace(p.first, p.second - d);
+        }
+    }
+
+    tot_cnt = m_est_tot_cnt;
+    err_frac = m_epsilon;
+    return mg;
+}
+
 void
 ChainMisraGries::create_tmp_cnt_at(
     TIMESTAMP ts_e) const
@@ -714,7 +800,7 @@ ChainMisraGries::create_tmp_cnt_at(
 
     const ChkptNode &last_chkpt = *(iter - 1);
 
-    std::unordered_map<key_type, uint64_t> &snapshot = m_tmp_cnt_map;
+    cnt_map_t &snapshot = m_tmp_cnt_map;
     uint64_t d = (uint64_t) std::floor(last_chkpt.m_tot_cnt * m_epsilon_over_3);
     for (const auto &p: last_chkpt.m_cnt_map)
     {
@@ -796,22 +882,135 @@ ChainMisraGries::estimate_frequency(
     TIMESTAMP ts_e,
     uint32_t key) const
 {
-    const std::unordered_map<key_type, uint64_t> &cnt_map =
-        (ts_e >= m_last_ts) ? MGA::cnt_map(&m_cur_sketch) : m_tmp_cnt_map;
-    if (ts_e < m_last_ts && m_tmp_cnt_ts != ts_e)
+    uint64_t est_c, est_tot_cnt;
+    if (ts_e >= m_last_ts)
+    {
+        est_c = MGA::get_cnt_prime(&m_cur_sketch, key);
+        est_tot_cnt = m_tot_cnt;
+    }
+    else if (m_use_point_query_index)
     {
-        create_tmp_cnt_at(ts_e);
+        est_c = lookup_key_history(ts_e, key, est_tot_cnt);
     }
+    else
+    {
+        if (m_tmp_cnt_ts != ts_e)
+        {
+            create_tmp_cnt_at(ts_e);
+        }
+        auto iter = m_tmp_cnt_map.find(key);
+        est_c = (iter == m_tmp_cnt_map.end()) ? 0 : iter->second;
+        est_tot_cnt = m_est_tot_cnt;
+    }
+    if (est_c == 0) return 0;
     
     // realign the error bound to center around the true value
     // d = +eps / 6 * N
-    uint64_t d = m_epsilon_over_3 / 2 * m_est_tot_cnt;
-    auto iter = cnt_map.find(d);
-    if (iter == cnt_map.end()) return 0;
-    uint64_t est_c = iter->second;
+    uint64_t d = m_epsilon_over_3 / 2 * est_tot_cnt;
     return est_c + d;
 }
 
+void
+ChainMisraGries::index_checkpoint(
+    const ChkptNode &chkpt)
+{
+    if (!m_use_point_query_index) return ;
+
+    m_time_points.push_back(TimePoint{chkpt.m_ts, chkpt.m_tot_cnt});
+    // The keys that are not in the snapshot have no entry at the
+    // checkpoint and are found by their last entries being older than it.
+    uint64_t d = (uint64_t) std::floor(chkpt.m_tot_cnt * m_epsilon_over_3);
+    for (const auto &p: chkpt.m_cnt_map)
+    {
+        if (p.second > d)
+        {
+            m_key_histories[p.first].push_back(
+                KeyHistoryEntry{chkpt.m_ts, p.second - d});
+        }
+    }
+}
+
+void
+ChainMisraGries::index_delta_list(
+    const DeltaNode *n)
+{
+    if (!m_use_point_query_index) return ;
+
+    m_time_points.push_back(TimePoint{n->m_ts, n->m_tot_cnt});
+    for (; n; n = n->m_next)
+    {
+        uint64_t d = (uint64_t) std::floor(n->m_tot_cnt * m_epsilon_over_3);
+        m_key_histories[n->m_key].push_back(KeyHistoryEntry{
+            n->m_ts, (n->m_new_cnt > d) ? n->m_new_cnt - d : 0});
+    }
+}
+
+uint64_t
+ChainMisraGries::lookup_key_history(
+    TIMESTAMP ts_e,
+    uint32_t key,
+    uint64_t &est_tot_cnt) const
+{
+    auto chkpt_iter = std::upper_bound(
+        m_checkpoints.begin(), m_checkpoints.end(),
+        ts_e,
+        [](TIMESTAMP ts_e, const ChkptNode &n) -> bool {
+            return ts_e < n.m_ts;
+        });
+    if (chkpt_iter == m_checkpoints.begin())
+    {
+        est_tot_cnt = 0;
+        return 0;
+    }
+    TIMESTAMP chkpt_ts = (chkpt_iter - 1)->m_ts;
+
+    // linear interpolation of the total counts at the previous and the next
+    // checkpoints/delta nodes as in create_tmp_cnt_at()
+    auto tp_iter = std::upper_bound(
+        m_time_points.begin(), m_time_points.end(),
+        ts_e,
+        [](TIMESTAMP ts_e, const TimePoint &tp) -> bool {
+            return ts_e < tp.m_ts;
+        });
+    assert(tp_iter != m_time_points.begin());
+    TIMESTAMP prev_ts = (tp_iter - 1)->m_ts;
+    uint64_t prev_tot_cnt = (tp_iter - 1)->m_tot_cnt;
+    TIMESTAMP next_ts = m_last_ts;
+    uint64_t next_tot_cnt = m_tot_cnt;
+    if (tp_iter != m_time_points.end())
+    {
+        next_ts = tp_iter->m_ts;
+        next_tot_cnt = tp_iter->m_tot_cnt;
+    }
+    if (prev_ts == next_ts)
+    {
+        est_tot_cnt = next_tot_cnt;
+    }
+    else
+    {
+        est_tot_cnt = (
+            (next_tot_cnt - prev_tot_cnt) * 1.0 * ts_e +
+            prev_tot_cnt * 1.0 * next_ts -
+            next_tot_cnt * 1.0 * prev_ts) / (next_ts - prev_ts);
+    }
+
+    auto hist_iter = m_key_histories.find(key);
+    if (hist_iter == m_key_histories.end()) return 0;
+    const std::vector<KeyHistoryEntry> &history = hist_iter->second;
+    auto iter = std::upper_bound(
+        history.begin(), history.end(),
+        ts_e,
+        [](TIMESTAMP ts_e, const KeyHistoryEntry &e) -> bool {
+            return ts_e < e.m_ts;
+        });
+    if (iter == history.begin()) return 0;
+    --iter;
+
+    // not in the snapshot at the checkpoint and unchanged since then
+    if (iter->m_ts < chkpt_ts) return 0;
+    return iter->m_cnt;
+}
+
 void
 ChainMisraGries::make_checkpoint_old()
 {
@@ -821,8 +1020,10 @@ ChainMisraGries::make_checkpoint_old()
         nullptr,
         MGA::cnt_map(&m_cur_sketch)
     });
+    m_checkpoints.back().m_cnt_map.shrink_to_fit();
     m_delta_list_tail_ptr = &m_checkpoints.back().m_first_delta_node;
     m_num_delta_nodes_since_last_chkpt = 0;
+    index_checkpoint(m_checkpoints.back());
     
     m_snapshot_cnt_map.clear();
     for (const auto &p: m_checkpoints.back().m_cnt_map)
@@ -849,11 +1050,9 @@ ChainMisraGries::make_checkpoint()
     m_delta_list_tail_ptr = &m_checkpoints.back().m_first_delta_node;
     m_num_delta_nodes_since_last_chkpt = 0;
     
-    // XXX doesn't reduce memory usage
-    // reset load factor to the default value
-    //cnt_map_t &cnt_map = m_checkpoints.back().m_cnt_map;
-    //cnt_map.max_load_factor(1 / umap_default_load_factor);
-    //cnt_map.rehash(cnt_map.size() * umap_default_load_factor);
+    // the checkpoint is never updated
+    m_checkpoints.back().m_cnt_map.shrink_to_fit();
+    index_checkpoint(m_checkpoints.back());
 
     m_sub_amount = 0;
     int64_t max_delta_c = (int64_t) get_allowable_cnt_upper_bound(0, m_tot_cnt);
@@ -866,7 +1065,7 @@ ChainMisraGries::make_checkpoint()
         p_counter->m_prev_chkpt_node = &m_checkpoints.back();
     }
     
-    for (auto &p: m_deleted_counters)
+    for (const auto &p: m_deleted_counters)
     {
         Counter *p_counter = p.second;
         p_counter->m_in_last_snapshot = false;
@@ -898,7 +1097,11 @@ ChainMisraGries::create_from_config(
         use_update_new = g_config->get_boolean("CMG.use_update_new", idx).value();
     }
 
-    return new ChainMisraGries(epsilon, use_update_new);
+    bool use_point_query_index =
+        g_config->get_boolean("CMG.point_query_index").value();
+
+    return new ChainMisraGries(epsilon, use_update_new,
+        use_point_query_index);
 }
 
 int
@@ -938,7 +1141,8 @@ ChainMisraGries::clear_delta_list(
 //
 
 TreeMisraGries::TreeMisraGries(
-    double  epsilon):
+    double  epsilon,
+    uint32_t prefix_cache_size):
     m_epsilon(epsilon),
     m_epsilon_prime(epsilon / 3.0),
     m_k((uint32_t) std::ceil(1 / m_epsilon_prime)),
@@ -950,7 +1154,11 @@ TreeMisraGries::TreeMisraGries(
     m_target_cnt(1),
     m_max_cnt_per_node_at_cur_level(1),
     m_cur_sketch(nullptr),
-    m_size_counter(0)
+    m_size_counter(0),
+    m_prefix_cache_size(prefix_cache_size),
+    m_prefix_cache(),
+    m_prefix_cache_index(),
+    m_prefix_cache_stats{0, 0, 0, 0, 0}
 {
     m_cur_sketch = new MisraGries(m_k);
 }
@@ -979,6 +1187,7 @@ TreeMisraGries::clear()
     m_max_cnt_per_node_at_cur_level =1;
     m_cur_sketch->clear();
     m_size_counter = 0;
+    clear_prefix_cache();
 }
 
 size_t
@@ -1016,25 +1225,75 @@ TreeMisraGries::update(
     m_tot_cnt += c;
 }
 
+void
+TreeMisraGries::update_batch(
+    const UpdateRecord_u32 *records,
+    size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        // only need to check whether to merge when the timestamp changes
+        if (m_last_ts != records[i].m_ts)
+        {
+            if (m_last_ts > 0 && m_tot_cnt + records[i].m_c >= m_target_cnt)
+            {
+                merge_cur_sketch();
+            }
+            m_last_ts = records[i].m_ts;
+        }
+
+        m_cur_sketch->update(records[i].m_value, records[i].m_c);
+        m_tot_cnt += records[i].m_c;
+    }
+}
 
 std::vector<IPersistentHeavyHitterSketch::HeavyHitter>
 TreeMisraGries::estimate_heavy_hitters(
     TIMESTAMP ts_e,
     double frac_threshold) const
 {
-    MisraGries *mg;
+    uint64_t est_tot_cnt;
+    FrozenMisraGries summary = get_prefix_summary(ts_e, est_tot_cnt);
+
+    // threshold = frac_threshold 
+    //             - eps/3 (m_epsilon_prime) 
+    //             - eps/3 (in misra gries)
+    return summary.estimate_heavy_hitters(
+            frac_threshold - m_epsilon_prime, est_tot_cnt, 1.0 / m_k);
+}
+
+MG*
+TreeMisraGries::get_prefix_mg(
+    TIMESTAMP ts_e,
+    uint64_t &tot_cnt,
+    double &err_frac) const
+{
+    FrozenMisraGries summary = get_prefix_summary(ts_e, tot_cnt);
+    MisraGries *mg = new MisraGries(m_k, summary);
+    err_frac = m_epsilon_prime + mg->get_eps();
+    return mg;
+}
+
+FrozenMisraGries
+TreeMisraGries::get_prefix_summary(
+    TIMESTAMP ts_e,
+    uint64_t &tot_cnt) const
+{
+    // the left children in range on the path down the partially covered
+    // tree, which come after the trees at the higher levels in time
+    std::vector<const TreeNode*> path;
+    bool includes_cur_sketch = false;
     uint32_t level;
     uint64_t est_tot_cnt = 0;
     if (ts_e >= m_last_ts)
     {
-        mg = m_cur_sketch->clone();
+        includes_cur_sketch = true;
         level = m_level;
         est_tot_cnt = m_tot_cnt;
     }
     else
     {
         level = m_level;
-        mg = new MisraGries(m_k);
         for (; level < m_tree.size(); ++level)
         {
             if (m_tree[level])
@@ -1053,7 +1312,7 @@ TreeMisraGries::estimate_heavy_hitters(
                         else
                         {
                             does_intersect = true;
-                            mg->merge(tn->m_left->m_mg);
+                            path.push_back(tn->m_left);
 
                             est_tot_cnt = tn->m_left->m_tot_cnt;
                             tn = tn->m_right;
@@ -1075,22 +1334,141 @@ TreeMisraGries::estimate_heavy_hitters(
         }
     }
 
-    for (; level < m_tree.size(); ++level)
+    // the tree nodes in range in the order of time
+    std::vector<const TreeNode*> nodes;
+    for (uint32_t top_level = (uint32_t) m_tree.size(); top_level > level;)
     {
-        if (m_tree[level])
+        if (m_tree[--top_level])
         {
-            assert(ts_e > m_tree[level]->m_ts);
-            mg->merge(m_tree[level]->m_mg);
+            assert(ts_e > m_tree[top_level]->m_ts);
+            nodes.push_back(m_tree[top_level]);
         }
     }
-    // threshold = frac_threshold 
-    //             - eps/3 (m_epsilon_prime) 
-    //             - eps/3 (in misra gries)
-    auto ret = mg->estimate_heavy_hitters(
-            frac_threshold - m_epsilon_prime, est_tot_cnt);
+    nodes.insert(nodes.end(), path.begin(), path.end());
 
-    delete mg;
-    return ret;
+    std::vector<const FrozenMisraGries*> summaries;
+    if (m_prefix_cache_size > 0 && !nodes.empty())
+    {
+        summaries.push_back(get_cached_prefix_sum(nodes));
+    }
+    else
+    {
+        for (const TreeNode *tn: nodes)
+        {
+            summaries.push_back(tn->m_mg);
+        }
+    }
+
+    FrozenMisraGries cur_summary;
+    if (includes_cur_sketch)
+    {
+        cur_summary = FrozenMisraGries(*m_cur_sketch);
+        summaries.push_back(&cur_summary);
+    }
+
+    tot_cnt = est_tot_cnt;
+    return FrozenMisraGries::merge(summaries.data(), summaries.size(), m_k);
+}
+
+const FrozenMisraGries*
+TreeMisraGries::get_cached_prefix_sum(
+    const std::vector<const TreeNode*> &nodes) const
+{
+    // A prefix is identified by its last node since the nodes before it
+    // stay the same when the trees are merged into larger ones.
+    size_t num_cached = nodes.size();
+    auto cached = m_prefix_cache.end();
+    while (num_cached > 0)
+    {
+        auto index_iter = m_prefix_cache_index.find(nodes[num_cached - 1]);
+        if (index_iter != m_prefix_cache_index.end())
+        {
+            cached = index_iter->second;
+            m_prefix_cache.splice(m_prefix_cache.begin(), m_prefix_cache,
+                cached);
+            break;
+        }
+        --num_cached;
+    }
+
+    if (num_cached == nodes.size())
+    {
+        ++m_prefix_cache_stats.m_num_hits;
+        return &cached->m_summary;
+    }
+
+    std::vector<const FrozenMisraGries*> summaries;
+    if (num_cached > 0)
+    {
+        ++m_prefix_cache_stats.m_num_partial_hits;
+        summaries.push_back(&cached->m_summary);
+    }
+    else
+    {
+        ++m_prefix_cache_stats.m_num_misses;
+    }
+    for (size_t i = num_cached; i < nodes.size(); ++i)
+    {
+        summaries.push_back(nodes[i]->m_mg);
+    }
+
+    m_prefix_cache.push_front(PrefixCacheEntry{nodes.back(),
+        FrozenMisraGries::sum(summaries.data(), summaries.size())});
+    m_prefix_cache.front().m_summary.shrink_to_fit();
+    m_prefix_cache_index[nodes.back()] = m_prefix_cache.begin();
+    if (m_prefix_cache.size() > m_prefix_cache_size)
+    {
+        m_prefix_cache_index.erase(m_prefix_cache.back().m_node);
+        m_prefix_cache.pop_back();
+    }
+    return &m_prefix_cache.front().m_summary;
+}
+
+void
+TreeMisraGries::clear_prefix_cache()
+{
+    m_prefix_cache.clear();
+    m_prefix_cache_index.clear();
+    m_prefix_cache_stats = PrefixCacheStats{0, 0, 0, 0, 0};
+}
+
+TreeMisraGries::PrefixCacheStats
+TreeMisraGries::get_prefix_cache_stats() const
+{
+    PrefixCacheStats stats = m_prefix_cache_stats;
+    stats.m_num_entries = m_prefix_cache.size();
+    stats.m_memory_usage = m_prefix_cache_index.bucket_count() * sizeof(void*)
+        + m_prefix_cache_index.size() * (sizeof(void*) +
+            sizeof(std::pair<const TreeNode*,
+                std::list<PrefixCacheEntry>::iterator>));
+    for (const PrefixCacheEntry &entry: m_prefix_cache)
+    {
+        // 2 pointers per list node
+        stats.m_memory_usage += sizeof(PrefixCacheEntry) + 2 * sizeof(void*)
+            + entry.m_summary.memory_usage();
+    }
+    return stats;
+}
+
+std::string
+TreeMisraGries::format_prefix_cache_stats(
+    const PrefixCacheStats &stats)
+{
+    return "prefix cache: hits = " + std::to_string(stats.m_num_hits)
+        + ", partial hits = " + std::to_string(stats.m_num_partial_hits)
+        + ", misses = " + std::to_string(stats.m_num_misses)
+        + ", entries = " + std::to_string(stats.m_num_entries)
+        + ", memory = " + std::to_string(stats.m_memory_usage) + " B";
+}
+
+std::string
+TreeMisraGries::get_extra_stats() const
+{
+    if (m_prefix_cache_size == 0)
+    {
+        return std::string();
+    }
+    return format_prefix_cache_stats(get_prefix_cache_stats());
 }
 
 void
@@ -1099,7 +1477,6 @@ TreeMisraGries::merge_cur_sketch()
     TreeNode *tn = new TreeNode;
     tn->m_ts = m_last_ts;
     tn->m_tot_cnt = m_tot_cnt;
-    tn->m_mg = new MisraGries(m_k);
     tn->m_left = tn->m_right = nullptr;
     
     if (MGA::delta(m_cur_sketch) != 0)
@@ -1108,11 +1485,13 @@ TreeMisraGries::merge_cur_sketch()
     }
     cnt_map_t &cnt_map = MGA::cnt_map(m_cur_sketch);
     auto purge_threshold = m_tot_cnt * m_epsilon_prime; // eps / 3 * m_tot_cnt
+    // there are at most k of them since they sum up to at most m_tot_cnt
+    std::vector<std::pair<uint32_t, uint64_t>> heavy_counters;
     for (auto iter = cnt_map.begin(); iter != cnt_map.end();)
     {
         if (iter->second >= purge_threshold)
         {
-            tn->m_mg->update(iter->first, iter->second);
+            heavy_counters.emplace_back(iter->first, iter->second);
             iter = cnt_map.erase(iter);
         }
         else
@@ -1124,6 +1503,7 @@ TreeMisraGries::merge_cur_sketch()
     {
         MGA::min_cnt(m_cur_sketch) = ~0ul;
     }
+    tn->m_mg = new FrozenMisraGries(std::move(heavy_counters));
 
     //m_size_counter += sizeof(TreeNode) + tn->m_mg->memory_usage();
 
@@ -1135,8 +1515,11 @@ TreeMisraGries::merge_cur_sketch()
         tn_merged->m_tot_cnt = m_tot_cnt;
 
         //m_size_counter -= tn->m_mg->memory_usage();
-        tn_merged->m_mg = tn->m_mg;
-        tn_merged->m_mg->merge(m_tree[level]->m_mg);
+        const FrozenMisraGries *children[2] = {tn->m_mg, m_tree[level]->m_mg};
+        tn_merged->m_mg = new FrozenMisraGries(
+            FrozenMisraGries::merge(children, 2, m_k));
+        tn_merged->m_mg->shrink_to_fit();
+        delete tn->m_mg;
         tn->m_mg = nullptr; // drop the mg sketch in the right child
         tn_merged->m_left = m_tree[level];
         tn_merged->m_right = tn;
@@ -1200,8 +1583,10 @@ TreeMisraGries::create_from_config(
     int idx)
 {
     double epsilon = g_config->get_double("TMG.epsilon", idx).value();
+    uint32_t prefix_cache_size =
+        g_config->get_u32("TMG.prefix_cache_size").value();
 
-    return new TreeMisraGries(epsilon);
+    return new TreeMisraGries(epsilon, prefix_cache_size);
 }
 
 //
@@ -1209,7 +1594,8 @@ TreeMisraGries::create_from_config(
 //
 
 TreeMisraGriesBITP::TreeMisraGriesBITP(
-    double  epsilon):
+    double  epsilon,
+    bool    merge_in_background):
     m_epsilon(epsilon),
     m_epsilon_prime(epsilon / 3.0),
     m_k((uint32_t) std::ceil(1 / m_epsilon_prime)),
@@ -1222,8 +1608,20 @@ TreeMisraGriesBITP::TreeMisraGriesBITP(
     m_cur_sketch(nullptr),
     m_size_counter(0),
     m_size_counter_max(0),
+    m_merge_in_background(merge_in_background),
+    m_sealed_leaves(),
+    m_num_unmerged_leaves(0),
+    m_merge_worker(),
+    m_mutex(),
+    m_worker_cv(),
+    m_merged_cv(),
+    m_worker_waiting(false),
+    m_num_merge_waiters(0),
+    m_stopped(false),
+    m_merge_error(),
+    m_merge_failed(false),
     m_tmp_ts(~0ul),
-    m_tmp_mg(nullptr),
+    m_tmp_summary(),
     m_est_tot_cnt(0)
 {
     m_cur_sketch = new MisraGries(m_k);
@@ -1238,6 +1636,10 @@ TreeMisraGriesBITP::~TreeMisraGriesBITP()
 void
 TreeMisraGriesBITP::clear()
 {
+    stop_merge_worker();
+    m_merge_error = nullptr;
+    m_merge_failed.store(false, std::memory_order_relaxed);
+
     m_last_ts = 0;
     m_tot_cnt = 0;
     m_level = 0;
@@ -1262,17 +1664,14 @@ TreeMisraGriesBITP::clear()
     }
 
     m_tmp_ts = ~0ul;
-    if (m_tmp_mg)
-    {
-        delete m_tmp_mg;
-        m_tmp_mg = nullptr;
-    }
+    m_tmp_summary.clear();
     m_est_tot_cnt = 0;
 }
 
 size_t
 TreeMisraGriesBITP::memory_usage() const
 {
+    wait_for_merges();
     return 72 // scalar members
         + sizeof(m_tree) + m_tree.capacity() * sizeof(TreeNode*)
         + sizeof(m_right_most_nodes) + m_right_most_nodes.capacity() * sizeof(TreeNode*)
@@ -1283,6 +1682,7 @@ TreeMisraGriesBITP::memory_usage() const
 size_t
 TreeMisraGriesBITP::max_memory_usage() const
 {
+    wait_for_merges();
     return 72 // scalar members
         + sizeof(m_tree) + m_tree.capacity() * sizeof(TreeNode*)
         + sizeof(m_right_most_nodes) + m_right_most_nodes.capacity() * sizeof(TreeNode*)
@@ -1302,13 +1702,15 @@ TreeMisraGriesBITP::update(
     uint32_t value,
     int c)
 {
+    if (m_merge_failed.load(std::memory_order_relaxed))
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        rethrow_merge_error();
+    }
+
     if (m_tmp_ts == ts)
     {
-        if (m_tmp_mg)
-        {
-            delete m_tmp_mg;
-            m_tmp_mg = nullptr;
-        }
+        m_tmp_summary.clear();
         m_tmp_ts = ~0ul;
     }
 
@@ -1317,11 +1719,6 @@ TreeMisraGriesBITP::update(
         merge_cur_sketch(); 
     }
 
-    if (m_size_counter > m_size_counter_max)
-    {
-        m_size_counter_max = m_size_counter;
-    }
-
     m_cur_sketch->update(value, c);
     m_last_ts = ts;
     m_tot_cnt += c;
@@ -1339,8 +1736,8 @@ TreeMisraGriesBITP::estimate_heavy_hitters_bitp(
 
     create_tmp_mg_at(ts_s);
 
-    auto ret = m_tmp_mg->estimate_heavy_hitters(
-            frac_threshold - m_epsilon_prime, m_est_tot_cnt);
+    auto ret = m_tmp_summary.estimate_heavy_hitters(
+            frac_threshold - m_epsilon_prime, m_est_tot_cnt, 1.0 / m_k);
     
     return ret;
 }
@@ -1349,7 +1746,11 @@ void
 TreeMisraGriesBITP::create_tmp_mg_at(
     TIMESTAMP ts_s) const
 {
-    MisraGries *mg = m_cur_sketch->clone();
+    wait_for_merges();
+
+    FrozenMisraGries cur_summary(*m_cur_sketch);
+    std::vector<const FrozenMisraGries*> summaries;
+    summaries.push_back(&cur_summary);
     uint64_t est_excluded_cnt = 0;
     uint64_t level = m_tree.size();
     while (level > 0)
@@ -1372,7 +1773,7 @@ TreeMisraGriesBITP::create_tmp_mg_at(
                     {
                         // the right subtree is in range
                         does_intersect = true;
-                        mg->merge(tn->m_right->m_mg);
+                        summaries.push_back(tn->m_right->m_mg);
                         tn = tn->m_left;
                     }
                     else
@@ -1401,16 +1802,13 @@ TreeMisraGriesBITP::create_tmp_mg_at(
         TreeNode *tn = m_tree[--level];
         if (tn)
         {
-            mg->merge(tn->m_mg);
+            summaries.push_back(tn->m_mg);
         }
     }
 
     m_tmp_ts = ts_s;
-    if (m_tmp_mg)
-    {
-        delete m_tmp_mg;
-    }
-    m_tmp_mg = mg;
+    m_tmp_summary = FrozenMisraGries::merge(
+        summaries.data(), summaries.size(), m_k);
     m_est_tot_cnt = m_tot_cnt - est_excluded_cnt;
 }
 
@@ -1425,19 +1823,169 @@ TreeMisraGriesBITP::estimate_frequency_bitp(
     }
 
     uint64_t d = (m_epsilon_prime / 2) * m_est_tot_cnt;
-    auto &cnt_map = MGA::cnt_map(m_tmp_mg);
-    auto iter = cnt_map.find(key);
-    if (iter == cnt_map.end()) return 0;
-    return iter->second + d;
+    uint64_t cnt = m_tmp_summary.get_cnt(key);
+    if (cnt == 0) return 0;
+    return cnt + d;
 }
 
 void
 TreeMisraGriesBITP::merge_cur_sketch()
+{
+    if (!m_merge_in_background)
+    {
+        insert_leaf(m_last_ts, m_tot_cnt,
+            new FrozenMisraGries(*m_cur_sketch));
+        m_cur_sketch->clear();
+        return ;
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // a failed worker has exited and takes no more leaves
+    rethrow_merge_error();
+    if (!m_merge_worker.joinable())
+    {
+        m_stopped = false;
+        m_merge_worker = std::thread(
+            &TreeMisraGriesBITP::run_merge_worker, this);
+    }
+
+    // bounds the memory of the sealed leaves if the worker falls behind
+    if (m_num_unmerged_leaves >= max_unmerged_leaves)
+    {
+        ++m_num_merge_waiters;
+        m_merged_cv.wait(lock, [this] {
+            return m_num_unmerged_leaves < max_unmerged_leaves;
+        });
+        --m_num_merge_waiters;
+        rethrow_merge_error();
+    }
+    m_sealed_leaves.push_back(SealedLeaf{m_last_ts, m_tot_cnt, m_cur_sketch});
+    ++m_num_unmerged_leaves;
+    bool wake_worker = m_worker_waiting;
+    lock.unlock();
+
+    if (wake_worker)
+    {
+        m_worker_cv.notify_one();
+    }
+    m_cur_sketch = new MisraGries(m_k);
+}
+
+void
+TreeMisraGriesBITP::run_merge_worker()
+{
+    std::vector<SealedLeaf> leaves;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        m_worker_waiting = true;
+        m_worker_cv.wait(lock, [this] {
+            return m_stopped || !m_sealed_leaves.empty();
+        });
+        m_worker_waiting = false;
+        // the remaining leaves are inserted before stopping
+        if (m_sealed_leaves.empty()) break;
+        leaves.swap(m_sealed_leaves);
+        lock.unlock();
+
+        for (size_t i = 0; i < leaves.size(); ++i)
+        {
+            const SealedLeaf &leaf = leaves[i];
+            try
+            {
+                FrozenMisraGries *summary = new FrozenMisraGries(*leaf.m_mg);
+                delete leaf.m_mg;
+                insert_leaf(leaf.m_ts, leaf.m_tot_cnt, summary);
+            }
+            catch (...)
+            {
+                // An exception escaping the thread would terminate the
+                // process. It is rethrown by the next update() or query
+                // instead, and the remaining leaves are dropped.
+                for (size_t j = i + 1; j < leaves.size(); ++j)
+                {
+                    delete leaves[j].m_mg;
+                }
+                lock.lock();
+                for (const SealedLeaf &leaf2: m_sealed_leaves)
+                {
+                    delete leaf2.m_mg;
+                }
+                m_sealed_leaves.clear();
+                m_num_unmerged_leaves = 0;
+                m_merge_error = std::current_exception();
+                m_merge_failed.store(true, std::memory_order_relaxed);
+                bool wake_waiters = m_num_merge_waiters > 0;
+                lock.unlock();
+                if (wake_waiters)
+                {
+                    m_merged_cv.notify_all();
+                }
+                return ;
+            }
+
+            lock.lock();
+            --m_num_unmerged_leaves;
+            bool wake_waiters = m_num_merge_waiters > 0;
+            lock.unlock();
+            if (wake_waiters)
+            {
+                m_merged_cv.notify_all();
+            }
+        }
+        leaves.clear();
+
+        lock.lock();
+    }
+}
+
+void
+TreeMisraGriesBITP::stop_merge_worker()
+{
+    if (!m_merge_worker.joinable()) return ;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopped = true;
+    }
+    m_worker_cv.notify_one();
+    m_merge_worker.join();
+}
+
+void
+TreeMisraGriesBITP::wait_for_merges() const
+{
+    if (!m_merge_in_background) return ;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (m_num_unmerged_leaves > 0)
+    {
+        ++m_num_merge_waiters;
+        m_merged_cv.wait(lock, [this] { return m_num_unmerged_leaves == 0; });
+        --m_num_merge_waiters;
+    }
+    rethrow_merge_error();
+}
+
+void
+TreeMisraGriesBITP::rethrow_merge_error() const
+{
+    if (m_merge_error)
+    {
+        std::rethrow_exception(m_merge_error);
+    }
+}
+
+void
+TreeMisraGriesBITP::insert_leaf(
+    TIMESTAMP ts,
+    uint64_t tot_cnt,
+    FrozenMisraGries *summary)
 {
     TreeNode *tn = new TreeNode;
-    tn->m_ts = m_last_ts;
-    tn->m_tot_cnt = m_tot_cnt;
-    tn->m_mg = m_cur_sketch;
+    tn->m_ts = ts;
+    tn->m_tot_cnt = tot_cnt;
+    tn->m_mg = summary;
     tn->m_left = nullptr;
     tn->m_right = nullptr;
     tn->m_parent = nullptr;
@@ -1449,7 +1997,7 @@ TreeMisraGriesBITP::merge_cur_sketch()
     {
         TreeNode *tn_merged = new TreeNode;
         tn_merged->m_ts = m_tree[level]->m_ts;
-        tn_merged->m_tot_cnt = m_tot_cnt;
+        tn_merged->m_tot_cnt = tot_cnt;
         tn_merged->m_left = m_tree[level];
         tn_merged->m_right = tn;
         tn_merged->m_parent = nullptr;
@@ -1457,9 +2005,12 @@ TreeMisraGriesBITP::merge_cur_sketch()
         tn->m_parent = tn_merged;
     
         m_size_counter -= m_tree[level]->m_mg->memory_usage();
-        tn_merged->m_mg = m_tree[level]->m_mg;
+        const FrozenMisraGries *children[2] = {m_tree[level]->m_mg, tn->m_mg};
+        tn_merged->m_mg = new FrozenMisraGries(
+            FrozenMisraGries::merge(children, 2, m_k));
+        tn_merged->m_mg->shrink_to_fit();
+        delete m_tree[level]->m_mg;
         m_tree[level]->m_mg = nullptr;
-        tn_merged->m_mg->merge(tn->m_mg);
         m_size_counter += sizeof(TreeNode) + tn_merged->m_mg->memory_usage();
         
         tn->m_next = m_right_most_nodes[level]->m_next;
@@ -1491,29 +2042,12 @@ TreeMisraGriesBITP::merge_cur_sketch()
             // compress p
             if (p->m_mg)
             {
-                uint64_t tot_cnt = m_tot_cnt - p->m_prev->m_tot_cnt;
-                uint64_t threshold = (uint64_t) std::floor(tot_cnt * m_epsilon_prime);
+                uint64_t p_tot_cnt = tot_cnt - p->m_prev->m_tot_cnt;
+                uint64_t threshold = (uint64_t) std::floor(p_tot_cnt * m_epsilon_prime);
 
                 m_size_counter -= p->m_mg->memory_usage();
-                
-                if (MGA::delta(p->m_mg) != 0)
-                {
-                    MGA::reset_delta(p->m_mg);
-                }
-                cnt_map_t& cnt_map = MGA::cnt_map(p->m_mg);
-                for (auto iter = cnt_map.begin();
-                        iter != cnt_map.end();)
-                {
-                    if (iter->second <= threshold)
-                    {
-                        iter = cnt_map.erase(iter);
-                    }
-                    else
-                    {
-                        ++iter;
-                    }
-                }
-
+                p->m_mg->purge(threshold);
+                p->m_mg->shrink_to_fit();
                 m_size_counter += p->m_mg->memory_usage();
             }
         }
@@ -1551,7 +2085,10 @@ TreeMisraGriesBITP::merge_cur_sketch()
         }
     }
 
-    m_cur_sketch = new MisraGries(m_k);
+    if (m_size_counter > m_size_counter_max)
+    {
+        m_size_counter_max = m_size_counter;
+    }
 }
 
 int
@@ -1577,8 +2114,328 @@ TreeMisraGriesBITP::create_from_config(
     int idx)
 {
     double epsilon = g_config->get_double("TMG_BITP.epsilon", idx).value();
+    // a merge worker only competes with the updates on a single core
+    bool merge_in_background =
+        g_config->get_boolean("TMG_BITP.merge_in_background").value() &&
+        std::thread::hardware_concurrency() > 1;
+
+    return new TreeMisraGriesBITP(epsilon, merge_in_background);
+}
+
+//
+// ShardedMisraGries implementation
+//
+
+ShardedMisraGries::ShardedMisraGries(
+    const std::string   &shard_sketch_name,
+    double              epsilon,
+    uint32_t            num_shards,
+    uint32_t            num_threads,
+    bool                full_epsilon_per_shard):
+    m_shard_sketch_name(shard_sketch_name),
+    m_epsilon(epsilon),
+    m_full_epsilon_per_shard(full_epsilon_per_shard),
+    m_shard_epsilon(full_epsilon_per_shard ?
+        epsilon : std::min(epsilon * num_shards, 1.0)),
+    m_num_threads((num_threads == 0 || num_threads > num_shards) ?
+        num_shards : num_threads),
+    m_shards(),
+    m_shard_updates(num_shards),
+    m_workers(),
+    m_mutex(),
+    m_worker_cv(),
+    m_done_cv(),
+    m_batch_seq(0),
+    m_num_busy_workers(0),
+    m_stopped(false)
+{
+    m_shards.reserve(num_shards);
+    for (uint32_t i = 0; i < num_shards; ++i)
+    {
+        if (shard_sketch_name == "TMG")
+        {
+            m_shards.push_back(new TreeMisraGries(m_shard_epsilon));
+        }
+        else
+        {
+            m_shards.push_back(new ChainMisraGries(m_shard_epsilon));
+        }
+    }
+}
+
+ShardedMisraGries::~ShardedMisraGries()
+{
+    stop_workers();
+    for (IPrefixMisraGries *shard: m_shards)
+    {
+        delete shard;
+    }
+}
+
+void
+ShardedMisraGries::clear()
+{
+    for (IPrefixMisraGries *shard: m_shards)
+    {
+        shard->clear();
+    }
+}
+
+size_t
+ShardedMisraGries::memory_usage() const
+{
+    return std::accumulate(m_shards.begin(), m_shards.end(),
+        (size_t) 0,
+        [](size_t acc, const IPrefixMisraGries *shard) -> size_t {
+            return acc + shard->memory_usage();
+        });
+}
+
+std::string
+ShardedMisraGries::get_short_description() const
+{
+    return "SMG-" + m_shard_sketch_name + "-e" + std::to_string(m_epsilon)
+        + "-s" + std::to_string(m_shards.size())
+        + (m_full_epsilon_per_shard ? "-fe" : "");
+}
+
+void
+ShardedMisraGries::update(
+    TIMESTAMP ts,
+    uint32_t key,
+    int c)
+{
+    m_shards[shard_of(key)]->update(ts, key, c);
+}
+
+void
+ShardedMisraGries::update_batch(
+    const UpdateRecord_u32 *records,
+    size_t n)
+{
+    for (std::vector<UpdateRecord_u32> &updates: m_shard_updates)
+    {
+        updates.clear();
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        m_shard_updates[shard_of(records[i].m_value)].push_back(records[i]);
+    }
+
+    if (m_num_threads <= 1)
+    {
+        update_shards(0);
+        return ;
+    }
+
+    if (m_workers.empty())
+    {
+        start_workers();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ++m_batch_seq;
+        m_num_busy_workers = (uint32_t) m_workers.size();
+    }
+    m_worker_cv.notify_all();
+
+    update_shards(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done_cv.wait(lock, [this] { return m_num_busy_workers == 0; });
+}
+
+void
+ShardedMisraGries::update_shards(
+    uint32_t tid)
+{
+    for (size_t i = tid; i < m_shards.size(); i += m_num_threads)
+    {
+        const std::vector<UpdateRecord_u32> &updates = m_shard_updates[i];
+        if (!updates.empty())
+        {
+            m_shards[i]->update_batch(updates.data(), updates.size());
+        }
+    }
+}
+
+void
+ShardedMisraGries::run_worker(
+    uint32_t tid)
+{
+    uint64_t last_batch_seq = 0;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        m_worker_cv.wait(lock, [this, last_batch_seq] {
+            return m_stopped || m_batch_seq != last_batch_seq;
+        });
+        if (m_stopped) break;
+        last_batch_seq = m_batch_seq;
+        lock.unlock();
+
+        update_shards(tid);
+
+        lock.lock();
+        if (--m_num_busy_workers == 0)
+        {
+            m_done_cv.notify_one();
+        }
+    }
+}
+
+void
+ShardedMisraGries::start_workers()
+{
+    m_stopped = false;
+    m_workers.reserve(m_num_threads - 1);
+    for (uint32_t tid = 1; tid < m_num_threads; ++tid)
+    {
+        m_workers.emplace_back(&ShardedMisraGries::run_worker, this, tid);
+    }
+}
+
+void
+ShardedMisraGries::stop_workers()
+{
+    if (m_workers.empty()) return ;
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopped = true;
+    }
+    m_worker_cv.notify_all();
+    for (std::thread &worker: m_workers)
+    {
+        worker.join();
+    }
+    m_workers.clear();
+}
+
+std::vector<IPersistentHeavyHitterSketch::HeavyHitter>
+ShardedMisraGries::estimate_heavy_hitters(
+    TIMESTAMP ts_e,
+    double frac_threshold) const
+{
+    std::vector<MG*> prefix_mgs;
+    prefix_mgs.reserve(m_shards.size());
+    uint64_t tot_cnt = 0;
+    double max_err = 0;
+    size_t num_counters = 0;
+    for (const IPrefixMisraGries *shard: m_shards)
+    {
+        uint64_t shard_tot_cnt;
+        double err_frac;
+        MG *mg = shard->get_prefix_mg(ts_e, shard_tot_cnt, err_frac);
+        prefix_mgs.push_back(mg);
+        tot_cnt += shard_tot_cnt;
+        max_err = std::max(max_err, err_frac * shard_tot_cnt);
+        num_counters += MGA::cnt_map(mg).size();
+    }
+
+    // The shards have disjoint keys, so a merged summary with more counters
+    // than all the shards have in total never subtracts during the merge and
+    // adds no error of its own.
+    MG merged((uint32_t) std::max(num_counters + 1, (size_t) 2));
+    for (MG *mg: prefix_mgs)
+    {
+        merged.merge(mg);
+        delete mg;
+    }
+
+    // A shard with N_i total count under-estimates by at most err_frac * N_i,
+    // so a key with frac_threshold * N has an estimate of at least
+    // frac_threshold * N - max_err. MisraGries::estimate_heavy_hitters()
+    // subtracts its own eps from the threshold, which we add back here.
+    double max_err_frac = (tot_cnt == 0) ? 0 : max_err / tot_cnt;
+    return merged.estimate_heavy_hitters(
+        frac_threshold - max_err_frac + merged.get_eps(), tot_cnt);
+}
+
+std::string
+ShardedMisraGries::get_extra_stats() const
+{
+    std::string budget = "shard epsilon = " + std::to_string(m_shard_epsilon)
+        + " (about " + std::to_string(
+            (uint64_t) std::ceil(1 / m_shard_epsilon) * m_shards.size())
+        + " counters in total)";
+    if (m_shard_sketch_name != "TMG")
+    {
+        return budget;
+    }
+
+    TreeMisraGries::PrefixCacheStats stats{0, 0, 0, 0, 0};
+    for (const IPrefixMisraGries *shard: m_shards)
+    {
+        TreeMisraGries::PrefixCacheStats shard_stats =
+            static_cast<const TreeMisraGries*>(shard)->get_prefix_cache_stats();
+        stats.m_num_hits += shard_stats.m_num_hits;
+        stats.m_num_partial_hits += shard_stats.m_num_partial_hits;
+        stats.m_num_misses += shard_stats.m_num_misses;
+        stats.m_num_entries += shard_stats.m_num_entries;
+        stats.m_memory_usage += shard_stats.m_memory_usage;
+    }
+    return budget + ", " + TreeMisraGries::format_prefix_cache_stats(stats);
+}
+
+int
+ShardedMisraGries::num_configs_defined()
+{
+    if (g_config->is_list("SMG.epsilon"))
+    {
+        int len = (int) g_config->list_length("SMG.epsilon");
+
+        int len2 = (int) g_config->list_length("SMG.num_shards");
+        if (len2 != -1 && len2 != len)
+        {
+            std::cerr << "[WARN] SMG ignored because list length mismatch in params"
+                << std::endl;
+            return 0;
+        }
+
+        return len;
+    }
+
+    return -1;
+}
+
+ShardedMisraGries*
+ShardedMisraGries::get_test_instance()
+{
+    return new ShardedMisraGries("CMG", 0.1, 2, 1);
+}
+
+ShardedMisraGries*
+ShardedMisraGries::create_from_config(
+    int idx)
+{
+    std::string shard_sketch_name = g_config->get("SMG.shard_sketch").value();
+    if (shard_sketch_name != "CMG" && shard_sketch_name != "TMG")
+    {
+        std::cerr << "[WARN] invalid SMG.shard_sketch " << shard_sketch_name
+            << " (CMG or TMG required), using CMG" << std::endl;
+        shard_sketch_name = "CMG";
+    }
+
+    double epsilon = g_config->get_double("SMG.epsilon", idx).value();
+
+    uint32_t num_shards;
+    if (!g_config->is_list("SMG.num_shards"))
+    {
+        num_shards = g_config->get_u32("SMG.num_shards").value();
+    }
+    else
+    {
+        num_shards = g_config->get_u32("SMG.num_shards", idx).value();
+    }
+
+    uint32_t num_threads = g_config->get_u32("SMG.num_threads").value();
+    bool full_epsilon_per_shard =
+        g_config->get_boolean("SMG.full_epsilon_per_shard").value();
 
-    return new TreeMisraGriesBITP(epsilon);
+    return new ShardedMisraGries(shard_sketch_name, epsilon, num_shards,
+        num_threads, full_epsilon_per_shard);
 }
 
 } // namespace MisraGriesSketches
@@ -2,6 +2,13 @@
 #define PMMG_H
 
 #include <vector>
+#include <list>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
 #include "util.h"
 #include "misra_gries.h"
 #include "sketch.h"
@@ -10,13 +17,28 @@
 namespace MisraGriesSketches {
 
 typedef uint32_t key_type;
-typedef std::unordered_map<key_type, uint64_t> cnt_map_t;
+typedef FlatHashMap<key_type, uint64_t> cnt_map_t;
 typedef MisraGries MG;
 
-constexpr double umap_default_load_factor = 1.25;
+// A persistent heavy hitter sketch that can produce the MG summary of any
+// prefix. Summaries from sketches over disjoint key sets can be merged at
+// query time (see ShardedMisraGries).
+struct IPrefixMisraGries:
+    public IPersistentHeavyHitterSketch
+{
+    // Returns a new MG summary of the prefix up to ts_e, which the caller
+    // owns. tot_cnt is set to the (estimated) total count of the prefix and
+    // err_frac to the max under-estimation of the counters as a fraction of
+    // tot_cnt. The counters never over-estimate.
+    virtual MG*
+    get_prefix_mg(
+        TIMESTAMP ts_e,
+        uint64_t &tot_cnt,
+        double &err_frac) const = 0;
+};
 
 class ChainMisraGries:
-    public IPersistentHeavyHitterSketch,
+    public IPrefixMisraGries,
     public IPersistentFrequencyEstimationSketch
 {
 private:
@@ -51,6 +73,25 @@ private:
 
         uint64_t                m_last_tot_cnt;
     };
+
+    // A recorded change of a key in the point query index, i.e., its
+    // estimated count in the snapshot at m_ts (c - eps/3 * N, or 0 if it's
+    // not in the snapshot) from a checkpoint or a delta node.
+    struct KeyHistoryEntry
+    {
+        TIMESTAMP               m_ts;
+
+        uint64_t                m_cnt;
+    };
+
+    // The timestamp and total count of a checkpoint or a list of delta
+    // nodes, which are used to estimate the total count at a timestamp.
+    struct TimePoint
+    {
+        TIMESTAMP               m_ts;
+
+        uint64_t                m_tot_cnt;
+    };
     
     // Let c' be the actual counter, c be the counter since the last recorded
     // change (in dnode or checkpoint), and N be the total count when the last
@@ -126,7 +167,8 @@ private:
 public:
     ChainMisraGries(
         double      epsilon,
-        bool        use_update_new = true);
+        bool        use_update_new = true,
+        bool        use_point_query_index = false);
 
     virtual
     ~ChainMisraGries();
@@ -146,6 +188,11 @@ public:
         uint32_t key,
         int c = 1) override;
 
+    void
+    update_batch(
+        const UpdateRecord_u32 *records,
+        size_t n) override;
+
     std::vector<HeavyHitter>
     estimate_heavy_hitters(
         TIMESTAMP ts_e,
@@ -156,6 +203,12 @@ public:
         TIMESTAMP ts_e,
         uint32_t key) const;
 
+    MG*
+    get_prefix_mg(
+        TIMESTAMP ts_e,
+        uint64_t &tot_cnt,
+        double &err_frac) const override;
+
 private:
     void
     clear(
@@ -231,6 +284,26 @@ private:
     create_tmp_cnt_at(
         TIMESTAMP ts_e) const;
 
+    // Adds the counters of chkpt to the point query index.
+    void
+    index_checkpoint(
+        const ChkptNode &chkpt);
+
+    // Adds a list of delta nodes of the same timestamp to the point query
+    // index.
+    void
+    index_delta_list(
+        const DeltaNode *n);
+
+    // Looks up the estimated count of key in the snapshot at ts_e in the
+    // point query index, where est_tot_cnt is set to the estimated total
+    // count at ts_e. Same as the count in create_tmp_cnt_at(ts_e).
+    uint64_t
+    lookup_key_history(
+        TIMESTAMP ts_e,
+        uint32_t key,
+        uint64_t &est_tot_cnt) const;
+
     double                      m_epsilon,
 
                                 m_epsilon_over_3;
@@ -246,7 +319,7 @@ private:
     MG                          m_cur_sketch; // the one up to the current count
     
     // for update_old impl. only
-    std::unordered_map<key_type, SnapshotCounter>
+    FlatHashMap<key_type, SnapshotCounter>
                                 m_snapshot_cnt_map; // the one up to the last delta/chkpt
 
     std::vector<ChkptNode>      m_checkpoints;
@@ -263,10 +336,10 @@ private:
 
     Counter                     *m_free_counters;
 
-    std::unordered_map<key_type, Counter*>
+    FlatHashMap<key_type, Counter*>
                                 m_key_to_counter_map;
 
-    std::unordered_map<key_type, Counter*>
+    FlatHashMap<key_type, Counter*>
                                 m_deleted_counters;
 
     std::vector<Counter*>       m_c1_max_heap;
@@ -279,11 +352,20 @@ private:
     mutable TIMESTAMP           m_tmp_cnt_ts;
     
     // estimation are in [-2 * eps/3 * N, eps / 3 * N] of the true value 
-    mutable std::unordered_map<key_type, uint64_t>
-                                m_tmp_cnt_map;
+    mutable cnt_map_t           m_tmp_cnt_map;
 
     mutable uint64_t            m_est_tot_cnt;
 
+    // Optional index for point queries so that estimate_frequency() does
+    // not replay the delta list. Each key has its recorded changes in
+    // time order, including the ones in the checkpoints.
+    bool                        m_use_point_query_index;
+
+    FlatHashMap<key_type, std::vector<KeyHistoryEntry>>
+                                m_key_histories;
+
+    std::vector<TimePoint>      m_time_points;
+
 public:
     static ChainMisraGries*
     get_test_instance();
@@ -300,7 +382,7 @@ private:
 };
 
 class TreeMisraGries:
-    public IPersistentHeavyHitterSketch
+    public IPrefixMisraGries
 {
 private:
     struct TreeNode {
@@ -308,16 +390,37 @@ private:
 
         uint64_t            m_tot_cnt;
 
-        MisraGries          *m_mg;
+        FrozenMisraGries    *m_mg;
 
         TreeNode            *m_left,
 
                             *m_right;
     };
+
+    // The unpruned sum of the summaries of a prefix, i.e., the tree nodes
+    // that are merged for a query up to m_node->m_ts.
+    struct PrefixCacheEntry {
+        const TreeNode      *m_node;
+
+        FrozenMisraGries    m_summary;
+    };
     
 public:
+    struct PrefixCacheStats {
+        uint64_t            m_num_hits; // the entire prefix was cached
+
+        uint64_t            m_num_partial_hits;
+
+        uint64_t            m_num_misses;
+
+        size_t              m_num_entries;
+
+        size_t              m_memory_usage;
+    };
+
     TreeMisraGries(
-        double  epsilon);
+        double  epsilon,
+        uint32_t prefix_cache_size = 8); // 0 to disable
 
     virtual
     ~TreeMisraGries();
@@ -337,12 +440,50 @@ public:
         uint32_t value,
         int c) override;
 
+    void
+    update_batch(
+        const UpdateRecord_u32 *records,
+        size_t n) override;
+
     std::vector<IPersistentHeavyHitterSketch::HeavyHitter>
     estimate_heavy_hitters(
         TIMESTAMP ts_e,
         double frac_threshold) const override;
 
+    MG*
+    get_prefix_mg(
+        TIMESTAMP ts_e,
+        uint64_t &tot_cnt,
+        double &err_frac) const override;
+
+    std::string
+    get_extra_stats() const override;
+
+    PrefixCacheStats
+    get_prefix_cache_stats() const;
+
+    static std::string
+    format_prefix_cache_stats(
+        const PrefixCacheStats &stats);
+
 private:
+    // Merges the summaries of the prefix up to ts_e, where tot_cnt is set
+    // to the (estimated) total count of the prefix.
+    FrozenMisraGries
+    get_prefix_summary(
+        TIMESTAMP ts_e,
+        uint64_t &tot_cnt) const;
+
+    // Returns the sum of the summaries of nodes, which are the tree nodes
+    // of a prefix in the order of time. It starts from the longest cached
+    // prefix of nodes and caches the result.
+    const FrozenMisraGries*
+    get_cached_prefix_sum(
+        const std::vector<const TreeNode*> &nodes) const;
+
+    void
+    clear_prefix_cache();
+
     void
     merge_cur_sketch();
 
@@ -374,6 +515,20 @@ private:
 
     size_t                  m_size_counter;
 
+    // Tree nodes are never modified once they are in m_tree, so the entries
+    // are valid until clear(). Most recently used first.
+    uint32_t                m_prefix_cache_size;
+
+    mutable std::list<PrefixCacheEntry>
+                            m_prefix_cache;
+
+    mutable std::unordered_map<const TreeNode*,
+        std::list<PrefixCacheEntry>::iterator>
+                            m_prefix_cache_index;
+
+    mutable PrefixCacheStats
+                            m_prefix_cache_stats;
+
 public:
     static int
     num_configs_defined();
@@ -395,7 +550,7 @@ private:
 
         uint64_t            m_tot_cnt;
 
-        MisraGries          *m_mg;
+        FrozenMisraGries    *m_mg;
 
         TreeNode            *m_parent, 
 
@@ -411,10 +566,21 @@ private:
                                      // TreeNodes are also linked as a **regular**
                                      // list in each level through the m_prev field
     };
+
+    // The MG of a finished timestamp that is waiting to be inserted into
+    // the tree by the merge worker.
+    struct SealedLeaf {
+        TIMESTAMP           m_ts;
+
+        uint64_t            m_tot_cnt;
+
+        MisraGries          *m_mg;
+    };
     
 public:
     TreeMisraGriesBITP(
-        double epsilon);
+        double epsilon,
+        bool merge_in_background = true);
 
     virtual
     ~TreeMisraGriesBITP();
@@ -451,9 +617,36 @@ public:
         uint32_t key) const override;
 
 private:
+    // Seals the current sketch and inserts it into the tree as a leaf,
+    // either synchronously or by handing it to the merge worker.
     void
     merge_cur_sketch();
 
+    // Inserts a leaf with the summary of the updates up to ts and merges
+    // the complete subtrees along the way.
+    void
+    insert_leaf(
+        TIMESTAMP ts,
+        uint64_t tot_cnt,
+        FrozenMisraGries *summary);
+
+    void
+    run_merge_worker();
+
+    // Inserts the remaining sealed leaves and stops the merge worker.
+    void
+    stop_merge_worker();
+
+    // Waits until the merge worker has inserted all the sealed leaves, so
+    // that the tree is consistent with the updates so far. Rethrows the
+    // exception of a failed merge.
+    void
+    wait_for_merges() const;
+
+    // Rethrows m_merge_error if set. Requires the lock on m_mutex.
+    void
+    rethrow_merge_error() const;
+
     void
     create_tmp_mg_at(
         TIMESTAMP ts_s) const;
@@ -481,11 +674,52 @@ private:
     size_t                  m_size_counter;
 
     size_t                  m_size_counter_max;
+
+    // If set, the tree is maintained by a worker thread, which is started on
+    // the first sealed leaf, while the updates go into a new m_cur_sketch.
+    // The tree and its counters above are owned by the worker while there
+    // are sealed leaves.
+    bool                    m_merge_in_background;
+
+    // update() blocks if the worker falls this many leaves behind
+    static constexpr size_t max_unmerged_leaves = 1024;
+
+    // sealed leaves that the worker hasn't taken yet
+    std::vector<SealedLeaf> m_sealed_leaves;
+
+    // sealed leaves that haven't been inserted yet, including the ones
+    // taken by the worker
+    size_t                  m_num_unmerged_leaves;
+
+    std::thread             m_merge_worker;
+
+    mutable std::mutex      m_mutex;
+
+    std::condition_variable m_worker_cv; // new sealed leaves or stopping
+
+    mutable std::condition_variable
+                            m_merged_cv; // sealed leaves are inserted
+
+    // the condition variables are only notified if someone is waiting
+    bool                    m_worker_waiting;
+
+    mutable uint32_t        m_num_merge_waiters;
+
+    bool                    m_stopped;
+
+    // An exception thrown by insert_leaf() on the merge worker, which then
+    // stops and drops the remaining sealed leaves. It is rethrown by every
+    // update() and query until clear().
+    std::exception_ptr      m_merge_error;
+
+    // set after m_merge_error so that update() can check it without the lock
+    std::atomic<bool>       m_merge_failed;
     
     // for frequency estimation
     mutable TIMESTAMP       m_tmp_ts; 
 
-    mutable MisraGries      *m_tmp_mg;
+    mutable FrozenMisraGries
+                            m_tmp_summary;
 
     mutable uint64_t        m_est_tot_cnt;
 
@@ -501,11 +735,142 @@ public:
         int idx);
 };
 
+// Partitions the keys by hash across a number of CMG or TMG instances
+// (shards), which are updated in parallel by update_batch(). Since the shards
+// summarize disjoint key sets, the heavy hitters are found by merging the
+// prefix MG summaries of all the shards at query time.
+//
+// By default the counter budget of a single sketch with epsilon is split
+// across the shards, i.e., each shard is created with epsilon * num_shards
+// and about k / num_shards counters, so the total memory does not grow with
+// the number of shards. A shard under-estimates by at most epsilon *
+// num_shards times its own count, which is epsilon times the total count
+// when the hash balances the shards. Heavy keys may unbalance them, but the
+// MG error of a shard is in fact bounded by its residual count outside its
+// largest counters (the tail bound of Berinde et al.), and the residual keys
+// are light and spread evenly by the hash. Queries never rely on the balance:
+// the threshold is lowered by the largest actual error bound of any shard.
+//
+// With full_epsilon_per_shard, every shard is created with epsilon instead,
+// which keeps the worst-case bound of a single sketch at up to num_shards
+// times its memory. get_extra_stats() reports the shard epsilon in use.
+class ShardedMisraGries:
+    public IPersistentHeavyHitterSketch
+{
+public:
+    ShardedMisraGries(
+        const std::string   &shard_sketch_name, // CMG or TMG
+        double              epsilon,
+        uint32_t            num_shards,
+        uint32_t            num_threads, // 0 for one thread per shard
+        bool                full_epsilon_per_shard = false);
+
+    virtual
+    ~ShardedMisraGries();
+
+    void
+    clear() override;
+
+    size_t
+    memory_usage() const override;
+
+    std::string
+    get_short_description() const override;
+
+    void
+    update(
+        TIMESTAMP ts,
+        uint32_t key,
+        int c = 1) override;
+
+    void
+    update_batch(
+        const UpdateRecord_u32 *records,
+        size_t n) override;
+
+    std::vector<HeavyHitter>
+    estimate_heavy_hitters(
+        TIMESTAMP ts_e,
+        double frac_threshold) const override;
+
+    std::string
+    get_extra_stats() const override;
+
+private:
+    uint32_t
+    shard_of(
+        uint32_t key) const
+    {
+        // Fibonacci hashing followed by a multiply-shift range reduction
+        return (uint32_t)(((uint64_t)(key * 0x9E3779B1u) * m_shards.size()) >> 32);
+    }
+
+    // Applies the staged updates to the shards owned by thread tid, i.e.,
+    // shards tid, tid + m_num_threads, ...
+    void
+    update_shards(
+        uint32_t tid);
+
+    void
+    run_worker(
+        uint32_t tid);
+
+    void
+    start_workers();
+
+    void
+    stop_workers();
+
+    std::string             m_shard_sketch_name;
+
+    double                  m_epsilon;
+
+    bool                    m_full_epsilon_per_shard;
+
+    double                  m_shard_epsilon;
+
+    uint32_t                m_num_threads; // including the updating thread
+
+    std::vector<IPrefixMisraGries*>
+                            m_shards;
+
+    std::vector<std::vector<UpdateRecord_u32>>
+                            m_shard_updates; // staged updates of a batch
+
+    // worker threads 1 .. m_num_threads - 1, started on the first batch
+    std::vector<std::thread>
+                            m_workers;
+
+    std::mutex              m_mutex;
+
+    std::condition_variable m_worker_cv; // a new batch or stopping
+
+    std::condition_variable m_done_cv; // all workers finished the batch
+
+    uint64_t                m_batch_seq;
+
+    uint32_t                m_num_busy_workers;
+
+    bool                    m_stopped;
+
+public:
+    static int
+    num_configs_defined();
+
+    static ShardedMisraGries*
+    get_test_instance();
+
+    static ShardedMisraGries*
+    create_from_config(
+        int idx);
+};
+
 } // namespace MisraGriesSketches
 
 using MisraGriesSketches::ChainMisraGries;
 using MisraGriesSketches::TreeMisraGries;
 using MisraGriesSketches::TreeMisraGriesBITP;
+using MisraGriesSketches::ShardedMisraGries;
 
 #endif // PMMG_H
 
@@ -15,12 +15,16 @@
 #include <cstdio>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
 #include <cassert>
 #include <random>
 #include "util.h"
 #include "conf.h"
 #include "sketch.h"
 #include "perf_timer.h"
+#include "binary_stream.h"
 extern "C"
 {
 #include <cblas.h>
@@ -43,7 +47,9 @@ class QueryBase
 
 protected:
     QueryBase():
-        m_out(std::cout)
+        m_out(std::cout),
+        m_update_batch_size(1),
+        m_num_update_slots(1)
     {}
 
     void finish() {}
@@ -58,6 +64,14 @@ protected:
 
     std::ostream                &m_out;
 
+    // max number of pending updates before they are applied to the sketches
+    uint32_t                    m_update_batch_size;
+
+    // Number of batches of pending updates the implementation should be able
+    // to buffer at the same time. The implementation parses updates into the
+    // slot selected by the last select_update_slot() call. Slot 0 is selected
+    // initially.
+    uint32_t                    m_num_update_slots;
 };
 
 template<
@@ -68,6 +82,18 @@ protected:
     using typename QueryImpl::ISketch;
     using QueryImpl::m_out;
     using QueryImpl::m_sketches;
+    using QueryImpl::m_update_batch_size;
+    using QueryImpl::m_num_update_slots;
+
+    struct UpdateWorker
+    {
+        std::thread             m_thread;
+
+        std::vector<int>        m_sketch_indices;
+
+        uint64_t                m_num_consumed_batches; // protected by
+                                                        // m_update_mutex
+    };
 
 public:
     Query():
@@ -75,6 +101,10 @@ public:
         m_measure_time(false),
         m_update_timers(),
         m_query_timers(),
+        m_num_update_threads(0),
+        m_cur_update_slot(0),
+        m_num_published_batches(0),
+        m_update_workers_stopped(false),
         m_progress_bar_stopped(true),
         m_progress_bar_status(PBS_NONE),
         m_infile_last_read_bytes(0),
@@ -83,7 +113,9 @@ public:
     {}
 
     ~Query()
-    {}
+    {
+        stop_update_workers();
+    }
     
     int
     setup()
@@ -109,6 +141,14 @@ public:
             strcpy(text_tt, "<time_buffer_too_small>");
         }
         
+        m_update_batch_size = g_config->get_u32("perf.update_batch_size").value();
+        m_num_update_threads = g_config->get_u32("perf.num_update_threads").value();
+        if (m_num_update_threads > 0)
+        {
+            m_num_update_slots =
+                g_config->get_u32("perf.update_pipeline_depth").value();
+        }
+
         int ret;
         if ((ret = QueryImpl::early_setup()))
         {
@@ -129,6 +169,10 @@ public:
                 for (auto &sketch: added_sketches)
                 {
                     m_sketches.emplace_back(dynamic_cast<ISketch*>(sketch));
+#ifdef STATIC_SKETCH_DISPATCH
+                    m_static_updaters.push_back(get_static_updater<
+                        typename StaticUpdater::record_type>(st, sketch));
+#endif
                 }
             }
         }
@@ -154,9 +198,8 @@ public:
         }
 
         m_out << "Processing infile 0: " << m_infile_names[0] << std::endl;
-        m_infile.open(m_infile_names[0]);
+        open_infile(0);
         m_next_infile_idx = 1;
-        m_infile_prev_pos = 0;
 
         std::optional<std::string> outfile_name_opt = g_config->get("outfile");
         m_has_outfile = (bool) outfile_name_opt;
@@ -189,47 +232,79 @@ public:
         return QueryImpl::additional_setup();
     }
 
-#define PERF_TIMER_TIMEIT(timer, action) \
+#define PERF_TIMER_TIMEIT_N(timer, n, action) \
     do { \
         if (!m_measure_time) { action } else { \
             (timer)->measure_start(); \
             { action } \
-            (timer)->measure_end();   \
+            (timer)->measure_end(n);   \
         } \
     } while (0)
 
+#define PERF_TIMER_TIMEIT(timer, action) PERF_TIMER_TIMEIT_N(timer, 1, action)
+
     int
     run()
     {
-        if (!m_infile.is_open()) return 1;
+        if (!m_infile.is_open() && !m_bin_infile.is_open()) return 1;
 
+        start_update_workers();
         start_progress_bar();
         
-        std::string line;
         size_t lineno = 0;
         for (;;)
         {
-            if (!std::getline(m_infile, line))
+            if (m_infile_is_binary)
             {
-                if (m_next_infile_idx < m_infile_names.size()) {
-                    m_infile.close();
-                    m_out << "Infile "
-                        << m_next_infile_idx - 1
-                        << " processed, printing stats"
-                        << std::endl;
-                    print_stats();
-
-                    m_out << "Processing infile "
-                        << m_next_infile_idx
-                        << ' ' 
-                        << m_infile_names[m_next_infile_idx] << std::endl;
-                    m_infile.open(m_infile_names[m_next_infile_idx++]);
-                    m_infile_prev_pos = 0;
-                    continue;
-                } else {
-                    break;
-                }
+                run_binary_infile(lineno);
             }
+            else
+            {
+                run_text_infile(lineno);
+            }
+            // must be done before closing the infile because pending updates
+            // may point into the mapped binary stream file
+            flush_updates();
+
+            if (m_next_infile_idx < m_infile_names.size()) {
+                close_infile();
+                m_out << "Infile "
+                    << m_next_infile_idx - 1
+                    << " processed, printing stats"
+                    << std::endl;
+                print_stats();
+
+                m_out << "Processing infile "
+                    << m_next_infile_idx
+                    << ' ' 
+                    << m_infile_names[m_next_infile_idx] << std::endl;
+                open_infile(m_next_infile_idx++);
+            } else {
+                break;
+            }
+        }
+
+        close_infile();
+        m_out << "Infile "
+            << m_next_infile_idx - 1
+            << " processed, printing stats"
+            << std::endl;
+        print_stats();
+
+        stop_progress_bar();
+        stop_update_workers();
+
+        return 0;
+    }
+
+private:
+    void
+    run_text_infile(
+        size_t &lineno)
+    {
+        std::string line;
+        while (std::getline(m_infile, line))
+        {
             ++lineno;
             auto pos = m_infile.tellg();
             m_infile_read_bytes += pos - m_infile_prev_pos;
@@ -246,45 +321,12 @@ public:
                 char *pc_arg_start;
                 
                 ts = (TIMESTAMP) strtoull(line.c_str() + 2, &pc_arg_start, 0);
-                if (QueryImpl::parse_query_arg(ts, pc_arg_start))
-                {
-                    fprintf(stderr,
-                        "[WARN] malformatted line on %lu\n",
-                        (uint64_t) lineno);
-                    continue;
-                }
-
-                pause_progress_bar();
-
-                for (int i = 0; i < (int) m_sketches.size(); ++i)
-                {
-                    PERF_TIMER_TIMEIT(&m_query_timers[i],
-                        QueryImpl::query(m_sketches[i].get(), ts););
-                    QueryImpl::print_query_summary(m_sketches[i].get());
-                    if (m_has_outfile)
-                    {
-                        QueryImpl::dump_query_result(m_sketches[i].get(),
-                            *m_outfiles[i].get(),
-                            ts,
-                            m_out_limit);
-                    }
-                }
-                
-                if (m_stderr_is_a_tty)
-                {
-                    m_out << std::endl;
-                }
-                continue_progress_bar();
+                run_query_at(ts, pc_arg_start, lineno);
             }
             else if (line[0] == '+')
             {
                 // stat request
-                pause_progress_bar();
-                m_out << "Stats request at line " << lineno
-                    << " with " << m_n_data << " processed" << std::endl;
-                print_stats();
-                m_out << std::endl;
-                continue_progress_bar();
+                run_stats_request(lineno);
             }
             else if (line[0] != '#')
             {
@@ -301,35 +343,287 @@ public:
                     continue;
                 }
 
-                for (int i = 0; i < (int) m_sketches.size(); ++i)
+                run_update();
+            }
+            // a line starting with # is a comment
+        }
+    }
+
+    // lineno counts records for binary stream files
+    void
+    run_binary_infile(
+        size_t &lineno)
+    {
+        const BinaryStreamRecord *rec;
+        while ((rec = m_bin_infile.next()))
+        {
+            ++lineno;
+            m_infile_read_bytes += m_bin_infile.bytes_read() - m_infile_prev_pos;
+            m_infile_prev_pos = m_bin_infile.bytes_read();
+
+            switch (rec->m_type)
+            {
+            case BSRT_QUERY:
+                run_query_at(rec->m_ts, rec->query_arg(), lineno);
+                break;
+            case BSRT_STATS:
+                run_stats_request(lineno);
+                break;
+            default:
+                if (QueryImpl::parse_binary_update_arg(rec))
                 {
-                    PERF_TIMER_TIMEIT(&m_update_timers[i],
-                        QueryImpl::update(m_sketches[i].get(), ts););
+                    fprintf(stderr,
+                        "[WARN] unexpected record %lu of type %u\n",
+                        (uint64_t) lineno,
+                        (unsigned) rec->m_type);
+                    continue;
                 }
 
-                ++m_n_data;
-                /*if (m_n_data % 50000 == 0)
-                {
-                    std::cerr << "Progress: " << m_n_data << " data points processed"
-                        << std::endl;
-                } */
+                run_update();
             }
-            // a line starting with # is a comment
         }
 
-        m_infile.close();
-        m_out << "Infile "
-            << m_next_infile_idx - 1
-            << " processed, printing stats"
-            << std::endl;
+        if (m_bin_infile.is_truncated())
+        {
+            fprintf(stderr,
+                "[WARN] truncated binary stream file after record %lu\n",
+                (uint64_t) lineno);
+        }
+    }
+
+    void
+    run_query_at(
+        TIMESTAMP ts,
+        const char *pc_arg_start,
+        size_t lineno)
+    {
+        flush_updates();
+
+        if (QueryImpl::parse_query_arg(ts, pc_arg_start))
+        {
+            fprintf(stderr,
+                "[WARN] malformatted line on %lu\n",
+                (uint64_t) lineno);
+            return ;
+        }
+
+        pause_progress_bar();
+
+        for (int i = 0; i < (int) m_sketches.size(); ++i)
+        {
+            PERF_TIMER_TIMEIT(&m_query_timers[i],
+                QueryImpl::query(m_sketches[i].get(), ts););
+            QueryImpl::print_query_summary(m_sketches[i].get());
+            if (m_has_outfile)
+            {
+                QueryImpl::dump_query_result(m_sketches[i].get(),
+                    *m_outfiles[i].get(),
+                    ts,
+                    m_out_limit);
+            }
+        }
+        
+        if (m_stderr_is_a_tty)
+        {
+            m_out << std::endl;
+        }
+        continue_progress_bar();
+    }
+
+    void
+    run_stats_request(
+        size_t lineno)
+    {
+        flush_updates();
+
+        pause_progress_bar();
+        m_out << "Stats request at line " << lineno
+            << " with " << m_n_data << " processed" << std::endl;
         print_stats();
+        m_out << std::endl;
+        continue_progress_bar();
+    }
 
-        stop_progress_bar();
+    // The update has been added to the pending updates by
+    // QueryImpl::parse_update_arg() or QueryImpl::parse_binary_update_arg().
+    void
+    run_update()
+    {
+        ++m_n_data;
+        if (QueryImpl::pending_updates_full())
+        {
+            submit_updates();
+        }
+    }
 
-        return 0;
+    // Applies the updates in the slot to sketch i.
+    void
+    update_sketch(
+        int i,
+        uint32_t slot)
+    {
+#ifdef STATIC_SKETCH_DISPATCH
+        if (m_static_updaters[i].is_valid())
+        {
+            QueryImpl::update_batch(&m_static_updaters[i], slot);
+            return ;
+        }
+#endif
+        QueryImpl::update_batch(m_sketches[i].get(), slot);
+    }
+
+    // Applies the pending updates to the sketches. Without update workers,
+    // this is done on the calling thread. Otherwise, the current slot is
+    // handed over to the workers and the next slot is selected for parsing,
+    // after waiting for the workers to release it if the pipeline is full.
+    void
+    submit_updates()
+    {
+        size_t n = QueryImpl::num_pending_updates();
+        if (n == 0) return ;
+
+        if (m_update_workers.empty())
+        {
+            for (int i = 0; i < (int) m_sketches.size(); ++i)
+            {
+                PERF_TIMER_TIMEIT_N(&m_update_timers[i], n,
+                    update_sketch(i, m_cur_update_slot););
+            }
+            QueryImpl::select_update_slot(m_cur_update_slot);
+            return ;
+        }
+
+        std::unique_lock<std::mutex> lock(m_update_mutex);
+        m_update_slot_num_updates[m_cur_update_slot] = n;
+        m_update_slot_num_remaining_workers[m_cur_update_slot] =
+            (uint32_t) m_update_workers.size();
+        ++m_num_published_batches;
+        m_update_worker_cv.notify_all();
+
+        m_cur_update_slot = (uint32_t)(m_num_published_batches % m_num_update_slots);
+        m_update_parser_cv.wait(lock, [this] {
+            return m_update_slot_num_remaining_workers[m_cur_update_slot] == 0;
+        });
+        lock.unlock();
+
+        QueryImpl::select_update_slot(m_cur_update_slot);
+    }
+
+    // Applies all pending updates and waits for the update workers to finish.
+    // Must be called before a sketch is queried or inspected on this thread.
+    void
+    flush_updates()
+    {
+        submit_updates();
+        if (m_update_workers.empty()) return ;
+
+        std::unique_lock<std::mutex> lock(m_update_mutex);
+        m_update_parser_cv.wait(lock, [this] {
+            for (uint32_t cnt: m_update_slot_num_remaining_workers)
+            {
+                if (cnt != 0) return false;
+            }
+            return true;
+        });
+    }
+
+    // Each update worker owns a fixed subset of the sketches and applies the
+    // published batches to them in order. A sketch is only updated by its
+    // owner so its update timer is not shared with other threads.
+    void
+    run_update_worker(
+        UpdateWorker *worker)
+    {
+        std::unique_lock<std::mutex> lock(m_update_mutex);
+        for (;;)
+        {
+            m_update_worker_cv.wait(lock, [this, worker] {
+                return m_update_workers_stopped ||
+                    worker->m_num_consumed_batches < m_num_published_batches;
+            });
+            if (worker->m_num_consumed_batches == m_num_published_batches)
+            {
+                break;
+            }
+
+            uint32_t slot = (uint32_t)(
+                worker->m_num_consumed_batches % m_num_update_slots);
+            size_t n = m_update_slot_num_updates[slot];
+            lock.unlock();
+
+            for (int i: worker->m_sketch_indices)
+            {
+                PERF_TIMER_TIMEIT_N(&m_update_timers[i], n,
+                    update_sketch(i, slot););
+            }
+
+            lock.lock();
+            ++worker->m_num_consumed_batches;
+            if (--m_update_slot_num_remaining_workers[slot] == 0)
+            {
+                m_update_parser_cv.notify_one();
+            }
+        }
+    }
+
+    void
+    start_update_workers()
+    {
+        uint32_t num_workers = (uint32_t) std::min(
+            (size_t) m_num_update_threads, m_sketches.size());
+        if (num_workers == 0) return ;
+
+        m_update_slot_num_updates.assign(m_num_update_slots, 0);
+        m_update_slot_num_remaining_workers.assign(m_num_update_slots, 0);
+        m_num_published_batches = 0;
+        m_update_workers_stopped = false;
+
+        // sketches are assigned to the workers in a round-robin fashion
+        m_update_workers.resize(num_workers);
+        for (int i = 0; i < (int) m_sketches.size(); ++i)
+        {
+            m_update_workers[i % num_workers].m_sketch_indices.push_back(i);
+        }
+        for (UpdateWorker &worker: m_update_workers)
+        {
+            worker.m_num_consumed_batches = 0;
+            worker.m_thread = std::thread(
+                &Query<QueryImpl>::run_update_worker, this, &worker);
+        }
+    }
+
+    bool
+    open_infile(
+        size_t idx)
+    {
+        const std::string &infile_name = m_infile_names[idx];
+        m_infile_prev_pos = 0;
+        m_infile_is_binary = is_binary_stream_file(infile_name);
+        if (m_infile_is_binary)
+        {
+            return m_bin_infile.open(infile_name);
+        }
+
+        m_infile.open(infile_name);
+        return m_infile.is_open();
     }
 
+    void
+    close_infile()
+    {
+        if (m_infile_is_binary)
+        {
+            m_bin_infile.close();
+        }
+        else
+        {
+            m_infile.close();
+        }
+    }
+
+public:
 #undef PERF_TIMER_TIMEIT
+#undef PERF_TIMER_TIMEIT_N
 
     int
     print_stats()
@@ -376,6 +670,23 @@ public:
             }
         }
 
+        bool has_extra_stats = false;
+        for (auto &sketch: m_sketches)
+        {
+            std::string extra_stats = sketch->get_extra_stats();
+            if (extra_stats.empty()) continue;
+            if (!has_extra_stats)
+            {
+                m_out << "=============  Sketch stats  =============" << std::endl;
+                has_extra_stats = true;
+            }
+            m_out << '\t'
+                << sketch.get()->get_short_description()
+                << ": "
+                << extra_stats
+                << std::endl;
+        }
+
         if (m_measure_time)
         {
             m_out << "=============  Time stats    =============" << std::endl;
@@ -584,6 +895,23 @@ private:
         print_progress_bar_content();
     }
 
+    void
+    stop_update_workers()
+    {
+        if (m_update_workers.empty()) return ;
+
+        {
+            std::lock_guard<std::mutex> lock(m_update_mutex);
+            m_update_workers_stopped = true;
+        }
+        m_update_worker_cv.notify_all();
+        for (UpdateWorker &worker: m_update_workers)
+        {
+            worker.m_thread.join();
+        }
+        m_update_workers.clear();
+    }
+
     bool                        m_measure_time,
                                 
                                 m_has_outfile,
@@ -596,6 +924,38 @@ private:
 
     std::vector<PerfTimer>      m_query_timers;
 
+#ifdef STATIC_SKETCH_DISPATCH
+    typedef typename std::conditional<
+        std::is_base_of<IPersistentSketch_u32, ISketch>::value,
+        StaticUpdater_u32,
+        StaticUpdater_dvec>::type StaticUpdater;
+
+    // one for each sketch in m_sketches
+    std::vector<StaticUpdater>  m_static_updaters;
+#endif
+
+    // update pipeline
+    uint32_t                    m_num_update_threads;
+
+    uint32_t                    m_cur_update_slot; // the slot being parsed into
+
+    std::vector<UpdateWorker>   m_update_workers;
+
+    std::mutex                  m_update_mutex;
+
+    std::condition_variable     m_update_worker_cv; // new batch or stopping
+
+    std::condition_variable     m_update_parser_cv; // a slot is released
+
+    uint64_t                    m_num_published_batches;
+
+    bool                        m_update_workers_stopped;
+
+    // the following are indexed by the slot and protected by m_update_mutex
+    std::vector<size_t>         m_update_slot_num_updates;
+
+    std::vector<uint32_t>       m_update_slot_num_remaining_workers;
+
     std::vector<std::string>    m_infile_names;
 
     size_t                      m_next_infile_idx;
@@ -604,6 +964,10 @@ private:
 
     std::ifstream               m_infile;
 
+    BinaryStreamReader          m_bin_infile;
+
+    bool                        m_infile_is_binary;
+
     std::vector<ResourceGuard<std::ostream>>
                                 m_outfiles;
 
@@ -680,6 +1044,8 @@ class QueryHeavyHitterImpl:
 protected:
     using QueryBase<IHHSketch>::m_out;
     using QueryBase<IHHSketch>::m_sketches;
+    using QueryBase<IHHSketch>::m_update_batch_size;
+    using QueryBase<IHHSketch>::m_num_update_slots;
 
     const char *
     get_name() const
@@ -723,6 +1089,12 @@ protected:
             m_exact_enabled = false;
         }
 
+        m_update_slots.resize(m_num_update_slots);
+        for (auto &updates: m_update_slots)
+        {
+            updates.reserve(m_update_batch_size);
+        }
+        m_pending_updates = &m_update_slots[0];
         return 0;
     }
 
@@ -837,34 +1209,59 @@ protected:
         TIMESTAMP ts,
         const char *str)
     {
-        if (m_input_is_ip)
+        uint32_t key;
+        int cnt;
+        if (parse_key_and_count(m_input_is_ip, str, key, cnt))
         {
-            while (std::isspace(*str)) ++str;
-            char ip_str[17];
-            strncpy(ip_str, str, 16);
-            ip_str[16] = '\0';
-        
-            struct in_addr ip;
-            if (!inet_aton(ip_str, &ip))
-            {
-                return 1;
-            }
-            m_update_value = (uint32_t) ip.s_addr;
+            return 1;
         }
-        else
+        m_pending_updates->push_back({ts, key, cnt});
+
+        return 0;
+    }
+
+    int
+    parse_binary_update_arg(
+        const BinaryStreamRecord *rec)
+    {
+        if (rec->m_type != BSRT_KEY && rec->m_type != BSRT_KEY_CNT)
         {
-            m_update_value = (uint32_t) strtoul(str, nullptr, 0);
+            return 1;
         }
 
+        m_pending_updates->push_back({rec->m_ts, rec->key(), rec->count()});
         return 0;
     }
 
+    size_t
+    num_pending_updates() const
+    {
+        return m_pending_updates->size();
+    }
+
+    bool
+    pending_updates_full() const
+    {
+        return m_pending_updates->size() >= m_update_batch_size;
+    }
+
+    // sketch is either an ISketch or a StaticUpdater
+    template<class SketchT>
     void
-    update(
-        IHHSketch *sketch,
-        TIMESTAMP ts)
+    update_batch(
+        SketchT *sketch,
+        uint32_t slot) const
     {
-        sketch->update(ts, m_update_value);
+        const std::vector<UpdateRecord_u32> &updates = m_update_slots[slot];
+        sketch->update_batch(updates.data(), updates.size());
+    }
+
+    void
+    select_update_slot(
+        uint32_t slot)
+    {
+        m_pending_updates = &m_update_slots[slot];
+        m_pending_updates->clear();
     }
 
 private:
@@ -872,7 +1269,11 @@ private:
 
     bool                        m_exact_enabled;
 
-    uint32_t                    m_update_value;
+    std::vector<std::vector<UpdateRecord_u32>>
+                                m_update_slots;
+
+    std::vector<UpdateRecord_u32>
+                                *m_pending_updates; // the selected slot
 
     double                      m_query_fraction;
 
@@ -931,10 +1332,41 @@ protected:
         TIMESTAMP ts,
         const char *str);
 
+    int
+    parse_binary_update_arg(
+        const BinaryStreamRecord *rec);
+
+    size_t
+    num_pending_updates() const
+    {
+        return m_pending_updates->size();
+    }
+
+    bool
+    pending_updates_full() const
+    {
+        return m_pending_updates->size() >= m_dvec_capacity;
+    }
+
+    // sketch is either an ISketch or a StaticUpdater
+    template<class SketchT>
     void
-    update(
-        IPersistentMatrixSketch *sketch,
-        TIMESTAMP ts);
+    update_batch(
+        SketchT *sketch,
+        uint32_t slot) const
+    {
+        const std::vector<UpdateRecord_dvec> &updates = m_update_slots[slot];
+        sketch->update_batch(updates.data(), updates.size());
+    }
+
+    void
+    select_update_slot(
+        uint32_t slot)
+    {
+        m_pending_updates = &m_update_slots[slot];
+        m_pending_updates->clear();
+        m_pending_dvec = m_dvec + (size_t) slot * m_dvec_capacity * m_n;
+    }
 
     void
     finish();
@@ -961,6 +1393,11 @@ private:
         IPersistentMatrixSketch *sketch,
         double err) const;
 
+    void
+    add_to_exact_fnorm_sqr(
+        TIMESTAMP ts,
+        const double *dvec);
+
     double
     get_exact_fnorm_sqr(
         TIMESTAMP ts) const;
@@ -986,7 +1423,19 @@ private:
 
     int                         m_n;
 
-    double                      *m_dvec; // next input vec
+    double                      *m_dvec; // input vecs parsed from text lines,
+                                         // m_dvec_capacity by m_n per slot
+
+    double                      *m_pending_dvec; // m_dvec of the selected slot
+
+    uint32_t                    m_dvec_capacity;
+
+    // the dvecs point to either m_dvec or the mapped binary stream file
+    std::vector<std::vector<UpdateRecord_dvec>>
+                                m_update_slots;
+
+    std::vector<UpdateRecord_dvec>
+                                *m_pending_updates; // the selected slot
 
     double                      *m_last_answer; // upper triangle matrix
 
@@ -1054,6 +1503,9 @@ QueryMatrixSketchImpl::QueryMatrixSketchImpl():
     m_use_analytic_error(false),
     m_n(0),
     m_dvec(nullptr),
+    m_pending_dvec(nullptr),
+    m_dvec_capacity(0),
+    m_pending_updates(nullptr),
     m_last_answer(nullptr),
     m_exact_covariance_matrix(nullptr),
     m_work(nullptr),
@@ -1129,29 +1581,40 @@ QueryMatrixSketchImpl::early_setup()
     {
         // infer m_n from the input
         std::string infile = g_config->get("infile").value();
-        std::ifstream fin(infile);
-        if (!fin) return 1;
-
-        std::string line;
-        m_n = 0;
-        while (std::getline(fin, line))
+        if (is_binary_stream_file(infile))
+        {
+            BinaryStreamReader reader;
+            if (!reader.open(infile)) return 1;
+            
+            const BinaryStreamRecord *rec = reader.find_first_dvec();
+            m_n = rec ? (int) rec->dim() : 0;
+        }
+        else
         {
-            if (line.empty()) continue;
-            if (line[0] == '?' || line[0] == '#') continue;
+            std::ifstream fin(infile);
+            if (!fin) return 1;
 
+            std::string line;
             m_n = 0;
-            const char *s = line.c_str();
-            while (*s && !std::isspace(*s)) ++s;
-            for (;*s;)
+            while (std::getline(fin, line))
             {
-                while (std::isspace(*s)) ++s;
-                if (*s)
+                if (line.empty()) continue;
+                if (line[0] == '?' || line[0] == '#') continue;
+
+                m_n = 0;
+                const char *s = line.c_str();
+                while (*s && !std::isspace(*s)) ++s;
+                for (;*s;)
                 {
-                    ++m_n;
-                    while (*s && !std::isspace(*s)) ++s;
+                    while (std::isspace(*s)) ++s;
+                    if (*s)
+                    {
+                        ++m_n;
+                        while (*s && !std::isspace(*s)) ++s;
+                    }
                 }
+                break;
             }
-            break;
         }
 
         if (m_n == 0)
@@ -1163,7 +1626,16 @@ QueryMatrixSketchImpl::early_setup()
         g_config->set_u32("MS.dimension", m_n);
     }
     
-    m_dvec = new double[m_n];
+    // limit the input buffer to about 4MB for high-dimensional inputs
+    m_dvec_capacity = std::max(1u, std::min(m_update_batch_size,
+        (uint32_t)((4u << 20) / (sizeof(double) * m_n))));
+    m_dvec = new double[(size_t) m_num_update_slots * m_dvec_capacity * m_n];
+    m_update_slots.resize(m_num_update_slots);
+    for (auto &updates: m_update_slots)
+    {
+        updates.reserve(m_dvec_capacity);
+    }
+    select_update_slot(0);
     m_last_answer = new double[matrix_size()];
 
     return 0;
@@ -1801,33 +2273,52 @@ QueryMatrixSketchImpl::parse_update_arg(
     TIMESTAMP ts,
     const char *str)
 {
-    if (ts != m_exact_fnorm_sqr_vec.back().first)
-    {
-        m_exact_fnorm_sqr_vec.emplace_back(
-            ts,
-            m_exact_fnorm_sqr_vec.back().second);
-    }
-
+    double *dvec = m_pending_dvec + m_pending_updates->size() * m_n;
     const char *s = str;
     for (int i = 0; i < m_n; ++i)
     {
         char *s2;
-        m_dvec[i] = strtod(s, &s2);
-        if (s2 == s || (m_dvec[i] == HUGE_VAL)) return 1;
+        dvec[i] = strtod(s, &s2);
+        if (s2 == s || (dvec[i] == HUGE_VAL)) return 1;
         s = s2;
-
-        m_exact_fnorm_sqr_vec.back().second += m_dvec[i] * m_dvec[i];
     }
     
+    add_to_exact_fnorm_sqr(ts, dvec);
+    m_pending_updates->push_back({ts, dvec});
+    return 0;
+}
+
+int
+QueryMatrixSketchImpl::parse_binary_update_arg(
+    const BinaryStreamRecord *rec)
+{
+    if (rec->m_type != BSRT_DVEC || (int) rec->dim() != m_n)
+    {
+        return 1;
+    }
+
+    // the sketches read the vector directly out of the mapped file
+    add_to_exact_fnorm_sqr(rec->m_ts, rec->dvec());
+    m_pending_updates->push_back({rec->m_ts, rec->dvec()});
     return 0;
 }
 
 void
-QueryMatrixSketchImpl::update(
-    IPersistentMatrixSketch *sketch,
-    TIMESTAMP ts)
+QueryMatrixSketchImpl::add_to_exact_fnorm_sqr(
+    TIMESTAMP ts,
+    const double *dvec)
 {
-    sketch->update(ts, m_dvec);
+    if (ts != m_exact_fnorm_sqr_vec.back().first)
+    {
+        m_exact_fnorm_sqr_vec.emplace_back(
+            ts,
+            m_exact_fnorm_sqr_vec.back().second);
+    }
+
+    for (int i = 0; i < m_n; ++i)
+    {
+        m_exact_fnorm_sqr_vec.back().second += dvec[i] * dvec[i];
+    }
 }
 
 void
@@ -1867,26 +2358,30 @@ struct FESketchQueryHelper {};
 template<>
 struct FESketchQueryHelper<IPersistentFrequencyEstimationSketch>
 {
-    static uint64_t
-    estimate(
+    static void
+    estimate_batch(
         IPersistentFrequencyEstimationSketch *sketch,
         TIMESTAMP ts_e,
-        uint32_t key)
+        const uint32_t *keys,
+        size_t n,
+        uint64_t *cnts)
     {
-        return sketch->estimate_frequency(ts_e, key);
+        sketch->estimate_frequency_batch(ts_e, keys, n, cnts);
     }
 };
 
 template<>
 struct FESketchQueryHelper<IPersistentFrequencyEstimationSketchBITP>
 {
-    static uint64_t
-    estimate(
+    static void
+    estimate_batch(
         IPersistentFrequencyEstimationSketchBITP *sketch,
         TIMESTAMP ts_s,
-        uint32_t key)
+        const uint32_t *keys,
+        size_t n,
+        uint64_t *cnts)
     {
-        return sketch->estimate_frequency_bitp(ts_s, key);
+        sketch->estimate_frequency_bitp_batch(ts_s, keys, n, cnts);
     }
 };
 
@@ -1897,6 +2392,8 @@ class QueryFrequencyEstimationImpl:
 protected:
     using QueryBase<ISketch>::m_out;
     using QueryBase<ISketch>::m_sketches;
+    using QueryBase<ISketch>::m_update_batch_size;
+    using QueryBase<ISketch>::m_num_update_slots;
 
     const char *
     get_name() const
@@ -1940,6 +2437,12 @@ protected:
             m_exact_enabled = false;
         }
 
+        m_update_slots.resize(m_num_update_slots);
+        for (auto &updates: m_update_slots)
+        {
+            updates.reserve(m_update_batch_size);
+        }
+        m_pending_updates = &m_update_slots[0];
         return 0;
     }
 
@@ -1983,14 +2486,10 @@ protected:
         ISketch *sketch,
         TIMESTAMP ts)
     {
-        m_last_answer.clear();
-        m_last_answer.reserve(m_query_keys.size());
-        for (uint64_t key: m_query_keys)
-        {
-            uint64_t cnt = FESketchQueryHelper<ISketch>::estimate(
-                    sketch, ts, key);
-            m_last_answer.push_back(cnt);
-        }
+        m_last_answer.resize(m_query_keys.size());
+        FESketchQueryHelper<ISketch>::estimate_batch(
+            sketch, ts, m_query_keys.data(), m_query_keys.size(),
+            m_last_answer.data());
     }
 
     void
@@ -2080,34 +2579,59 @@ protected:
         TIMESTAMP ts,
         const char *str)
     {
-        if (m_input_is_ip)
+        uint32_t key;
+        int cnt;
+        if (parse_key_and_count(m_input_is_ip, str, key, cnt))
         {
-            while (std::isspace(*str)) ++str;
-            char ip_str[17];
-            strncpy(ip_str, str, 16);
-            ip_str[16] = '\0';
-        
-            struct in_addr ip;
-            if (!inet_aton(ip_str, &ip))
-            {
-                return 1;
-            }
-            m_update_value = (uint32_t) ip.s_addr;
+            return 1;
         }
-        else
+        m_pending_updates->push_back({ts, key, cnt});
+
+        return 0;
+    }
+
+    int
+    parse_binary_update_arg(
+        const BinaryStreamRecord *rec)
+    {
+        if (rec->m_type != BSRT_KEY && rec->m_type != BSRT_KEY_CNT)
         {
-            m_update_value = (uint32_t) strtoul(str, nullptr, 0);
+            return 1;
         }
 
+        m_pending_updates->push_back({rec->m_ts, rec->key(), rec->count()});
         return 0;
     }
 
+    size_t
+    num_pending_updates() const
+    {
+        return m_pending_updates->size();
+    }
+
+    bool
+    pending_updates_full() const
+    {
+        return m_pending_updates->size() >= m_update_batch_size;
+    }
+
+    // sketch is either an ISketch or a StaticUpdater
+    template<class SketchT>
     void
-    update(
-        ISketch *sketch,
-        TIMESTAMP ts)
+    update_batch(
+        SketchT *sketch,
+        uint32_t slot) const
     {
-        sketch->update(ts, m_update_value);
+        const std::vector<UpdateRecord_u32> &updates = m_update_slots[slot];
+        sketch->update_batch(updates.data(), updates.size());
+    }
+
+    void
+    select_update_slot(
+        uint32_t slot)
+    {
+        m_pending_updates = &m_update_slots[slot];
+        m_pending_updates->clear();
     }
 
 private:
@@ -2115,7 +2639,11 @@ private:
 
     bool                        m_exact_enabled;
 
-    uint32_t                    m_update_value;
+    std::vector<std::vector<UpdateRecord_u32>>
+                                m_update_slots;
+
+    std::vector<UpdateRecord_u32>
+                                *m_pending_updates; // the selected slot
 
     std::vector<uint32_t>       m_query_keys;
 
@@ -0,0 +1,234 @@
+#include "row_store.h"
+extern "C"
+{
+#include <cblas.h>
+}
+#include <cstring>
+#include <cassert>
+#include <cmath>
+
+using namespace std;
+
+bool parse_row_storage_type(const string &str, RowStorageType &type) {
+    if (str == "double") {
+        type = ROW_STORAGE_DOUBLE;
+    } else if (str == "float") {
+        type = ROW_STORAGE_FLOAT;
+    } else if (str == "bfloat16") {
+        type = ROW_STORAGE_BFLOAT16;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static size_t entry_size(RowStorageType type) {
+    switch (type) {
+    case ROW_STORAGE_FLOAT:
+        return sizeof(float);
+    case ROW_STORAGE_BFLOAT16:
+        return sizeof(uint16_t);
+    default:
+        return sizeof(double);
+    }
+}
+
+// round to nearest even, NaNs stay NaNs
+static uint16_t float_to_bfloat16(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    if ((bits & 0x7fffffffu) > 0x7f800000u) {
+        return (uint16_t) ((bits >> 16) | 0x40u);
+    }
+    bits += 0x7fffu + ((bits >> 16) & 1u);
+    return (uint16_t) (bits >> 16);
+}
+
+static float bfloat16_to_float(uint16_t h) {
+    uint32_t bits = (uint32_t) h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+RowStore::RowStore(int n, RowStorageType type) :
+    m_n(n),
+    m_type(type),
+    m_row_bytes(entry_size(type) * (size_t) n),
+    m_max_chunk_shift(0),
+    m_chunks(),
+    m_size(0) {
+
+    while (m_max_chunk_shift < 31 &&
+        (m_row_bytes << (m_max_chunk_shift + 1)) <= max_chunk_bytes) {
+        ++m_max_chunk_shift;
+    }
+}
+
+RowStore::~RowStore() {
+    clear();
+}
+
+void RowStore::clear() {
+    for (char *chunk: m_chunks) {
+        delete []chunk;
+    }
+    m_chunks.clear();
+    m_size = 0;
+}
+
+void RowStore::locate(uint32_t id, size_t &chunk, size_t &off) const {
+    uint64_t num_growing_rows = ((uint64_t) 4 << m_max_chunk_shift) - 2;
+    if (id < num_growing_rows) {
+        // chunks 2p and 2p + 1 start at rows 2^(p + 1) - 2 and
+        // 3 * 2^p - 2
+        uint64_t x = (uint64_t) id + 2;
+        unsigned p = 0;
+        while ((x >> (p + 2)) != 0) ++p;
+        uint64_t r = x - ((uint64_t) 2 << p);
+        chunk = 2 * p + (size_t) (r >> p);
+        off = (size_t) (r & (((uint64_t) 1 << p) - 1));
+    } else {
+        uint64_t j = id - num_growing_rows;
+        chunk = 2 * (m_max_chunk_shift + 1) +
+            (size_t) (j >> m_max_chunk_shift);
+        off = (size_t) (j & (((uint64_t) 1 << m_max_chunk_shift) - 1));
+    }
+}
+
+uint32_t RowStore::append(const double *dvec) {
+    assert(m_size != invalid_id);
+    uint32_t id = m_size++;
+    size_t chunk, off;
+    locate(id, chunk, off);
+    if (chunk == m_chunks.size()) {
+        m_chunks.push_back(new char[chunk_num_rows(chunk) * m_row_bytes]);
+    }
+
+    char *row = m_chunks[chunk] + off * m_row_bytes;
+    switch (m_type) {
+    case ROW_STORAGE_FLOAT:
+        {
+            float *p = (float *) row;
+            for (int i = 0; i < m_n; ++i) {
+                p[i] = (float) dvec[i];
+            }
+        }
+        break;
+    case ROW_STORAGE_BFLOAT16:
+        {
+            uint16_t *p = (uint16_t *) row;
+            for (int i = 0; i < m_n; ++i) {
+                p[i] = float_to_bfloat16((float) dvec[i]);
+            }
+        }
+        break;
+    default:
+        memcpy(row, dvec, m_row_bytes);
+    }
+    return id;
+}
+
+const double *RowStore::get(uint32_t id, double *buf) const {
+    assert(id < m_size);
+    size_t chunk, off;
+    locate(id, chunk, off);
+    const char *row = m_chunks[chunk] + off * m_row_bytes;
+    switch (m_type) {
+    case ROW_STORAGE_FLOAT:
+        {
+            const float *p = (const float *) row;
+            for (int i = 0; i < m_n; ++i) {
+                buf[i] = p[i];
+            }
+        }
+        return buf;
+    case ROW_STORAGE_BFLOAT16:
+        {
+            const uint16_t *p = (const uint16_t *) row;
+            for (int i = 0; i < m_n; ++i) {
+                buf[i] = bfloat16_to_float(p[i]);
+            }
+        }
+        return buf;
+    default:
+        return (const double *) row;
+    }
+}
+
+unsigned long long RowStore::memory_usage() const {
+    unsigned long long res = m_chunks.capacity() * sizeof(char*);
+    for (size_t k = 0; k < m_chunks.size(); ++k) {
+        res += chunk_num_rows(k) * m_row_bytes;
+    }
+    return res;
+}
+
+PackedGramAccumulator::PackedGramAccumulator(int n, double *A) :
+    m_n(n),
+    m_A(A),
+    m_block(),
+    m_num_rows(0),
+    m_tile() {
+}
+
+PackedGramAccumulator::~PackedGramAccumulator() {
+    assert(m_num_rows == 0);
+}
+
+void PackedGramAccumulator::add(const double *dvec, double alpha) {
+    assert(alpha >= 0);
+    if (m_block.empty()) {
+        m_block.resize((size_t) m_n * block_rows);
+    }
+
+    double *x = m_block.data() + (size_t) m_n * m_num_rows;
+    if (alpha == 1.0) {
+        memcpy(x, dvec, sizeof(double) * m_n);
+    } else {
+        double s = std::sqrt(alpha);
+        for (int i = 0; i < m_n; ++i) {
+            x[i] = dvec[i] * s;
+        }
+    }
+
+    if (++m_num_rows == block_rows) {
+        flush();
+    }
+}
+
+void PackedGramAccumulator::flush() {
+    if (m_num_rows == 0) return ;
+    if (m_tile.empty()) {
+        m_tile.resize((size_t) m_n * std::min(tile_width, m_n));
+    }
+
+    const double *X = m_block.data();
+    double *T = m_tile.data();
+    for (int j0 = 0; j0 < m_n; j0 += tile_width) {
+        int w = std::min(tile_width, m_n - j0);
+        int j1 = j0 + w;
+
+        // rows [0, j1) of columns [j0, j1) of X * X^T in T with ld j1
+        if (j0 > 0) {
+            cblas_dgemm(CblasColMajor, CblasNoTrans, CblasTrans,
+                j0, w, m_num_rows,
+                1.0, X, m_n, X + j0, m_n,
+                0.0, T, j1);
+        }
+        cblas_dsyrk(CblasColMajor, CblasUpper, CblasNoTrans,
+            w, m_num_rows,
+            1.0, X + j0, m_n,
+            0.0, T + j0, j1);
+
+        for (int c = 0; c < w; ++c) {
+            size_t j = (size_t) (j0 + c);
+            double *col = m_A + j * (j + 1) / 2;
+            const double *t = T + (size_t) c * j1;
+            for (size_t i = 0; i <= j; ++i) {
+                col[i] += t[i];
+            }
+        }
+    }
+    m_num_rows = 0;
+}
@@ -0,0 +1,123 @@
+#ifndef ROW_STORE_H
+#define ROW_STORE_H
+
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <algorithm>
+
+enum RowStorageType {
+    ROW_STORAGE_DOUBLE,     // exact (default)
+    ROW_STORAGE_FLOAT,      // float32
+    ROW_STORAGE_BFLOAT16    // bfloat16, i.e., float32 with a 7-bit mantissa
+};
+
+// Parses "double", "float" or "bfloat16". Returns false on invalid strings.
+bool parse_row_storage_type(const std::string &str, RowStorageType &type);
+
+// An append-only store of the sampled rows of a matrix sketch, which is
+// shared by all of its reservoir lists. A row is referred to by its id,
+// i.e., the number of rows appended before it, so a row taken by several
+// lists is stored only once. Rows are never removed except by clear(), so
+// no ownership or reference counts are tracked.
+//
+// Rows are copied into chunks of consecutive rows. Chunks 2k and 2k + 1
+// hold 2^k rows until a chunk reaches max_chunk_bytes, after which all
+// chunks have the size of the last one. So appending a row rarely allocates
+// and at most about a third of the store is unused.
+//
+// With float32 or bfloat16 storage, the entries are rounded to nearest on
+// append() and converted back to double by get().
+class RowStore {
+    public:
+        static constexpr uint32_t invalid_id = ~(uint32_t) 0;
+
+        RowStore(int n, RowStorageType type = ROW_STORAGE_DOUBLE);
+
+        ~RowStore();
+
+        RowStore(const RowStore&) = delete;
+        RowStore& operator=(const RowStore&) = delete;
+
+        // Frees all the rows.
+        void clear();
+
+        // Copies dvec of n entries and returns its id.
+        uint32_t append(const double *dvec);
+
+        // Returns the row with id. It points into the store if the rows are
+        // stored in double, or to buf (of n doubles) with the converted row
+        // otherwise.
+        const double *get(uint32_t id, double *buf) const;
+
+        uint32_t size() const { return m_size; }
+
+        RowStorageType storage_type() const { return m_type; }
+
+        unsigned long long memory_usage() const;
+
+    private:
+        static constexpr size_t max_chunk_bytes = 1 << 20;
+
+        int                     m_n;
+
+        RowStorageType          m_type;
+
+        size_t                  m_row_bytes;
+
+        // chunk k holds 2^min(k / 2, m_max_chunk_shift) rows
+        unsigned                m_max_chunk_shift;
+
+        std::vector<char*>      m_chunks;
+
+        uint32_t                m_size;
+
+        void locate(uint32_t id, size_t &chunk, size_t &off) const;
+
+        size_t chunk_num_rows(size_t chunk) const {
+            return (size_t) 1 <<
+                std::min<size_t>(chunk / 2, m_max_chunk_shift);
+        }
+};
+
+// Accumulates alpha * x * x^T of rows x into a packed upper triangular
+// matrix in column major (as cblas_dspr does), at level 3 BLAS speed. The
+// scaled rows are gathered into a block of up to block_rows rows, which is
+// added to the matrix tile by tile with a dsyrk on the diagonal tiles and a
+// dgemm on the tiles above them. So the packed matrix is read and written
+// once per block rather than once per row.
+class PackedGramAccumulator {
+    public:
+        // A is the packed matrix of order n, which is added to.
+        PackedGramAccumulator(int n, double *A);
+
+        ~PackedGramAccumulator();
+
+        PackedGramAccumulator(const PackedGramAccumulator&) = delete;
+        PackedGramAccumulator& operator=(const PackedGramAccumulator&) = delete;
+
+        // Requires alpha >= 0.
+        void add(const double *dvec, double alpha);
+
+        // Adds the pending rows to A. Must be called before A is read.
+        void flush();
+
+    private:
+        static constexpr int block_rows = 256;
+
+        static constexpr int tile_width = 128;
+
+        int                     m_n;
+
+        double                  *m_A;
+
+        // the gathered rows, one per column of an n x block_rows matrix
+        std::vector<double>     m_block;
+
+        int                     m_num_rows;
+
+        // n x tile_width
+        std::vector<double>     m_tile;
+};
+
+#endif // ROW_STORE_H
@@ -4,6 +4,8 @@
 #include <algorithm>
 #include <cstdlib>
 #include <unordered_map>
+#include <cmath>
+#include <limits>
 #include "util.h"
 #include "conf.h"
 #include <sstream>
@@ -202,12 +204,16 @@ using namespace SamplingSketchInternals;
 SamplingSketch::SamplingSketch(
     unsigned sample_size,
     unsigned seed,
-    bool enable_frequency_estimation):
+    bool enable_frequency_estimation,
+    bool use_skip_counting):
     m_enable_frequency_estimation(enable_frequency_estimation),
     m_sample_size(sample_size),
     m_seen(0ull),
     m_reservoir(new List[sample_size]),
     m_rng(seed),
+    m_use_skip_counting(use_skip_counting),
+    m_skip(0ull),
+    m_w(1.0),
     m_last_ts(0),
     m_tmp_cnt_ts(0),
     m_tmp_cnt_map(),
@@ -220,25 +226,104 @@ SamplingSketch::~SamplingSketch()
     delete[] m_reservoir;
 }
 
+template<class T>
 void
-SamplingSketch::update(unsigned long long ts, const char *str, int c)
+SamplingSketch::update_reservoir(
+    TIMESTAMP ts,
+    T value,
+    int c)
 {
-update_loop:
-    if (m_seen < m_sample_size)
+    if (m_use_skip_counting)
     {
-        m_reservoir[m_seen++].append(ts, str);
+        update_reservoir_skip_counting(ts, value, c);
+        return ;
     }
-    else
+
+    // uniform_int_distribution is stateless, so reusing one with a new range
+    // for each draw yields the same samples as constructing a new one.
+    typedef std::uniform_int_distribution<unsigned long long> unif_t;
+    unif_t unif;
+    for (; c > 0; --c)
     {
-        std::uniform_int_distribution<unsigned long long> unif(0, m_seen++);
-        auto i = unif(m_rng);
-        if (i < m_sample_size)
+        if (m_seen < m_sample_size)
+        {
+            m_reservoir[m_seen++].append(ts, value);
+        }
+        else
         {
-            m_reservoir[i].append(ts, str);
+            auto i = unif(m_rng, unif_t::param_type(0, m_seen++));
+            if (i < m_sample_size)
+            {
+                m_reservoir[i].append(ts, value);
+            }
         }
     }
+}
 
-    if (--c) goto update_loop;
+template<class T>
+void
+SamplingSketch::update_reservoir_skip_counting(
+    TIMESTAMP ts,
+    T value,
+    int c)
+{
+    if (c <= 0) return ;
+    unsigned long long n = (unsigned long long) c;
+
+    while (m_seen < m_sample_size)
+    {
+        m_reservoir[m_seen++].append(ts, value);
+        if (m_seen == m_sample_size)
+        {
+            m_w = 1.0;
+            draw_next_skip();
+        }
+        if (!--n) return ;
+    }
+
+    // The (m_skip + 1)-th record from now replaces a random sample.
+    while (n > m_skip)
+    {
+        n -= m_skip + 1;
+        m_seen += m_skip + 1;
+        std::uniform_int_distribution<unsigned> unif(0, m_sample_size - 1);
+        m_reservoir[unif(m_rng)].append(ts, value);
+        draw_next_skip();
+    }
+    m_skip -= n;
+    m_seen += n;
+}
+
+double
+SamplingSketch::next_uniform_0_1()
+{
+    // in (0, 1] so that its log is finite
+    return 1.0 - std::generate_canonical<double,
+        std::numeric_limits<double>::digits>(m_rng);
+}
+
+void
+SamplingSketch::draw_next_skip()
+{
+    m_w *= std::exp(std::log(next_uniform_0_1()) / m_sample_size);
+    double skip = std::floor(std::log(next_uniform_0_1()) / std::log1p(-m_w));
+
+    // m_w may underflow to 0 on extremely long streams, which makes skip
+    // inf or nan
+    if (skip < (double) std::numeric_limits<unsigned long long>::max())
+    {
+        m_skip = (unsigned long long) skip;
+    }
+    else
+    {
+        m_skip = std::numeric_limits<unsigned long long>::max();
+    }
+}
+
+void
+SamplingSketch::update(unsigned long long ts, const char *str, int c)
+{
+    update_reservoir(ts, str, c);
 }
 
 void
@@ -259,22 +344,36 @@ SamplingSketch::update(TIMESTAMP ts, uint32_t value, int c)
         }
     }
 
-update_loop:
-    if (m_seen < m_sample_size)
+    update_reservoir(ts, value, c);
+}
+
+void
+SamplingSketch::update_batch(
+    const UpdateRecord_u32 *records,
+    size_t n)
+{
+    if (n == 0) return ;
+
+    if (m_enable_frequency_estimation && m_tmp_cnt_ts != 0 &&
+        records[0].m_ts <= m_tmp_cnt_ts &&
+        m_tmp_cnt_ts <= records[n - 1].m_ts)
     {
-        m_reservoir[m_seen++].append(ts, value);
+        m_tmp_cnt_ts = 0;
+        m_tmp_cnt_map.clear();
     }
-    else
+
+    for (size_t k = 0; k < n; ++k)
     {
-        std::uniform_int_distribution<unsigned long long> unif(0, m_seen++);
-        auto i = unif(m_rng);
-        if (i < m_sample_size)
+        TIMESTAMP ts = records[k].m_ts;
+        uint32_t value = records[k].m_value;
+        if (m_enable_frequency_estimation && ts != m_last_ts)
         {
-            m_reservoir[i].append(ts, value);
+            m_ts2cnt_map.emplace_back(std::make_pair(m_last_ts, m_seen));
+            m_last_ts = ts;
         }
-    }
 
-    if (--c) goto update_loop;
+        update_reservoir(ts, value, records[k].m_c);
+    }
 }
 
 void
@@ -285,6 +384,8 @@ SamplingSketch::clear()
         m_reservoir[i].reset();
     }
     m_seen = 0;
+    m_skip = 0;
+    m_w = 1.0;
 
     if (m_enable_frequency_estimation)
     {
@@ -299,6 +400,10 @@ size_t
 SamplingSketch::memory_usage() const
 {
     size_t sum = 24 + sizeof(m_rng);
+    if (m_use_skip_counting)
+    {
+        sum += sizeof(m_skip) + sizeof(m_w);
+    }
     for (unsigned i = 0; i < m_sample_size; ++i)
     {
         sum += m_reservoir[i].memory_usage();
@@ -481,14 +586,17 @@ SamplingSketch::create_from_config(
 {
     uint32_t sample_size, seed;
     bool in_frequency_estimation_test;
+    bool use_skip_counting;
 
     sample_size = g_config->get_u32("SAMPLING.sample_size", idx).value();
     seed = g_config->get_u32("SAMPLING.seed", -1).value();
+    use_skip_counting = g_config->get_boolean("SAMPLING.skip_counting").value();
 
     in_frequency_estimation_test = 
         (g_config->get("test_name").value() == "frequency_estimation");
 
-    return new SamplingSketch(sample_size, seed, in_frequency_estimation_test);
+    return new SamplingSketch(sample_size, seed, in_frequency_estimation_test,
+        use_skip_counting);
 }
 
 int
@@ -23,7 +23,8 @@ public:
     SamplingSketch(
         unsigned sample_size,
         unsigned seed = 19950810u,
-        bool enable_frequency_estimation = false);
+        bool enable_frequency_estimation = false,
+        bool use_skip_counting = false);
 
     virtual ~SamplingSketch();
 
@@ -39,6 +40,11 @@ public:
         uint32_t value,
         int c = 1) override;
 
+    void
+    update_batch(
+        const UpdateRecord_u32 *records,
+        size_t n) override;
+
     void
     clear() override;
 
@@ -64,6 +70,26 @@ public:
         uint32_t key) const override;
 
 private:
+    template<class T>
+    void
+    update_reservoir(
+        TIMESTAMP ts,
+        T value,
+        int c);
+
+    template<class T>
+    void
+    update_reservoir_skip_counting(
+        TIMESTAMP ts,
+        T value,
+        int c);
+
+    double
+    next_uniform_0_1();
+
+    void
+    draw_next_skip();
+
     bool                m_enable_frequency_estimation;
 
     unsigned            m_sample_size;
@@ -75,6 +101,16 @@ private:
 
     std::mt19937        m_rng;
 
+    // Skip counting (Li's Algorithm L): once the reservoir is full, the
+    // number of records to skip before the next replacement is drawn
+    // directly, so a skipped record only decrements m_skip. m_w is the
+    // largest of the sample_size smallest random keys of the records so far.
+    bool                m_use_skip_counting;
+
+    unsigned long long  m_skip;
+
+    double              m_w;
+
     TIMESTAMP           m_last_ts;
 
     mutable TIMESTAMP   m_tmp_cnt_ts;
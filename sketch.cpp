@@ -14,6 +14,7 @@
 #include <cassert>
 #include <utility>
 #include <memory>
+#include <type_traits>
 
 char help_str_buffer[help_str_bufsize];
 
@@ -233,3 +234,117 @@ create_persistent_sketch_from_config(
     return ret;
 }
 
+
+#ifdef STATIC_SKETCH_DISPATCH
+namespace {
+
+template<class UpdateRecord>
+struct UpdateRecordTraits {};
+
+template<>
+struct UpdateRecordTraits<UpdateRecord_u32>
+{
+    typedef IPersistentSketch_u32 sketch_interface;
+};
+
+template<>
+struct UpdateRecordTraits<UpdateRecord_dvec>
+{
+    typedef IPersistentSketch_dvec sketch_interface;
+};
+
+template<class SketchT>
+inline void
+static_update(
+    SketchT *sketch,
+    const UpdateRecord_u32 &record)
+{
+    sketch->SketchT::update(record.m_ts, record.m_value, record.m_c);
+}
+
+template<class SketchT>
+inline void
+static_update(
+    SketchT *sketch,
+    const UpdateRecord_dvec &record)
+{
+    sketch->SketchT::update(record.m_ts, record.m_dvec);
+}
+
+template<class SketchT, class UpdateRecord>
+void
+static_update_batch(
+    void *sketch,
+    const UpdateRecord *records,
+    size_t n)
+{
+    SketchT *s = static_cast<SketchT*>(sketch);
+
+    // &SketchT::update_batch is a member of the interface unless SketchT
+    // (or one of its concrete bases) provides a native batch update
+    if constexpr (std::is_same<
+            decltype(&SketchT::update_batch),
+            void (UpdateRecordTraits<UpdateRecord>::sketch_interface::*)(
+                const UpdateRecord*, size_t)>::value)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            static_update(s, records[i]);
+        }
+    }
+    else
+    {
+        s->SketchT::update_batch(records, n);
+    }
+}
+
+template<class SketchT, class UpdateRecord>
+StaticUpdater<UpdateRecord>
+make_static_updater(
+    IPersistentSketch *sketch)
+{
+    if constexpr (std::is_base_of<
+            typename UpdateRecordTraits<UpdateRecord>::sketch_interface,
+            SketchT>::value)
+    {
+        SketchT *s = dynamic_cast<SketchT*>(sketch);
+        if (s)
+        {
+            return StaticUpdater<UpdateRecord>{
+                s, &static_update_batch<SketchT, UpdateRecord>};
+        }
+    }
+
+    return StaticUpdater<UpdateRecord>{nullptr, nullptr};
+}
+
+} // anonymous namespace
+
+template<class UpdateRecord>
+StaticUpdater<UpdateRecord>
+get_static_updater(
+    SKETCH_TYPE st,
+    IPersistentSketch *sketch)
+{
+    switch (st)
+    {
+#   define DEFINE_SKETCH_TYPE(stname, clsname, _3) \
+    case ST_LITERAL(stname): \
+        return make_static_updater<clsname, UpdateRecord>(sketch);
+#   include "sketch_list.h"
+#   undef DEFINE_SKETCH_TYPE
+    }
+
+    return StaticUpdater<UpdateRecord>{nullptr, nullptr};
+}
+
+template StaticUpdater<UpdateRecord_u32>
+get_static_updater<UpdateRecord_u32>(
+    SKETCH_TYPE st,
+    IPersistentSketch *sketch);
+
+template StaticUpdater<UpdateRecord_dvec>
+get_static_updater<UpdateRecord_dvec>(
+    SKETCH_TYPE st,
+    IPersistentSketch *sketch);
+#endif // STATIC_SKETCH_DISPATCH
@@ -17,6 +17,24 @@ typedef unsigned long long TIMESTAMP;
 using std::uint32_t;
 using std::uint64_t;
 
+// Records for the batched update interfaces. A batch is a contiguous span
+// of updates in the order they arrive, i.e., with non-decreasing timestamps.
+struct UpdateRecord_u32
+{
+    TIMESTAMP       m_ts;
+
+    uint32_t        m_value;
+
+    int             m_c;
+};
+
+struct UpdateRecord_dvec
+{
+    TIMESTAMP       m_ts;
+
+    const double    *m_dvec;
+};
+
 
 /*
  * Note: ts > 0, following the notation in Wei et al. (Persistent Data Sketching)
@@ -43,6 +61,12 @@ struct IPersistentSketch
     virtual std::string
     get_short_description() const = 0;
 
+    // override IPersistentSketch::get_extra_stats() to report
+    // sketch-specific statistics (e.g., cache hit counts) in the stats
+    // output. Empty if there's none.
+    virtual std::string
+    get_extra_stats() const { return std::string(); }
+
     static int num_configs_defined() { return -1; }
 };
 
@@ -63,6 +87,17 @@ struct IPersistentSketch_u32:
     // if it's needed in the test
     virtual void
     update(TIMESTAMP ts, uint32_t value, int c = 1) = 0;
+
+    // Equivalent to calling update() on each record in order. Override it
+    // if the per-record cost can be amortized across a batch.
+    virtual void
+    update_batch(const UpdateRecord_u32 *records, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            update(records[i].m_ts, records[i].m_value, records[i].m_c);
+        }
+    }
 };
 
 struct IPersistentSketch_dvec:
@@ -74,6 +109,17 @@ struct IPersistentSketch_dvec:
     //       sketch
     virtual void
     update(TIMESTAMP ts, const double *dvec) = 0;
+
+    // Equivalent to calling update() on each record in order. Override it
+    // if the per-record cost can be amortized across a batch.
+    virtual void
+    update_batch(const UpdateRecord_dvec *records, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            update(records[i].m_ts, records[i].m_dvec);
+        }
+    }
 };
 
 struct IPersistentPointQueryable:
@@ -147,6 +193,22 @@ struct IPersistentFrequencyEstimationSketch:
     estimate_frequency(
         TIMESTAMP ts_e,
         uint32_t key) const = 0;
+
+    // Estimates the frequencies of keys[0..n) at ts_e into cnts[0..n).
+    // Equivalent to calling estimate_frequency() on each key. Override it if
+    // the per-key cost can be amortized across the keys.
+    virtual void
+    estimate_frequency_batch(
+        TIMESTAMP ts_e,
+        const uint32_t *keys,
+        size_t n,
+        uint64_t *cnts) const
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            cnts[i] = estimate_frequency(ts_e, keys[i]);
+        }
+    }
 };
 
 struct IPersistentFrequencyEstimationSketchBITP:
@@ -158,6 +220,21 @@ struct IPersistentFrequencyEstimationSketchBITP:
     estimate_frequency_bitp(
         TIMESTAMP ts_s,
         uint32_t key) const = 0;
+
+    // Same as IPersistentFrequencyEstimationSketch::estimate_frequency_batch()
+    // except for estimate_frequency_bitp().
+    virtual void
+    estimate_frequency_bitp_batch(
+        TIMESTAMP ts_s,
+        const uint32_t *keys,
+        size_t n,
+        uint64_t *cnts) const
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            cnts[i] = estimate_frequency_bitp(ts_s, keys[i]);
+        }
+    }
 };
 
 struct IPersistentMatrixSketch:
@@ -189,5 +266,52 @@ std::vector<IPersistentSketch*>
 create_persistent_sketch_from_config(
     SKETCH_TYPE st);
 
+#ifdef STATIC_SKETCH_DISPATCH
+// Static dispatch mode (./configure --enable-static-dispatch)
+//
+// A StaticUpdater applies a batch of updates to a sketch through a function
+// instantiated for its concrete type from the registry in sketch_list.h.
+// Updates are applied with qualified, non-virtual calls to the concrete
+// class's update_batch() or update(), so there is no vtable lookup or
+// virtual base adjustment per record.
+template<class UpdateRecord>
+struct StaticUpdater
+{
+    typedef UpdateRecord    record_type;
+
+    void                    *m_sketch; // points to the concrete type
+
+    void                    (*m_update_batch_fn)(
+                                void *sketch,
+                                const UpdateRecord *records,
+                                size_t n);
+
+    bool
+    is_valid() const
+    {
+        return m_update_batch_fn != nullptr;
+    }
+
+    void
+    update_batch(
+        const UpdateRecord *records,
+        size_t n) const
+    {
+        m_update_batch_fn(m_sketch, records, n);
+    }
+};
+
+typedef StaticUpdater<UpdateRecord_u32> StaticUpdater_u32;
+typedef StaticUpdater<UpdateRecord_dvec> StaticUpdater_dvec;
+
+// Returns an invalid updater if sketch is not of type st or st does not
+// accept updates of the given record type.
+template<class UpdateRecord>
+StaticUpdater<UpdateRecord>
+get_static_updater(
+    SKETCH_TYPE st,
+    IPersistentSketch *sketch);
+#endif // STATIC_SKETCH_DISPATCH
+
 #endif // SKETCH_H
 
@@ -33,6 +33,7 @@ DEFINE_SKETCH_TYPE(PCM_HH, HeavyHitters, PCM_based_heavy_hitters)
 #ifndef ST_REQUIRE_CREATE
 DEFINE_SKETCH_TYPE(CMG, ChainMisraGries, chain_misra_gries)
 DEFINE_SKETCH_TYPE(TMG, TreeMisraGries, tree_misra_gries)
+DEFINE_SKETCH_TYPE(SMG, ShardedMisraGries, sharded_misra_gries)
 DEFINE_SKETCH_TYPE(DUMMY_PMG, DummyPersistentMisraGries, dummy_persistent_misra_gries)
 DEFINE_SKETCH_TYPE(TMG_BITP, TreeMisraGriesBITP, tree_misra_gries_bitp)
 DEFINE_SKETCH_TYPE(SAMPLING_BITP, SamplingSketchBITP, persistent_sampling_sketch_bitp)
@@ -0,0 +1,133 @@
+#include <iostream>
+#include <map>
+#include <random>
+#include <vector>
+#include "flat_hash_map.h"
+
+using namespace std;
+
+typedef FlatHashMap<uint64_t, int> map_t;
+
+bool same_entries(const map_t &m, const map<uint64_t, int> &ref) {
+    if (m.size() != ref.size()) return false;
+    size_t n = 0;
+    for (auto kv: m) {
+        auto iter = ref.find(kv.first);
+        if (iter == ref.end() || iter->second != kv.second) return false;
+        ++n;
+    }
+    return n == ref.size();
+}
+
+// Erases every even key while iterating from begin(). Each entry must be
+// visited exactly once.
+bool test_erase_while_iterating() {
+    map_t m;
+    map<uint64_t, int> ref;
+    for (uint64_t i = 0; i < 1000; ++i) {
+        m[i * 7919] = (int) i;
+        ref[i * 7919] = (int) i;
+    }
+
+    map<uint64_t, int> visited;
+    for (auto iter = m.begin(); iter != m.end(); ) {
+        ++visited[iter->first];
+        if (iter->second % 2 == 0) {
+            ref.erase(iter->first);
+            iter = m.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+
+    bool pass = visited.size() == 1000;
+    for (auto kv: visited) {
+        if (kv.second != 1) pass = false;
+    }
+    pass = pass && same_entries(m, ref);
+    cout << "Erase while iterating: " << (pass ? "Pass!" : "Failed!") << endl;
+    return pass;
+}
+
+// Mirrors FlatHashMap::home_slot() for a table with 2^log_cap slots.
+uint64_t home_slot(uint64_t key, unsigned log_cap) {
+    uint64_t h = key * 0x9E3779B97F4A7C15ull;
+    h = (h ^ (h >> 32)) * 0x9E3779B97F4A7C15ull;
+    return h >> (64 - log_cap);
+}
+
+// Keys homed at the last slot of a 16-slot table wrap around to slots
+// 0, 1, 2, ... Lookups, erasing (which shifts entries back across the end)
+// and iteration must all handle the wrap.
+bool test_wrap_around() {
+    vector<uint64_t> keys;
+    for (uint64_t key = 1; keys.size() < 5; ++key) {
+        if (home_slot(key, 4) == 15) keys.push_back(key);
+    }
+
+    map_t m;
+    m.reserve(8);
+    bool pass = m.capacity() == 16;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        m[keys[i]] = (int) i;
+    }
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto iter = m.find(keys[i]);
+        if (iter == m.end() || iter->second != (int) i) pass = false;
+    }
+
+    // the entries occupy slots 15, 0, 1, 2, 3 and iteration starts after
+    // the first empty slot, so they are visited in insertion order
+    size_t i = 0;
+    for (auto kv: m) {
+        if (i >= keys.size() || kv.first != keys[i]) pass = false;
+        ++i;
+    }
+    pass = pass && i == keys.size();
+
+    // erasing the entry in slot 15 shifts the others back across the end
+    m.erase(keys[0]);
+    for (size_t i = 1; i < keys.size(); ++i) {
+        auto iter = m.find(keys[i]);
+        if (iter == m.end() || iter->second != (int) i) pass = false;
+    }
+    pass = pass && m.count(keys[0]) == 0 && m.size() == keys.size() - 1;
+
+    // erase while iterating across the wrap
+    for (auto iter = m.begin(); iter != m.end(); ) {
+        iter = m.erase(iter);
+    }
+    pass = pass && m.empty() && m.begin() == m.end();
+    cout << "Wrap-around probing: " << (pass ? "Pass!" : "Failed!") << endl;
+    return pass;
+}
+
+// Random inserts and erases at high load factors in small tables, checked
+// against std::map.
+bool test_random_ops() {
+    mt19937_64 rgen(12345);
+    bool pass = true;
+    for (int round = 0; round < 2000 && pass; ++round) {
+        map_t m;
+        map<uint64_t, int> ref;
+        for (int op = 0; op < 64; ++op) {
+            uint64_t key = rgen() % 24;
+            if (rgen() % 3 == 0) {
+                if (m.erase(key) != ref.erase(key)) pass = false;
+            } else {
+                m[key] += op;
+                ref[key] += op;
+            }
+        }
+        pass = pass && same_entries(m, ref);
+    }
+    cout << "Random operations: " << (pass ? "Pass!" : "Failed!") << endl;
+    return pass;
+}
+
+int main(int argc, char **argv) {
+    bool pass = test_erase_while_iterating();
+    pass = test_wrap_around() && pass;
+    pass = test_random_ops() && pass;
+    return pass ? 0 : 1;
+}
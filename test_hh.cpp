@@ -1,10 +1,25 @@
 #include <iostream>
 #include <cstring>
 #include <vector>
+#include <algorithm>
 #include "heavyhitters.h"
 
 using namespace std;
 
+// Keys of more than logUniverseSize bits (e.g., IPv4 addresses with
+// logU = 23) must not write past the cells of the exact top levels.
+bool test_keys_out_of_universe() {
+  HeavyHitters hh(23, 0.01, 0.05, 50);
+  for (uint32_t i = 0; i < 20000; i++) {
+	  hh.update(i / 100 + 1, 0xC0A80000u + i * 2654435761u % 4096, 1);
+	  hh.update(i / 100 + 1, 12345, 1);
+  }
+  auto res = hh.query_hh(200, 10000);
+  bool pass = std::find(res.begin(), res.end(), 12345u) != res.end();
+  cout << "Keys out of universe: " << (pass ? "Pass!" : "Failed!") << endl;
+  return pass;
+}
+
 int main(int argc, char **argv) {
 
   HeavyHitters hh(3);
@@ -20,5 +35,9 @@ int main(int argc, char **argv) {
 	  cout << x << endl;
   }
 
+  if (!test_keys_out_of_universe()) {
+	  return 1;
+  }
+
   return 0;
 }
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <cstring>
+#include <vector>
 #include "pams.h"
 
 using namespace std;
@@ -26,6 +27,44 @@ void pams_test(PAMSketch *pams, const char *str, int begin, int end) {
     cout << str << "[" << begin << "," << end << "]:\tEst: " << pams->estimate_point_in_interval(str, begin, end) << "\tTruth: " << count(begin, end, str) << endl; 
 }
 
+// update_batch() must sample the same updates as update() regardless of
+// the batch size, so both sketches answer every query the same.
+bool test_batch_matches_single_updates() {
+  std::vector<UpdateRecord_u32> records;
+  for (uint32_t i = 0; i < 20000; i++) {
+      records.push_back(UpdateRecord_u32{i / 10 + 1,
+          (i * 2654435761u) % 97 + (i % 3 == 0 ? 0 : 1000), (int)(i % 4) + 1});
+  }
+
+  PAMSketch single(0.01, 0.05, 50);
+  for (const UpdateRecord_u32 &r : records) {
+      single.update(r.m_ts, r.m_value, r.m_c);
+  }
+
+  bool pass = true;
+  for (size_t batch_size : {1, 7, 256, 20000}) {
+      PAMSketch batch(0.01, 0.05, 50);
+      for (size_t i = 0; i < records.size(); i += batch_size) {
+          batch.update_batch(&records[i],
+              std::min(batch_size, records.size() - i));
+      }
+
+      for (TIMESTAMP ts = 1; ts <= 2001; ts += 50) {
+          for (uint32_t key = 0; key < 1100; key++) {
+              if (single.estimate_frequency(ts, key) !=
+                      batch.estimate_frequency(ts, key) ||
+                  single.estimate_frequency_bitp(ts, key) !=
+                      batch.estimate_frequency_bitp(ts, key)) {
+                  pass = false;
+              }
+          }
+      }
+  }
+  cout << "Batch updates match single updates: "
+      << (pass ? "Pass!" : "Failed!") << endl;
+  return pass;
+}
+
 int main(int argc, char **argv) {
 
   double epsilon = 0.01;
@@ -43,5 +82,9 @@ int main(int argc, char **argv) {
   pams_test(&pams, "lady", 0, 4);
   pams_test(&pams, "lady", 6, 16);
 
+  if (!test_batch_matches_single_updates()) {
+      return 1;
+  }
+
   return 0;
 }
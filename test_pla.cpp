@@ -1,5 +1,6 @@
 #include "pla.h"
 #include <iostream>
+#include <random>
 using namespace std;
 
 void test() {
@@ -54,6 +55,103 @@ void test() {
     }
 }
 
+// PLAArray should produce the same segments as one PLA per cell, including
+// for repeated timestamps, and estimates within the float32 error allowed for
+// its compressed segments.
+void test_pla_array(PLAMode mode) {
+    const size_t num_cells = 37;
+    const unsigned long long max_ts = 20000;
+    vector<PLA> plas(num_cells, PLA(1.0, mode));
+    PLAArray pla_array(num_cells, 1.0, mode);
+    vector<double> cnt(num_cells, 0);
+
+    mt19937 rgen(19950810u);
+    uniform_int_distribution<size_t> cell_dist(0, num_cells - 1);
+    uniform_int_distribution<int> ts_inc_dist(0, 2);
+    unsigned long long ts = 1;
+    while (ts < max_ts) {
+        size_t i = cell_dist(rgen);
+        cnt[i] += 1;
+        plas[i].feed({ts, cnt[i]});
+        pla_array.feed(i, {ts, cnt[i]});
+        ts += ts_inc_dist(rgen);
+    }
+
+    auto pass = true;
+    for (size_t i = 0; i < num_cells && pass; ++i) {
+        if (plas[i].result.size() != pla_array.num_segments(i)) {
+            cout << "Failed! cell " << i << " has " << pla_array.num_segments(i)
+                << " segments instead of " << plas[i].result.size() << endl;
+            pass = false;
+            break;
+        }
+        for (unsigned long long t = 0; t <= max_ts + 1; ++t) {
+            double expected = plas[i].estimate(t);
+            if (abs(expected - pla_array.estimate(i, t)) >
+                    1.0 / 256 + 1e-9 * max(1.0, abs(expected))) {
+                cout << "Failed! cell " << i << " at " << t << ": "
+                    << pla_array.estimate(i, t) << " instead of "
+                    << plas[i].estimate(t) << endl;
+                pass = false;
+                break;
+            }
+        }
+    }
+    if (pass) {
+        cout << "Pass!" << endl;
+    }
+}
+
+// The optimal PLA should stay within the tolerance at the last point of every
+// timestamp and never use more segments than the swing PLA.
+void test_optimal_pla() {
+    const double tolerance = 2.0;
+    const unsigned long long max_ts = 100000;
+    PLA swing(tolerance, PLA_SWING);
+    PLA optimal(tolerance, PLA_OPTIMAL);
+    vector<PLA::point> last_points;
+
+    mt19937 rgen(19950810u);
+    uniform_int_distribution<int> ts_inc_dist(0, 3);
+    uniform_int_distribution<int> cnt_dist(-1, 3);
+    unsigned long long ts = 1;
+    double cnt = 0;
+    while (ts < max_ts) {
+        cnt += cnt_dist(rgen);
+        swing.feed({ts, cnt});
+        optimal.feed({ts, cnt});
+        if (!last_points.empty() && last_points.back().x == ts) {
+            last_points.back().y = cnt;
+        } else {
+            last_points.push_back({ts, cnt});
+        }
+        ts += ts_inc_dist(rgen);
+    }
+
+    auto pass = true;
+    for (const PLA::point &pt: last_points) {
+        double est = optimal.estimate(pt.x);
+        if (abs(est - pt.y) > tolerance + 1e-6) {
+            cout << "Failed! estimate at " << pt.x << " is " << est
+                << " instead of " << pt.y << endl;
+            pass = false;
+            break;
+        }
+    }
+    if (pass && optimal.result.size() > swing.result.size()) {
+        cout << "Failed! optimal PLA has " << optimal.result.size()
+            << " segments but swing PLA has " << swing.result.size() << endl;
+        pass = false;
+    }
+    if (pass) {
+        cout << "Pass! (" << optimal.result.size() << " optimal vs "
+            << swing.result.size() << " swing segments)" << endl;
+    }
+}
+
 int main() {
     test();
+    test_pla_array(PLA_SWING);
+    test_pla_array(PLA_OPTIMAL);
+    test_optimal_pla();
 }
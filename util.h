@@ -4,6 +4,7 @@
 #include <cmath>
 #include <cerrno>
 #include <cstring>
+#include <algorithm>
 #include "MurmurHash3.h"
 
 #define STRINGIFY_HELPER(_1) #_1
@@ -150,6 +151,104 @@ private:
     T *m_t;
 };
 
+// Sorts vals[0..n) and returns their median. n must be positive.
+inline double sort_and_get_median(double *vals, unsigned n)
+{
+    std::sort(vals, vals + n);
+    if (n & 1)
+    {
+        return vals[n / 2];
+    }
+    return (vals[n / 2] + vals[n / 2 - 1]) / 2.;
+}
+
+// The median of vals[0..N) by sorting a copy with an odd-even transposition
+// network, which is unrolled into min and max without branches.
+template<unsigned N>
+inline double get_median_by_network(const double *vals)
+{
+    double tmp[N];
+    std::copy(vals, vals + N, tmp);
+    for (unsigned pass = 0; pass < N; ++pass)
+    {
+        for (unsigned i = pass & 1; i + 1 < N; i += 2)
+        {
+            double a = tmp[i];
+            double b = tmp[i + 1];
+            tmp[i] = std::min(a, b);
+            tmp[i + 1] = std::max(a, b);
+        }
+    }
+    if (N & 1)
+    {
+        return tmp[N / 2];
+    }
+    return (tmp[N / 2] + tmp[N / 2 - 1]) / 2.;
+}
+
+// Returns the median of vals[0..n), which may be reordered. n must be
+// positive. std::sort of a few values in random order mispredicts most of
+// its branches, so small n go through a sorting network instead.
+inline double get_median(double *vals, unsigned n)
+{
+    switch (n)
+    {
+    case 1: return vals[0];
+    case 2: return get_median_by_network<2>(vals);
+    case 3: return get_median_by_network<3>(vals);
+    case 4: return get_median_by_network<4>(vals);
+    case 5: return get_median_by_network<5>(vals);
+    case 6: return get_median_by_network<6>(vals);
+    case 7: return get_median_by_network<7>(vals);
+    case 8: return get_median_by_network<8>(vals);
+    }
+    return sort_and_get_median(vals, n);
+}
+
+// A counter-based generator: the i-th draw is the SplitMix64 finalizer of
+// key + i * golden_gamma. It is much cheaper than std::mt19937 and its whole
+// state is the key and the counter.
+class CounterRNG {
+public:
+    CounterRNG(uint64_t key = 0): m_key(key), m_ctr(0) {}
+
+    void seed(uint64_t key) {
+        m_key = key;
+        m_ctr = 0;
+    }
+
+    uint64_t operator()() {
+        return mix(m_key + (++m_ctr) * golden_gamma);
+    }
+
+    // uniform in (0, 1]
+    double next_double_oc() {
+        return (double)(((*this)() >> 11) + 1) * 0x1.0p-53;
+    }
+
+    static uint64_t mix(uint64_t z) {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+private:
+    static constexpr uint64_t golden_gamma = 0x9e3779b97f4a7c15ull;
+
+    uint64_t m_key;
+
+    uint64_t m_ctr;
+};
+
+// Returns the number of failures before the first success in independent
+// Bernoulli(p) trials, given u uniform in (0, 1] and log1m_p = log(1 - p).
+// Returns UINT64_MAX if that is too large to represent (e.g., p = 0).
+inline uint64_t geometric_skip(double u, double log1m_p)
+{
+    double k = std::floor(std::log(u) / log1m_p);
+    return (k < 18446744073709551616.0) ? (uint64_t) k : ~(uint64_t) 0;
+}
+
 inline uint64_t str_hash(const char *str)
 {
     size_t len = strlen(str);